@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# compare.sh - Compare two load test result files from bench/run.sh
+#
+# Usage: bench/compare.sh OLD.tsv NEW.tsv
+#
+# Prints each MPM and scenario found in both files with the new value
+# and its change from the old one. Higher is better for requests/sec;
+# lower is better for latency, CPU time and memory.
+
+set -eu
+
+[ $# -eq 2 ] || { echo "usage: compare.sh OLD.tsv NEW.tsv" >&2; exit 2; }
+
+awk -F '\t' '
+function change(old, new) {
+    return old > 0 ? sprintf("%+.1f%%", (new - old) * 100 / old) : "-"
+}
+
+/^#/ {
+    if (FNR == 1) label[FILENAME == ARGV[1] ? "old" : "new"] = substr($0, 10)
+    next
+}
+
+$1 == "mpm" {
+    for (i = 1; i <= NF; i++) column[$i] = i
+    next
+}
+
+FILENAME == ARGV[1] {
+    old[$1 "/" $2] = $0
+    next
+}
+
+($1 "/" $2) in old {
+    split(old[$1 "/" $2], o, "\t")
+    if (!header++) {
+        printf "%s -> %s\n\n", label["old"], label["new"]
+        printf "%-16s %18s %18s %18s %18s %18s %18s\n", "mpm/scenario",
+               "requests/sec", "p50 ms", "p99 ms", "p999 ms", "cpu us/req", "rss kB/child"
+    }
+    printf "%-16s", $1 "/" $2
+    printf " %9.1f %8s", $column["rps"], change(o[column["rps"]], $column["rps"])
+    printf " %9.2f %8s", $column["p50_us"] / 1000, change(o[column["p50_us"]], $column["p50_us"])
+    printf " %9.2f %8s", $column["p99_us"] / 1000, change(o[column["p99_us"]], $column["p99_us"])
+    printf " %9.2f %8s", $column["p999_us"] / 1000, change(o[column["p999_us"]], $column["p999_us"])
+    printf " %9d %8s", $column["cpu_us_per_req"], change(o[column["cpu_us_per_req"]], $column["cpu_us_per_req"])
+    printf " %9d %8s\n", $column["rss_kb_per_child"], change(o[column["rss_kb_per_child"]], $column["rss_kb_per_child"])
+}
+
+END {
+    if (!header) {
+        print "compare.sh: no MPM and scenario in common" > "/dev/stderr"
+        exit 1
+    }
+}
+' "$1" "$2"
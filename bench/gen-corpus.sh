@@ -0,0 +1,113 @@
+#!/bin/sh
+#
+# gen-corpus.sh - Generate a synthetic Gemini capsule for the load test
+#
+# Usage: bench/gen-corpus.sh DIR [COUNT] [SEED]
+#
+# Writes DIR/index.gmi, COUNT pages under DIR/notes/ and DIR/urls.txt
+# (the URL paths for gmi2html-load, relative to DIR). Pages are mostly
+# small, with some medium and a few large ones, and contain every line
+# type plus links to other pages. The same COUNT and SEED always give
+# the same corpus, so results from different releases are comparable.
+
+set -eu
+
+dir=${1:?usage: gen-corpus.sh DIR [COUNT] [SEED]}
+count=${2:-200}
+seed=${3:-1}
+
+mkdir -p "$dir/notes"
+
+awk -v dir="$dir" -v count="$count" -v seed="$seed" '
+function word() {
+    return words[int(rand() * nwords) + 1]
+}
+
+function sentence(n,    s, i) {
+    s = word()
+    s = toupper(substr(s, 1, 1)) substr(s, 2)
+    for (i = 1; i < n; i++) {
+        r = rand()
+        if (r < 0.03) s = s " `" word() "`"
+        else if (r < 0.05) s = s " **" word() "**"
+        else s = s " " word()
+    }
+    return s "."
+}
+
+function paragraph(    s, i, n) {
+    n = 2 + int(rand() * 5)
+    s = sentence(6 + int(rand() * 14))
+    for (i = 1; i < n; i++) s = s " " sentence(6 + int(rand() * 14))
+    return s
+}
+
+function page(file, num, paras,    i, r, j) {
+    print "# Note " num ": " word() " " word() > file
+    print "" > file
+    for (i = 1; i <= paras; i++) {
+        r = rand()
+        if (i > 1 && r < 0.08) {
+            print "" > file
+            print "## " sentence(3 + int(rand() * 4)) > file
+            print "" > file
+        } else if (r < 0.10) {
+            print "### " sentence(2 + int(rand() * 4)) > file
+        }
+        r = rand()
+        if (r < 0.70) {
+            print paragraph() > file
+        } else if (r < 0.80) {
+            for (j = 0; j < 2 + int(rand() * 5); j++) print "* " sentence(3 + int(rand() * 8)) > file
+        } else if (r < 0.87) {
+            print "> " paragraph() > file
+        } else if (r < 0.95) {
+            for (j = 0; j < 1 + int(rand() * 3); j++) {
+                printf "=> %04d.gmi %s\n", int(rand() * count) + 1, sentence(2 + int(rand() * 5)) > file
+            }
+            if (rand() < 0.3) print "=> https://example.com/" word() " " sentence(3) > file
+        } else {
+            print "```" word() > file
+            for (j = 0; j < 3 + int(rand() * 12); j++) {
+                printf "    %s(%s, %d);\n", word(), word(), int(rand() * 1000) > file
+            }
+            print "```" > file
+        }
+        if (rand() < 0.6) print "" > file
+    }
+    close(file)
+}
+
+BEGIN {
+    srand(seed)
+    nwords = split("gemini capsule protocol request response server client " \
+        "document heading paragraph link quote list preformatted text line " \
+        "module apache handler render cache stylesheet markup browser reader " \
+        "network socket latency throughput request thread process memory " \
+        "small web simple quiet garden archive journal entry notes draft " \
+        "river mountain lantern harbor meadow signal compass kettle orchard " \
+        "the a of and to in is that for it with as on was by at from", words, " ")
+
+    index_file = dir "/index.gmi"
+    urls = dir "/urls.txt"
+    print "# Benchmark capsule" > index_file
+    print "" > index_file
+    print "/index.gmi" > urls
+
+    for (n = 1; n <= count; n++) {
+        r = rand()
+        if (r < 0.70) paras = 10 + int(rand() * 30)
+        else if (r < 0.95) paras = 100 + int(rand() * 300)
+        else paras = 1500 + int(rand() * 1500)
+
+        name = sprintf("%04d.gmi", n)
+        page(dir "/notes/" name, n, paras)
+        printf "=> notes/%s Note %d\n", name, n > index_file
+        print "/notes/" name > urls
+    }
+    close(index_file)
+    close(urls)
+}
+'
+
+echo "gen-corpus.sh: $count pages in $dir ($(du -sh "$dir" | cut -f1))"
@@ -0,0 +1,283 @@
+#!/bin/sh
+#
+# run.sh - End-to-end load test of mod_gmi2html inside a throwaway httpd
+#
+# For each MPM and scenario, starts httpd on a private config with the
+# module loaded, drives it with gmi2html-load over a generated capsule,
+# and records requests/sec, latency percentiles, CPU time per request
+# and resident memory per child in bench/results/<label>.tsv. Compare
+# two result files with bench/compare.sh.
+#
+# Run it from the top of the tree (make loadtest). Settings come from
+# the environment:
+#
+#   HTTPD        httpd binary (default: httpd or apache2 on PATH)
+#   MODULES_DIR  directory with the MPM modules (default: from apxs)
+#   MODULE       mod_gmi2html.so to load (default: ./mod_gmi2html.so)
+#   LOADGEN      load generator (default: ./gmi2html-load)
+#   MPMS         MPMs to test (default: "prefork worker event")
+#   SCENARIOS    scenarios to test (default: "builtin styled cached")
+#   CONNECTIONS  concurrent connections (default: 16)
+#   DURATION     measured seconds per run (default: 10)
+#   WARMUP       unmeasured seconds per run (default: 2)
+#   PAGES        pages in the generated capsule (default: 200)
+#   PORT         port to listen on (default: 18080)
+#   LABEL        name of the results file (default: git describe)
+#   RESULTS_DIR  where results are written (default: bench/results)
+#
+# Scenarios:
+#   builtin  built-in stylesheet, converted on every request
+#   styled   Gmi2HtmlStylesheet and Gmi2HtmlHead, converted on every request
+#   cached   as styled, with Gmi2HtmlCacheRoot
+
+set -eu
+
+top=$(pwd)
+bench=$(cd "$(dirname "$0")" && pwd)
+
+HTTPD=${HTTPD:-$(command -v httpd || command -v apache2 || command -v /usr/sbin/apache2 || true)}
+MODULE=${MODULE:-$top/mod_gmi2html.so}
+LOADGEN=${LOADGEN:-$top/gmi2html-load}
+MPMS=${MPMS:-prefork worker event}
+SCENARIOS=${SCENARIOS:-builtin styled cached}
+CONNECTIONS=${CONNECTIONS:-16}
+DURATION=${DURATION:-10}
+WARMUP=${WARMUP:-2}
+PAGES=${PAGES:-200}
+PORT=${PORT:-18080}
+LABEL=${LABEL:-$(git -C "$bench" describe --always --dirty 2>/dev/null || echo unversioned)}
+RESULTS_DIR=${RESULTS_DIR:-$bench/results}
+THREADS_PER_CHILD=8
+
+die() {
+    echo "run.sh: $*" >&2
+    exit 1
+}
+
+[ -n "$HTTPD" ] && [ -x "$HTTPD" ] || die "httpd not found; set HTTPD"
+[ -f "$MODULE" ] || die "$MODULE not found; run make first"
+[ -x "$LOADGEN" ] || die "$LOADGEN not found; run make loadgen first"
+
+if [ -z "${MODULES_DIR:-}" ]; then
+    MODULES_DIR=$( (apxs -q LIBEXECDIR || apxs2 -q LIBEXECDIR) 2>/dev/null || true)
+fi
+if [ -z "$MODULES_DIR" ]; then
+    for dir in /usr/lib/apache2/modules /usr/lib64/httpd/modules /usr/lib/httpd/modules \
+               /usr/local/apache2/modules; do
+        if [ -d "$dir" ]; then
+            MODULES_DIR=$dir
+            break
+        fi
+    done
+fi
+
+for scenario in $SCENARIOS; do
+    case $scenario in
+        builtin|styled|cached) ;;
+        *) die "unknown scenario $scenario" ;;
+    esac
+done
+
+case $MODULE in /*) ;; *) MODULE=$top/$MODULE ;; esac
+
+work=$(mktemp -d "${TMPDIR:-/tmp}/gmi2html-bench.XXXXXX")
+chmod 755 "$work"
+conf=$work/httpd.conf
+pidfile=$work/httpd.pid
+errorlog=$work/error.log
+
+stop_httpd() {
+    if [ -f "$pidfile" ]; then
+        "$HTTPD" -f "$conf" -k stop 2>/dev/null || kill "$(cat "$pidfile")" 2>/dev/null || true
+        for _ in $(seq 50); do
+            [ -f "$pidfile" ] && kill -0 "$(cat "$pidfile")" 2>/dev/null || break
+            sleep 0.2
+        done
+        rm -f "$pidfile"
+    fi
+}
+trap 'stop_httpd; rm -rf "$work"' EXIT
+trap 'exit 1' INT TERM
+
+compiled_in=$("$HTTPD" -l 2>/dev/null || true)
+
+# LoadModule line for a module unless it is compiled in (as $3.c, default
+# $2.c); fails if it is missing
+load_module() {
+    case $compiled_in in *" ${3:-$2}.c"*) return 0 ;; esac
+    [ -f "$MODULES_DIR/$2.so" ] || return 1
+    echo "LoadModule $1 $MODULES_DIR/$2.so"
+}
+
+# Process IDs of the httpd parent and its children
+httpd_pids() {
+    parent=$(cat "$pidfile")
+    echo "$parent"
+    for stat in /proc/[0-9]*/stat; do
+        { read -r line < "$stat"; } 2>/dev/null || continue
+        set -- ${line##*) }
+        [ "$2" = "$parent" ] && echo "${line%% *}"
+    done
+    return 0
+}
+
+# Total user and system CPU time of httpd so far, in clock ticks
+cpu_ticks() {
+    for pid in $(httpd_pids); do
+        sed 's/.*) //' "/proc/$pid/stat" 2>/dev/null || true
+    done | awk '{ ticks += $12 + $13 } END { print ticks + 0 }'
+}
+
+# Mean and largest resident set size of the children, in kB
+child_rss() {
+    parent=$(cat "$pidfile")
+    for pid in $(httpd_pids); do
+        [ "$pid" = "$parent" ] || awk '/^VmRSS:/ { print $2 }' "/proc/$pid/status" 2>/dev/null || true
+    done | awk '{ sum += $1; if ($1 > max) max = $1; n++ } END { printf "%.0f %d\n", n ? sum / n : 0, max }'
+}
+
+mpm_config() {
+    case $1 in
+        prefork)
+            cat <<CONF
+StartServers $CONNECTIONS
+MinSpareServers 1
+MaxSpareServers $CONNECTIONS
+ServerLimit $CONNECTIONS
+MaxRequestWorkers $CONNECTIONS
+CONF
+            ;;
+        worker|event)
+            servers=$(( (CONNECTIONS + THREADS_PER_CHILD - 1) / THREADS_PER_CHILD ))
+            cat <<CONF
+StartServers $servers
+ServerLimit $servers
+ThreadsPerChild $THREADS_PER_CHILD
+MinSpareThreads $THREADS_PER_CHILD
+MaxSpareThreads $(( servers * THREADS_PER_CHILD ))
+MaxRequestWorkers $(( servers * THREADS_PER_CHILD ))
+CONF
+            ;;
+    esac
+}
+
+scenario_config() {
+    case $1 in
+        builtin) ;;
+        styled)
+            echo "Gmi2HtmlStylesheet $top/examples/default-stylesheet.css"
+            echo "Gmi2HtmlHead $top/examples/head-complete.html"
+            ;;
+        cached)
+            scenario_config styled
+            echo "Gmi2HtmlCacheRoot $work/cache"
+            ;;
+    esac
+}
+
+# Write the httpd config for one MPM and scenario
+write_config() {
+    {
+        load_module "mpm_$1_module" "mod_mpm_$1" "$1"
+        load_module authz_core_module mod_authz_core || true
+        if [ "$(id -u)" = 0 ]; then
+            load_module unixd_module mod_unixd || true
+            echo "User nobody"
+            echo "Group $(id -gn nobody)"
+        fi
+        cat <<CONF
+LoadModule gmi2html_module $MODULE
+
+ServerRoot $work
+ServerName localhost
+Listen 127.0.0.1:$PORT
+PidFile $pidfile
+ErrorLog $errorlog
+LogLevel notice
+DocumentRoot $work/capsule
+KeepAlive On
+MaxKeepAliveRequests 0
+KeepAliveTimeout 5
+MaxConnectionsPerChild 0
+
+$(mpm_config "$1")
+
+$(scenario_config "$2")
+
+<Directory $work/capsule>
+    <IfModule authz_core_module>
+        Require all granted
+    </IfModule>
+    Gmi2HtmlEnabled on
+    <FilesMatch "\.gmi\$">
+        SetHandler gmi2html
+    </FilesMatch>
+</Directory>
+CONF
+    } > "$conf"
+}
+
+start_httpd() {
+    : > "$errorlog"
+    "$HTTPD" -f "$conf" -k start || return 1
+    for _ in $(seq 50); do
+        grep -q "resuming normal operations" "$errorlog" 2>/dev/null && [ -f "$pidfile" ] && return 0
+        sleep 0.2
+    done
+    cat "$errorlog" >&2
+    return 1
+}
+
+"$bench/gen-corpus.sh" "$work/capsule" "$PAGES" >&2
+mkdir -p "$RESULTS_DIR"
+results=$RESULTS_DIR/$LABEL.tsv
+ticks_per_sec=$(getconf CLK_TCK)
+version=$("$HTTPD" -v 2>/dev/null | sed -n 's/^Server version: //p')
+cpu=$(sed -n 's/^model name[^:]*: //p' /proc/cpuinfo 2>/dev/null | head -1)
+
+{
+    echo "# label: $LABEL"
+    echo "# date: $(date -u +%Y-%m-%dT%H:%M:%SZ)"
+    echo "# httpd: $version"
+    echo "# cpu: $cpu ($(getconf _NPROCESSORS_ONLN) online)"
+    echo "# corpus: $PAGES pages, $CONNECTIONS connections, ${WARMUP}s warmup, ${DURATION}s measured"
+    printf 'mpm\tscenario\trequests\terrors\trps\tp50_us\tp99_us\tp999_us\tcpu_us_per_req\trss_kb_per_child\trss_kb_max\n'
+} > "$results"
+
+for mpm in $MPMS; do
+    if ! load_module "mpm_${mpm}_module" "mod_mpm_$mpm" "$mpm" > /dev/null; then
+        echo "run.sh: skipping $mpm, mod_mpm_$mpm.so is not in $MODULES_DIR" >&2
+        continue
+    fi
+    for scenario in $SCENARIOS; do
+        write_config "$mpm" "$scenario"
+        rm -rf "$work/cache"
+        mkdir -p "$work/cache"
+        [ "$(id -u)" = 0 ] && chown nobody "$work/cache"
+        start_httpd || die "httpd failed to start for $mpm/$scenario"
+
+        echo "run.sh: $mpm/$scenario" >&2
+        "$LOADGEN" -u "$work/capsule/urls.txt" -p "$PORT" -c "$CONNECTIONS" \
+                   -d "$DURATION" -w "$WARMUP" > "$work/load.out" &
+        loadgen=$!
+        sleep "$WARMUP"
+        before=$(cpu_ticks)
+        wait "$loadgen" || die "gmi2html-load failed for $mpm/$scenario"
+        after=$(cpu_ticks)
+        rss=$(child_rss)
+        stop_httpd
+
+        awk -v mpm="$mpm" -v scenario="$scenario" -v ticks=$((after - before)) \
+            -v hz="$ticks_per_sec" -v rss="$rss" '
+            {
+                for (i = 1; i <= NF; i++) { split($i, kv, "="); v[kv[1]] = kv[2] }
+                split(rss, r, " ")
+                printf "%s\t%s\t%d\t%d\t%.1f\t%d\t%d\t%d\t%.0f\t%d\t%d\n", mpm, scenario,
+                       v["requests"], v["errors"], v["rps"], v["p50_us"], v["p99_us"], v["p999_us"],
+                       v["requests"] ? ticks * 1000000 / hz / v["requests"] : 0, r[1], r[2]
+            }' "$work/load.out" >> "$results"
+    done
+done
+
+column -t -s "$(printf '\t')" "$results" 2>/dev/null || cat "$results"
+echo "run.sh: results in $results" >&2
@@ -1,4 +1,5 @@
 #include "gemini_parser.h"
+#include "gmi2html_trace.h"
 #include <string.h>
 #include <ctype.h>
 
@@ -56,9 +57,10 @@ static const char *skip_newline(const char *p, const char *end) {
     return p;
 }
 
-/* Parse a link line (=> URL [label]) */
-static GeminiLink parse_link_line(const char *line, size_t len) {
-    GeminiLink link = {0};
+/* Locate the URL and label of a link line (=> URL [label]) */
+static void scan_link_line(const char *line, size_t len,
+                           const char **url, size_t *url_len,
+                           const char **label, size_t *label_len) {
     const char *p = line;
     const char *end = line + len;
     
@@ -75,19 +77,33 @@ static GeminiLink parse_link_line(const char *line, size_t len) {
     while (p < end && *p != ' ' && *p != '\t') {
         p++;
     }
-    
-    if (p > url_start) {
-        char *raw_url = strndup_safe(url_start, p - url_start);
-        link.url = convert_link_path(raw_url);
-        free(raw_url);
-    }
+    *url = p > url_start ? url_start : NULL;
+    *url_len = p - url_start;
     
     /* Skip whitespace after URL */
     p = skip_whitespace(p, end);
     
     /* Extract label (rest of line) */
-    if (p < end) {
-        link.label = strndup_safe(p, end - p);
+    *label = p < end ? p : NULL;
+    *label_len = end - p;
+}
+
+/* Parse a link line (=> URL [label]) */
+static GeminiLink parse_link_line(const char *line, size_t len) {
+    GeminiLink link = {0};
+    const char *url, *label;
+    size_t url_len, label_len;
+    
+    scan_link_line(line, len, &url, &url_len, &label, &label_len);
+    
+    if (url) {
+        char *raw_url = strndup_safe(url, url_len);
+        link.url = convert_link_path(raw_url);
+        free(raw_url);
+    }
+    
+    if (label) {
+        link.label = strndup_safe(label, label_len);
     }
     
     return link;
@@ -131,7 +147,8 @@ static char *html_escape(const char *str) {
     return escaped;
 }
 
-/* Return link path as-is (module serves .gmi files directly) */
+/* Return link path as-is (module serves .gmi files directly)
+   The single-pass converter writes link URLs unchanged for the same reason */
 static char *convert_link_path(const char *url) {
     if (!url) return NULL;
     
@@ -258,8 +275,181 @@ static char *process_inline_bold(const char *text) {
     return result;
 }
 
+/* Recognise an include line ("%include <path>"), returning the path */
+static int match_include_line(const char *line, size_t len, const char **path, size_t *path_len) {
+    static const char directive[] = "%include";
+    size_t directive_len = sizeof(directive) - 1;
+    
+    if (len <= directive_len || strncmp(line, directive, directive_len) ||
+        (line[directive_len] != ' ' && line[directive_len] != '\t')) {
+        return 0;
+    }
+    
+    const char *end = line + len;
+    const char *p = skip_whitespace(line + directive_len, end);
+    while (end > p && isspace((unsigned char)end[-1])) {
+        end--;
+    }
+    if (p == end) {
+        return 0;
+    }
+    
+    *path = p;
+    *path_len = end - p;
+    return 1;
+}
+
+/* Find include lines without building a document */
+void gemini_scan_includes(const char *content, size_t length,
+                          GeminiIncludeCallback callback, void *ctx) {
+    const char *p = content;
+    const char *end = content + length;
+    int in_preformat = 0;
+    
+    while (p < end) {
+        const char *line_end = find_line_end(p, end);
+        size_t line_len = line_end - p;
+        const char *path;
+        size_t path_len;
+        
+        /* Same rules as gemini_parse: no includes inside preformatted blocks */
+        if (line_len >= 3 && strncmp(p, "```", 3) == 0) {
+            in_preformat = !in_preformat;
+        } else if (!in_preformat && match_include_line(p, line_len, &path, &path_len)) {
+            callback(ctx, path, path_len);
+        }
+        
+        p = skip_newline(line_end, end);
+    }
+}
+
+/* Find the link lines of a document without parsing it */
+void gemini_scan_links(const char *content, size_t length,
+                       GeminiLinkCallback callback, void *ctx) {
+    const char *p = content;
+    const char *end = content + length;
+    int in_preformat = 0;
+    
+    while (p < end) {
+        const char *line_end = find_line_end(p, end);
+        size_t line_len = line_end - p;
+        
+        if (line_len >= 3 && strncmp(p, "```", 3) == 0) {
+            in_preformat = !in_preformat;
+        } else if (!in_preformat && line_len >= 2 && strncmp(p, "=>", 2) == 0) {
+            const char *url, *label;
+            size_t url_len, label_len;
+            
+            scan_link_line(p, line_len, &url, &url_len, &label, &label_len);
+            if (url) {
+                callback(ctx, url, url_len);
+            }
+        }
+        
+        p = skip_newline(line_end, end);
+    }
+}
+
+/* One classified source line; text fields point into the source */
+typedef struct {
+    GeminiLineType type;
+    const char *text;        /* Line content as stored in GeminiLine.content */
+    size_t text_len;
+    int heading_level;       /* 1-3 for headings */
+    const char *url;         /* Link URL (NULL if none) */
+    size_t url_len;
+    const char *label;       /* Link label (NULL if none) */
+    size_t label_len;
+    const char *alt;         /* Preformat toggle alt text (NULL if none) */
+    size_t alt_len;
+} LineView;
+
+/* Classify one line (without its newline), tracking preformatted blocks */
+static void classify_line(const char *line, size_t len, int options,
+                          int *in_preformat, LineView *view) {
+    memset(view, 0, sizeof(*view));
+    view->text = line;
+    view->text_len = 0;
+    
+    /* Check if line is blank */
+    int is_blank = 1;
+    for (size_t i = 0; i < len; i++) {
+        if (!isspace((unsigned char)line[i])) {
+            is_blank = 0;
+            break;
+        }
+    }
+    
+    if (is_blank) {
+        view->type = LINE_TYPE_BLANK;
+    } else if (len >= 3 && strncmp(line, "```", 3) == 0) {
+        /* Preformat toggle, opening or closing */
+        view->type = LINE_TYPE_PREFORMAT_TOGGLE;
+        if (len > 3) {
+            view->alt = line + 3;
+            view->alt_len = len - 3;
+        }
+        *in_preformat = !*in_preformat;
+    } else if (*in_preformat) {
+        view->type = LINE_TYPE_PREFORMATTED;
+        view->text_len = len;
+    } else if (len == 3 && strncmp(line, "---", 3) == 0) {
+        view->type = LINE_TYPE_HORIZONTAL_RULE;
+    } else if (len >= 2 && strncmp(line, "=>", 2) == 0) {
+        view->type = LINE_TYPE_LINK;
+        view->text_len = len;
+        scan_link_line(line, len, &view->url, &view->url_len, &view->label, &view->label_len);
+    } else if (line[0] == '#') {
+        view->type = LINE_TYPE_HEADING;
+        view->heading_level = 1;
+        size_t offset = 1;
+        
+        if (offset < len && line[offset] == '#') {
+            view->heading_level = 2;
+            offset++;
+        }
+        if (offset < len && line[offset] == '#') {
+            view->heading_level = 3;
+            offset++;
+        }
+        
+        /* Skip whitespace after # */
+        while (offset < len && isspace((unsigned char)line[offset])) {
+            offset++;
+        }
+        
+        view->text = line + offset;
+        view->text_len = len - offset;
+    } else if (len >= 2 && line[0] == '*' && line[1] == ' ') {
+        view->type = LINE_TYPE_LIST_ITEM;
+        view->text = line + 2;
+        view->text_len = len - 2;
+    } else if (line[0] == '>') {
+        view->type = LINE_TYPE_QUOTE;
+        size_t offset = 1;
+        while (offset < len && isspace((unsigned char)line[offset])) {
+            offset++;
+        }
+        view->text = line + offset;
+        view->text_len = len - offset;
+    } else if ((options & GEMINI_PARSE_INCLUDES) &&
+               match_include_line(line, len, &view->text, &view->text_len)) {
+        view->type = LINE_TYPE_INCLUDE;
+    } else {
+        view->type = LINE_TYPE_TEXT;
+        view->text_len = len;
+    }
+}
+
 /* Parse Gemini document */
 GeminiDocument *gemini_parse(const char *content, size_t length) {
+    return gemini_parse_with_options(content, length, 0);
+}
+
+/* Parse Gemini document with GEMINI_PARSE_* options */
+GeminiDocument *gemini_parse_with_options(const char *content, size_t length, int options) {
+    GMI2HTML_TRACE1(parse_start, length);
+    
     GeminiDocument *doc = malloc(sizeof(GeminiDocument));
     if (!doc) return NULL;
     
@@ -278,98 +468,26 @@ GeminiDocument *gemini_parse(const char *content, size_t length) {
     int in_preformat = 0;
     
     while (p < end) {
-        const char *line_start = p;
         const char *line_end = find_line_end(p, end);
-        size_t line_len = line_end - line_start;
-        
         GeminiLine parsed_line = {0};
+        LineView view;
         
-        /* Remove trailing whitespace */
-        while (line_len > 0 && (line_start[line_len - 1] == '\r' || 
-                               line_start[line_len - 1] == '\n')) {
-            line_len--;
-        }
+        classify_line(p, line_end - p, options, &in_preformat, &view);
         
-        /* Check if line is blank */
-        int is_blank = 1;
-        for (size_t i = 0; i < line_len; i++) {
-            if (!isspace((unsigned char)line_start[i])) {
-                is_blank = 0;
-                break;
-            }
+        parsed_line.type = view.type;
+        parsed_line.heading_level = view.heading_level;
+        parsed_line.content = strndup_safe(view.text, view.text_len);
+        if (view.type == LINE_TYPE_LINK) {
+            parsed_line.link = parse_link_line(p, line_end - p);
+        }
+        if (view.alt) {
+            parsed_line.alt_text = strndup_safe(view.alt, view.alt_len);
         }
         
-        if (is_blank) {
-            parsed_line.type = LINE_TYPE_BLANK;
-            parsed_line.content = strndup_safe("", 0);
-        } else if (in_preformat) {
-            /* Check if this is a preformat toggle */
-            if (line_len >= 3 && strncmp(line_start, "```", 3) == 0) {
-                parsed_line.type = LINE_TYPE_PREFORMAT_TOGGLE;
-                parsed_line.content = strndup_safe("", 0);
-                if (line_len > 3) {
-                    parsed_line.alt_text = strndup_safe(line_start + 3, line_len - 3);
-                }
-                in_preformat = 0;
-            } else {
-                parsed_line.type = LINE_TYPE_PREFORMATTED;
-                parsed_line.content = strndup_safe(line_start, line_len);
-            }
-        } else {
-            /* Not in preformat mode */
-            if (line_len >= 3 && strncmp(line_start, "```", 3) == 0) {
-                parsed_line.type = LINE_TYPE_PREFORMAT_TOGGLE;
-                parsed_line.content = strndup_safe("", 0);
-                if (line_len > 3) {
-                    parsed_line.alt_text = strndup_safe(line_start + 3, line_len - 3);
-                }
-                in_preformat = 1;
-            } else if (line_len == 3 && strncmp(line_start, "---", 3) == 0) {
-                parsed_line.type = LINE_TYPE_HORIZONTAL_RULE;
-                parsed_line.content = strndup_safe("", 0);
-            } else if (line_len >= 2 && strncmp(line_start, "=>", 2) == 0) {
-                parsed_line.type = LINE_TYPE_LINK;
-                parsed_line.content = strndup_safe(line_start, line_len);
-                parsed_line.link = parse_link_line(line_start, line_len);
-            } else if (line_len >= 1 && line_start[0] == '#') {
-                parsed_line.type = LINE_TYPE_HEADING;
-                parsed_line.heading_level = 1;
-                size_t offset = 1;
-                
-                if (offset < line_len && line_start[offset] == '#') {
-                    parsed_line.heading_level = 2;
-                    offset++;
-                }
-                if (offset < line_len && line_start[offset] == '#') {
-                    parsed_line.heading_level = 3;
-                    offset++;
-                }
-                
-                /* Skip whitespace after # */
-                while (offset < line_len && isspace((unsigned char)line_start[offset])) {
-                    offset++;
-                }
-                
-                parsed_line.content = strndup_safe(line_start + offset, line_len - offset);
-                
-                /* Extract page title from first # heading */
-                if (parsed_line.heading_level == 1 && !doc->page_title && parsed_line.content) {
-                    doc->page_title = strndup_safe(parsed_line.content, strlen(parsed_line.content));
-                }
-            } else if (line_len >= 2 && line_start[0] == '*' && line_start[1] == ' ') {
-                parsed_line.type = LINE_TYPE_LIST_ITEM;
-                parsed_line.content = strndup_safe(line_start + 2, line_len - 2);
-            } else if (line_len >= 1 && line_start[0] == '>') {
-                parsed_line.type = LINE_TYPE_QUOTE;
-                size_t offset = 1;
-                while (offset < line_len && isspace((unsigned char)line_start[offset])) {
-                    offset++;
-                }
-                parsed_line.content = strndup_safe(line_start + offset, line_len - offset);
-            } else {
-                parsed_line.type = LINE_TYPE_TEXT;
-                parsed_line.content = strndup_safe(line_start, line_len);
-            }
+        /* Extract page title from first # heading */
+        if (view.type == LINE_TYPE_HEADING && view.heading_level == 1 &&
+            !doc->page_title && parsed_line.content) {
+            doc->page_title = strndup_safe(parsed_line.content, view.text_len);
         }
         
         /* Resize if needed */
@@ -377,6 +495,10 @@ GeminiDocument *gemini_parse(const char *content, size_t length) {
             doc->capacity *= 2;
             GeminiLine *new_lines = realloc(doc->lines, sizeof(GeminiLine) * doc->capacity);
             if (!new_lines) {
+                free(parsed_line.content);
+                free(parsed_line.link.url);
+                free(parsed_line.link.label);
+                free(parsed_line.alt_text);
                 gemini_document_free(doc);
                 return NULL;
             }
@@ -387,188 +509,720 @@ GeminiDocument *gemini_parse(const char *content, size_t length) {
         p = skip_newline(line_end, end);
     }
     
+    GMI2HTML_TRACE1(parse_end, doc->line_count);
     return doc;
 }
 
-/* Convert Gemini document to HTML */
-char *gemini_to_html(GeminiDocument *doc, const char *title) {
-    return gemini_to_html_with_stylesheet(doc, title, NULL);
+/* Find the page title (first # heading) without parsing the whole document */
+char *gemini_extract_title(const char *content, size_t length) {
+    const char *p = content;
+    const char *end = content + length;
+    int in_preformat = 0;
+    
+    while (p < end) {
+        const char *line_end = find_line_end(p, end);
+        LineView view;
+        
+        classify_line(p, line_end - p, 0, &in_preformat, &view);
+        if (view.type == LINE_TYPE_HEADING && view.heading_level == 1) {
+            return strndup_safe(view.text, view.text_len);
+        }
+        
+        p = skip_newline(line_end, end);
+    }
+    
+    return NULL;
 }
 
-/* Convert Gemini document to HTML with custom stylesheet */
-char *gemini_to_html_with_stylesheet(GeminiDocument *doc, const char *title, const char *stylesheet) {
-    return gemini_to_html_with_stylesheet_and_head(doc, title, stylesheet, NULL);
-}
+/* Growable output buffer for the renderer */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    int failed;  /* Set once an allocation fails; later appends are dropped */
+} HtmlBuffer;
 
-/* Convert Gemini document to HTML with custom stylesheet and custom head content */
-char *gemini_to_html_with_stylesheet_and_head(GeminiDocument *doc, const char *title, const char *stylesheet, const char *custom_head) {
-    if (!doc) return NULL;
+/* Make room for extra bytes plus a terminating NUL */
+static int html_buffer_reserve(HtmlBuffer *buf, size_t extra) {
+    if (buf->failed) return 0;
+    if (buf->len + extra + 1 <= buf->cap) return 1;
     
-    /* Build HTML string - start with larger buffer to reduce reallocs */
-    size_t buffer_size = 65536;  /* Start with 64KB instead of 8KB */
-    char *html = malloc(buffer_size);
-    if (!html) return NULL;
+    size_t new_cap = buf->cap ? buf->cap : 65536;  /* Start with 64KB to reduce reallocs */
+    while (buf->len + extra + 1 > new_cap) {
+        new_cap *= 2;
+    }
     
-    size_t pos = 0;
+    char *new_data = realloc(buf->data, new_cap);
+    if (!new_data) {
+        buf->failed = 1;
+        return 0;
+    }
+    buf->data = new_data;
+    buf->cap = new_cap;
+    return 1;
+}
+
+static void html_buffer_append(HtmlBuffer *buf, const char *str, size_t n) {
+    if (!html_buffer_reserve(buf, n)) return;
+    memcpy(buf->data + buf->len, str, n);
+    buf->len += n;
+    buf->data[buf->len] = '\0';
+}
+
+static void html_buffer_puts(HtmlBuffer *buf, const char *str) {
+    html_buffer_append(buf, str, strlen(str));
+}
+
+/* Append text with HTML special characters escaped (as html_escape) */
+static void html_buffer_append_escaped(HtmlBuffer *buf, const char *str, size_t len) {
+    if (!str) return;
     
+    const char *run = str;
+    const char *end = str + len;
+    for (const char *p = str; p < end; p++) {
+        const char *entity;
+        switch (*p) {
+            case '<': entity = "&lt;"; break;
+            case '>': entity = "&gt;"; break;
+            case '&': entity = "&amp;"; break;
+            case '"': entity = "&quot;"; break;
+            case '\'': entity = "&#39;"; break;
+            default: continue;
+        }
+        html_buffer_append(buf, run, p - run);
+        html_buffer_puts(buf, entity);
+        run = p + 1;
+    }
+    html_buffer_append(buf, run, end - run);
+}
+
+/* Take ownership of the rendered string (NULL if rendering ran out of memory) */
+static char *html_buffer_finish(HtmlBuffer *buf) {
+    if (buf->failed || !html_buffer_reserve(buf, 0)) {
+        free(buf->data);
+        return NULL;
+    }
+    buf->data[buf->len] = '\0';
+    return buf->data;
+}
+
+/* Block state carried from line to line while rendering */
+typedef struct {
+    HtmlBuffer *out;
+    const GeminiRenderOptions *options;
+    int in_list;
+    int in_preformat;
+    int in_blockquote;
+} RenderState;
+
+/* End an output line; minified output runs tags together instead */
+static void render_newline(HtmlBuffer *out, const GeminiRenderOptions *options) {
+    if (!options->minify) {
+        html_buffer_append(out, "\n", 1);
+    }
+}
+
+/* Emit the document head, up to and including <body> */
+static void render_page_start(HtmlBuffer *out, const char *title, size_t title_len,
+                              const GeminiRenderOptions *options) {
     /* Use custom stylesheet or built-in */
-    const char *css = stylesheet ? stylesheet : BUILTIN_STYLESHEET;
+    const char *css = options->stylesheet ? options->stylesheet : BUILTIN_STYLESHEET;
+    
+    if (options->minify) {
+        html_buffer_puts(out,
+            "<!DOCTYPE html><html><head><meta charset=\"UTF-8\">"
+            "<meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0\">"
+            "<title>");
+        html_buffer_append(out, title, title_len);
+        html_buffer_puts(out, "</title>");
+        if (options->custom_head) {
+            html_buffer_puts(out, options->custom_head);
+        }
+        html_buffer_puts(out, "<style>");
+        html_buffer_puts(out, css);
+        html_buffer_puts(out, "</style></head><body>");
+        return;
+    }
     
     /* HTML header with standard meta tags and stylesheet */
-    pos += snprintf(html + pos, buffer_size - pos,
+    html_buffer_puts(out,
         "<!DOCTYPE html>\n"
         "<html>\n"
         "<head>\n"
         "  <meta charset=\"UTF-8\">\n"
         "  <meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0\">\n"
-        "  <title>%s</title>\n",
-        doc->page_title ? doc->page_title : (title ? title : "Gemini Document"));
+        "  <title>");
+    html_buffer_append(out, title, title_len);
+    html_buffer_puts(out, "</title>\n");
     
     /* Add custom head content if provided */
-    if (custom_head) {
-        pos += snprintf(html + pos, buffer_size - pos, "%s\n", custom_head);
+    if (options->custom_head) {
+        html_buffer_puts(out, options->custom_head);
+        html_buffer_puts(out, "\n");
     }
     
     /* Add stylesheet */
-    pos += snprintf(html + pos, buffer_size - pos,
-        "  <style>\n"
-        "%s"
+    html_buffer_puts(out, "  <style>\n");
+    html_buffer_puts(out, css);
+    html_buffer_puts(out,
         "  </style>\n"
         "</head>\n"
-        "<body>\n",
-        css);
+        "<body>\n");
+}
+
+static void render_page_end(HtmlBuffer *out, const GeminiRenderOptions *options) {
+    html_buffer_puts(out, "</body>");
+    render_newline(out, options);
+    html_buffer_puts(out, "</html>");
+    render_newline(out, options);
+}
+
+/* Emit one classified line */
+static void render_line(RenderState *st, const LineView *line) {
+    HtmlBuffer *out = st->out;
+    const GeminiRenderOptions *options = st->options;
     
-    int in_list = 0;
-    int in_preformat = 0;
-    int in_blockquote = 0;
+    /* Close open tags if needed */
+    if (st->in_list && line->type != LINE_TYPE_LIST_ITEM) {
+        html_buffer_puts(out, "</ul>");
+        render_newline(out, options);
+        st->in_list = 0;
+    }
     
-    for (size_t i = 0; i < doc->line_count; i++) {
-        GeminiLine *line = &doc->lines[i];
-        
-        /* Expand buffer if getting full (be conservative - expand at 75% capacity) */
-        if (pos > buffer_size * 3 / 4) {
-            buffer_size *= 2;
-            char *new_html = realloc(html, buffer_size);
-            if (!new_html) {
-                free(html);
-                return NULL;
-            }
-            html = new_html;
-        }
-        
-        /* Close open tags if needed */
-        if (in_list && line->type != LINE_TYPE_LIST_ITEM) {
-            pos += snprintf(html + pos, buffer_size - pos, "</ul>\n");
-            in_list = 0;
-        }
-        
-        if (in_blockquote && line->type != LINE_TYPE_QUOTE) {
-            pos += snprintf(html + pos, buffer_size - pos, "</blockquote>\n");
-            in_blockquote = 0;
-        }
-        
-        switch (line->type) {
-            case LINE_TYPE_TEXT: {
-                char *escaped = html_escape(line->content);
+    if (st->in_blockquote && line->type != LINE_TYPE_QUOTE) {
+        html_buffer_puts(out, "</blockquote>");
+        render_newline(out, options);
+        st->in_blockquote = 0;
+    }
+    
+    switch (line->type) {
+        case LINE_TYPE_TEXT:
+            html_buffer_puts(out, "<p>");
+            if (!memchr(line->text, '*', line->text_len) && !memchr(line->text, '`', line->text_len)) {
+                /* No inline markup possible, so escaping is all there is to do */
+                html_buffer_append_escaped(out, line->text, line->text_len);
+            } else {
+                char *text = strndup_safe(line->text, line->text_len);
+                char *escaped = html_escape(text);
                 char *with_bold = process_inline_bold(escaped);
                 char *with_code = process_inline_code(with_bold ? with_bold : escaped);
-                pos += snprintf(html + pos, buffer_size - pos, "<p>%s</p>\n", with_code ? with_code : "");
+                html_buffer_puts(out, with_code ? with_code : "");
+                free(text);
                 free(escaped);
                 free(with_bold);
                 free(with_code);
-                break;
             }
-            
-            case LINE_TYPE_BLANK:
-                pos += snprintf(html + pos, buffer_size - pos, "<br>\n");
-                break;
-            
-            case LINE_TYPE_HEADING: {
-                char *escaped = html_escape(line->content);
-                int level = line->heading_level;
-                pos += snprintf(html + pos, buffer_size - pos,
-                    "<h%d>%s</h%d>\n",
-                    level, escaped ? escaped : "", level);
-                free(escaped);
-                break;
+            html_buffer_puts(out, "</p>");
+            render_newline(out, options);
+            break;
+        
+        case LINE_TYPE_BLANK:
+            /* Runs of blank lines become adjacent <br>s when minified;
+               inside a preformatted block the newline is content */
+            html_buffer_puts(out, "<br>");
+            if (st->in_preformat) {
+                html_buffer_puts(out, "\n");
+            } else {
+                render_newline(out, options);
             }
-            
-            case LINE_TYPE_LIST_ITEM: {
-                if (!in_list) {
-                    pos += snprintf(html + pos, buffer_size - pos, "<ul>\n");
-                    in_list = 1;
+            break;
+        
+        case LINE_TYPE_HEADING: {
+            static const char *open[] = { "<h1>", "<h2>", "<h3>" };
+            static const char *close[] = { "</h1>", "</h2>", "</h3>" };
+            int level = line->heading_level >= 1 && line->heading_level <= 3 ? line->heading_level : 1;
+            html_buffer_puts(out, open[level - 1]);
+            html_buffer_append_escaped(out, line->text, line->text_len);
+            html_buffer_puts(out, close[level - 1]);
+            render_newline(out, options);
+            break;
+        }
+        
+        case LINE_TYPE_LIST_ITEM:
+            if (!st->in_list) {
+                html_buffer_puts(out, "<ul>");
+                render_newline(out, options);
+                st->in_list = 1;
+            }
+            html_buffer_puts(out, options->minify ? "<li>" : "  <li>");
+            html_buffer_append_escaped(out, line->text, line->text_len);
+            html_buffer_puts(out, "</li>");
+            render_newline(out, options);
+            break;
+        
+        case LINE_TYPE_QUOTE:
+            if (!st->in_blockquote) {
+                html_buffer_puts(out, "<blockquote>");
+                render_newline(out, options);
+                st->in_blockquote = 1;
+            }
+            html_buffer_puts(out, "<p>");
+            html_buffer_append_escaped(out, line->text, line->text_len);
+            html_buffer_puts(out, "</p>");
+            render_newline(out, options);
+            break;
+        
+        case LINE_TYPE_PREFORMAT_TOGGLE:
+            if (st->in_preformat) {
+                html_buffer_puts(out, "</pre>");
+                render_newline(out, options);
+                st->in_preformat = 0;
+            } else {
+                /* Kept when minified: the parser drops this newline, but
+                   without it a leading blank line would be dropped instead */
+                html_buffer_puts(out, "<pre>\n");
+                st->in_preformat = 1;
+            }
+            break;
+        
+        case LINE_TYPE_PREFORMATTED:
+            html_buffer_append_escaped(out, line->text, line->text_len);
+            html_buffer_puts(out, "\n");
+            break;
+        
+        case LINE_TYPE_HORIZONTAL_RULE:
+            html_buffer_puts(out, "<hr>");
+            render_newline(out, options);
+            break;
+        
+        case LINE_TYPE_LINK:
+            if (line->url) {
+                html_buffer_puts(out, "<div class=\"gemini-link\"><a href=\"");
+                html_buffer_append_escaped(out, line->url, line->url_len);
+                html_buffer_puts(out, "\">");
+                if (line->label) {
+                    html_buffer_append_escaped(out, line->label, line->label_len);
+                } else {
+                    html_buffer_append_escaped(out, line->url, line->url_len);
                 }
-                char *escaped = html_escape(line->content);
-                pos += snprintf(html + pos, buffer_size - pos, "  <li>%s</li>\n", escaped ? escaped : "");
-                free(escaped);
-                break;
+                html_buffer_puts(out, "</a></div>");
+                render_newline(out, options);
             }
-            
-            case LINE_TYPE_QUOTE: {
-                if (!in_blockquote) {
-                    pos += snprintf(html + pos, buffer_size - pos, "<blockquote>\n");
-                    in_blockquote = 1;
+            break;
+        
+        case LINE_TYPE_INCLUDE: {
+            /* Fragments are already rendered; unresolved includes are dropped */
+            if (options->include_resolver) {
+                char *path = strndup_safe(line->text, line->text_len);
+                const char *fragment = path ? options->include_resolver(options->include_ctx, path) : NULL;
+                if (fragment) {
+                    html_buffer_puts(out, fragment);
                 }
-                char *escaped = html_escape(line->content);
-                pos += snprintf(html + pos, buffer_size - pos, "<p>%s</p>\n", escaped ? escaped : "");
-                free(escaped);
-                break;
+                free(path);
             }
+            break;
+        }
+    }
+}
+
+/* Close any remaining open tags */
+static void render_finish(RenderState *st) {
+    if (st->in_list) {
+        html_buffer_puts(st->out, "</ul>");
+        render_newline(st->out, st->options);
+    }
+    if (st->in_blockquote) {
+        html_buffer_puts(st->out, "</blockquote>");
+        render_newline(st->out, st->options);
+    }
+    if (st->in_preformat) {
+        html_buffer_puts(st->out, "</pre>");
+        render_newline(st->out, st->options);
+    }
+    st->in_list = st->in_blockquote = st->in_preformat = 0;
+}
+
+/* Emit every line of a document */
+static void render_body(HtmlBuffer *out, GeminiDocument *doc, const GeminiRenderOptions *options) {
+    RenderState st = { out, options, 0, 0, 0 };
+    
+    for (size_t i = 0; i < doc->line_count; i++) {
+        const GeminiLine *line = &doc->lines[i];
+        LineView view = {0};
+        
+        view.type = line->type;
+        view.text = line->content;
+        view.text_len = line->content ? strlen(line->content) : 0;
+        view.heading_level = line->heading_level;
+        view.url = line->link.url;
+        view.url_len = line->link.url ? strlen(line->link.url) : 0;
+        view.label = line->link.label;
+        view.label_len = line->link.label ? strlen(line->link.label) : 0;
+        render_line(&st, &view);
+    }
+    render_finish(&st);
+}
+
+/* Convert Gemini document to HTML */
+char *gemini_to_html(GeminiDocument *doc, const char *title) {
+    return gemini_to_html_with_stylesheet(doc, title, NULL);
+}
+
+/* Convert Gemini document to HTML with custom stylesheet */
+char *gemini_to_html_with_stylesheet(GeminiDocument *doc, const char *title, const char *stylesheet) {
+    return gemini_to_html_with_stylesheet_and_head(doc, title, stylesheet, NULL);
+}
+
+/* Convert Gemini document to HTML with custom stylesheet and custom head content */
+char *gemini_to_html_with_stylesheet_and_head(GeminiDocument *doc, const char *title, const char *stylesheet, const char *custom_head) {
+    GeminiRenderOptions options = {0};
+    options.stylesheet = stylesheet;
+    options.custom_head = custom_head;
+    return gemini_to_html_with_options(doc, title, &options);
+}
+
+/* Convert Gemini document to a complete HTML page */
+char *gemini_to_html_with_options(GeminiDocument *doc, const char *title, const GeminiRenderOptions *options) {
+    if (!doc) return NULL;
+    
+    static const GeminiRenderOptions defaults = {0};
+    if (!options) options = &defaults;
+    
+    GMI2HTML_TRACE1(render_start, doc->line_count);
+    
+    HtmlBuffer out = {0};
+    const char *page_title = doc->page_title ? doc->page_title : (title ? title : "Gemini Document");
+    render_page_start(&out, page_title, strlen(page_title), options);
+    render_body(&out, doc, options);
+    render_page_end(&out, options);
+    
+    GMI2HTML_TRACE1(render_end, out.len);
+    return html_buffer_finish(&out);
+}
+
+/* Convert Gemini document to an HTML fragment (body content only) */
+char *gemini_to_html_fragment(GeminiDocument *doc, const GeminiRenderOptions *options) {
+    if (!doc) return NULL;
+    
+    static const GeminiRenderOptions defaults = {0};
+    if (!options) options = &defaults;
+    
+    GMI2HTML_TRACE1(render_start, doc->line_count);
+    
+    HtmlBuffer out = {0};
+    render_body(&out, doc, options);
+    
+    GMI2HTML_TRACE1(render_end, out.len);
+    return html_buffer_finish(&out);
+}
+
+/* Streaming output is handed to the writer in chunks of about this size */
+#define STREAM_CHUNK_SIZE 32768
+
+/* Put the page head in front of the body rendered so far */
+static void prepend_page_start(HtmlBuffer *out, const char *title, size_t title_len,
+                               const GeminiRenderOptions *options) {
+    HtmlBuffer head = {0};
+    
+    render_page_start(&head, title, title_len, options);
+    if (out->len) {
+        html_buffer_append(&head, out->data, out->len);
+    }
+    head.failed |= out->failed;
+    free(out->data);
+    *out = head;
+}
+
+/* Pass everything buffered so far to the writer */
+static int stream_flush(HtmlBuffer *out, GeminiWriteFn write, void *ctx) {
+    if (out->failed) return -1;
+    if (out->len && write(ctx, out->data, out->len) != 0) return -1;
+    out->len = 0;
+    return 0;
+}
+
+/* Blocks for GeminiRenderOptions.block_cache end at the first heading or
+   blank line (outside preformatted text) after this many bytes */
+#define BLOCK_MIN_SIZE 4096
+
+/* GeminiWriteFn appending to an HtmlBuffer */
+static int append_to_buffer(void *ctx, const char *data, size_t len) {
+    HtmlBuffer *out = (HtmlBuffer *)ctx;
+    
+    html_buffer_append(out, data, len);
+    return out->failed ? -1 : 0;
+}
+
+/* Append the HTML of one block, from the block cache when it has it */
+static void emit_block(HtmlBuffer *out, const char *start, const char *end, int cacheable,
+                       const GeminiRenderOptions *options, size_t *line_count) {
+    const GeminiBlockCache *cache = options->block_cache;
+    
+    if (cacheable && cache->lookup(cache->ctx, start, end - start, append_to_buffer, out)) {
+        return;
+    }
+    
+    /* Every block starts outside lists, quotes and preformatted text */
+    RenderState st = { out, options, 0, 0, 0 };
+    int parse_options = options->include_resolver ? GEMINI_PARSE_INCLUDES : 0;
+    int in_preformat = 0;
+    size_t offset = out->len;
+    const char *p = start;
+    
+    while (p < end) {
+        const char *line_end = find_line_end(p, end);
+        LineView view;
+        
+        classify_line(p, line_end - p, parse_options, &in_preformat, &view);
+        render_line(&st, &view);
+        (*line_count)++;
+        p = skip_newline(line_end, end);
+    }
+    render_finish(&st);
+    
+    if (cacheable && !out->failed) {
+        cache->store(cache->ctx, start, end - start, out->data + offset, out->len - offset);
+    }
+}
+
+/* Whether a line is blank, as classify_line decides */
+static int is_blank_line(const char *line, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (!isspace((unsigned char)line[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Convert block by block, reusing the HTML of blocks in options->block_cache
+ * Lines are only classified in full inside blocks that are rendered, so an
+ * edit costs a scan of the source plus the rendering of the changed blocks.
+ * Output is identical to convert_document without a block cache. */
+static int convert_blocks(const char *content, size_t length, const char *title,
+                          const GeminiRenderOptions *options,
+                          GeminiWriteFn write, void *ctx, HtmlBuffer *out) {
+    GMI2HTML_TRACE1(parse_start, length);
+    
+    const char *title_text = NULL;
+    size_t title_len = 0;
+    int titled = 0;
+    int in_preformat = 0;
+    int cacheable = 1;
+    size_t line_count = 0;
+    size_t written = 0;
+    const char *block = content;
+    const char *p = content;
+    const char *end = content + length;
+    
+    while (p < end) {
+        const char *line_end = find_line_end(p, end);
+        size_t len = line_end - p;
+        
+        if (len >= 3 && strncmp(p, "```", 3) == 0) {
+            in_preformat = !in_preformat;
+        } else if (!in_preformat) {
+            int heading = len > 0 && p[0] == '#';
             
-            case LINE_TYPE_PREFORMAT_TOGGLE:
-                if (in_preformat) {
-                    pos += snprintf(html + pos, buffer_size - pos, "</pre>\n");
-                    in_preformat = 0;
-                } else {
-                    pos += snprintf(html + pos, buffer_size - pos,
-                        "<pre%s>\n",
-                        line->alt_text ? "" : "");
-                    in_preformat = 1;
+            if ((heading || is_blank_line(p, len)) && (size_t)(p - block) >= BLOCK_MIN_SIZE) {
+                emit_block(out, block, p, cacheable, options, &line_count);
+                block = p;
+                cacheable = 1;
+                
+                if (titled && write && out->len >= STREAM_CHUNK_SIZE) {
+                    written += out->len;
+                    if (stream_flush(out, write, ctx) != 0) return -1;
                 }
-                break;
-            
-            case LINE_TYPE_PREFORMATTED: {
-                char *escaped = html_escape(line->content);
-                pos += snprintf(html + pos, buffer_size - pos, "%s\n", escaped ? escaped : "");
-                free(escaped);
-                break;
             }
             
-            case LINE_TYPE_HORIZONTAL_RULE:
-                pos += snprintf(html + pos, buffer_size - pos, "<hr>\n");
-                break;
-            
-            case LINE_TYPE_LINK: {
-                if (line->link.url) {
-                    char *url_escaped = html_escape(line->link.url);
-                    char *label_escaped = line->link.label ? 
-                        html_escape(line->link.label) : 
-                        html_escape(line->link.url);
-                    
-                    pos += snprintf(html + pos, buffer_size - pos,
-                        "<div class=\"gemini-link\"><a href=\"%s\">%s</a></div>\n",
-                        url_escaped ? url_escaped : "",
-                        label_escaped ? label_escaped : "");
-                    
-                    free(url_escaped);
-                    free(label_escaped);
+            if (heading && !title_text) {
+                LineView view;
+                int heading_preformat = 0;
+                
+                classify_line(p, len, 0, &heading_preformat, &view);
+                if (view.heading_level == 1) {
+                    title_text = view.text;
+                    title_len = view.text_len;
+                }
+            } else if (options->include_resolver) {
+                const char *path;
+                size_t path_len;
+                
+                if (match_include_line(p, len, &path, &path_len)) {
+                    cacheable = 0;
                 }
-                break;
             }
         }
+        
+        /* The head goes in front of everything, so output can start once
+           the title is known */
+        if (!titled && title_text) {
+            prepend_page_start(out, title_text, title_len, options);
+            titled = 1;
+        }
+        
+        p = skip_newline(line_end, end);
+    }
+    emit_block(out, block, end, cacheable, options, &line_count);
+    
+    if (!titled) {
+        const char *fallback = title ? title : "Gemini Document";
+        prepend_page_start(out, fallback, strlen(fallback), options);
+    }
+    render_page_end(out, options);
+    
+    GMI2HTML_TRACE1(parse_end, line_count);
+    GMI2HTML_TRACE1(render_end, written + out->len);
+    return out->failed ? -1 : 0;
+}
+
+/* Classify and render in one pass over the source
+ * The title comes from the first level 1 heading, which may be anywhere,
+ * so body output is held back until that heading (or the end of the
+ * document) and the head is then put in front of it. From there on a
+ * writer, if given, receives the output in STREAM_CHUNK_SIZE pieces. */
+static int convert_document(const char *content, size_t length, const char *title,
+                            const GeminiRenderOptions *options,
+                            GeminiWriteFn write, void *ctx, HtmlBuffer *out) {
+    static const GeminiRenderOptions defaults = {0};
+    if (!options) options = &defaults;
+    
+    if (options->block_cache) {
+        return convert_blocks(content, length, title, options, write, ctx, out);
+    }
+    
+    GMI2HTML_TRACE1(parse_start, length);
+    
+    RenderState st = { out, options, 0, 0, 0 };
+    int parse_options = options->include_resolver ? GEMINI_PARSE_INCLUDES : 0;
+    int in_preformat = 0;
+    int titled = 0;
+    size_t line_count = 0;
+    size_t written = 0;
+    const char *p = content;
+    const char *end = content + length;
+    
+    while (p < end) {
+        const char *line_end = find_line_end(p, end);
+        LineView view;
+        
+        classify_line(p, line_end - p, parse_options, &in_preformat, &view);
+        line_count++;
+        
+        if (!titled && view.type == LINE_TYPE_HEADING && view.heading_level == 1) {
+            prepend_page_start(out, view.text, view.text_len, options);
+            titled = 1;
+        }
+        
+        render_line(&st, &view);
+        
+        if (titled && write && out->len >= STREAM_CHUNK_SIZE) {
+            written += out->len;
+            if (stream_flush(out, write, ctx) != 0) return -1;
+        }
+        
+        p = skip_newline(line_end, end);
     }
+    render_finish(&st);
     
-    /* Close any remaining open tags */
-    if (in_list) pos += snprintf(html + pos, buffer_size - pos, "</ul>\n");
-    if (in_blockquote) pos += snprintf(html + pos, buffer_size - pos, "</blockquote>\n");
-    if (in_preformat) pos += snprintf(html + pos, buffer_size - pos, "</pre>\n");
+    if (!titled) {
+        const char *fallback = title ? title : "Gemini Document";
+        prepend_page_start(out, fallback, strlen(fallback), options);
+    }
+    render_page_end(out, options);
     
-    /* HTML footer */
-    pos += snprintf(html + pos, buffer_size - pos,
-        "</body>\n"
-        "</html>\n");
+    GMI2HTML_TRACE1(parse_end, line_count);
+    GMI2HTML_TRACE1(render_end, written + out->len);
+    return out->failed ? -1 : 0;
+}
+
+/* Convert Gemini source to HTML in one pass, streaming the output */
+int gemini_stream_html(const char *content, size_t length, const char *title,
+                       const GeminiRenderOptions *options,
+                       GeminiWriteFn write, void *ctx) {
+    HtmlBuffer out = {0};
+    int status = -1;
+    
+    if (content && write &&
+        convert_document(content, length, title, options, write, ctx, &out) == 0) {
+        status = stream_flush(&out, write, ctx);
+    }
+    
+    free(out.data);
+    return status;
+}
+
+/* Convert Gemini source to a complete HTML page in one pass */
+char *gemini_convert_to_html(const char *content, size_t length, const char *title,
+                             const GeminiRenderOptions *options) {
+    HtmlBuffer out = {0};
+    
+    if (!content) return NULL;
+    
+    convert_document(content, length, title, options, NULL, NULL, &out);
+    return html_buffer_finish(&out);
+}
+
+/* Get the built-in stylesheet */
+const char *gemini_builtin_stylesheet(void) {
+    return BUILTIN_STYLESHEET;
+}
+
+/* Characters that need no whitespace on either side of them */
+static int css_separator(char c) {
+    return c == '{' || c == '}' || c == ';' || c == ',' || c == '>' || c == '\0';
+}
+
+/* Minify a stylesheet
+ * Whitespace runs become one space, which is then dropped next to a
+ * separator and after a colon. Whitespace before a colon is kept, as
+ * "a :hover" and "a:hover" are different selectors. */
+char *gemini_minify_css(const char *css, size_t length) {
+    char *out = malloc(length + 1);
+    const char *p = css;
+    const char *end = css + length;
+    size_t n = 0;
+    int space = 0;  /* Whitespace seen since the last output character */
+    
+    if (!out) return NULL;
+    
+    while (p < end) {
+        char c = *p;
+        
+        if (c == '/' && p + 1 < end && p[1] == '*') {
+            const char *close = p + 2;
+            while (close + 1 < end && !(close[0] == '*' && close[1] == '/')) close++;
+            p = close + 1 < end ? close + 2 : end;
+            space = 1;  /* A comment still separates tokens */
+            continue;
+        }
+        
+        if (isspace((unsigned char)c)) {
+            space = 1;
+            p++;
+            continue;
+        }
+        
+        /* Drop the last semicolon of a block */
+        if (c == '}' && n && out[n - 1] == ';') {
+            n--;
+        }
+        
+        if (space && n && !css_separator(out[n - 1]) && out[n - 1] != ':' && !css_separator(c)) {
+            out[n++] = ' ';
+        }
+        space = 0;
+        
+        if (c == '"' || c == '\'') {
+            /* Copy strings verbatim, including escaped quotes */
+            const char *close = p + 1;
+            while (close < end && *close != c) {
+                if (*close == '\\' && close + 1 < end) close++;
+                close++;
+            }
+            if (close < end) close++;
+            memcpy(out + n, p, close - p);
+            n += close - p;
+            p = close;
+            continue;
+        }
+        
+        out[n++] = c;
+        p++;
+    }
     
-    return html;
+    out[n] = '\0';
+    return out;
 }
 
 /* Free Gemini document */
@@ -583,6 +1237,7 @@ void gemini_document_free(GeminiDocument *doc) {
     }
     
     free(doc->lines);
+    free(doc->page_title);
     free(doc);
 }
 
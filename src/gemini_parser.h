@@ -20,7 +20,8 @@ typedef enum {
     LINE_TYPE_LIST_ITEM,
     LINE_TYPE_QUOTE,
     LINE_TYPE_BLANK,
-    LINE_TYPE_HORIZONTAL_RULE
+    LINE_TYPE_HORIZONTAL_RULE,
+    LINE_TYPE_INCLUDE   /* "%include <path>", only with GEMINI_PARSE_INCLUDES */
 } GeminiLineType;
 
 typedef struct {
@@ -43,6 +44,74 @@ typedef struct {
     char *page_title;  /* Extracted from first # heading */
 } GeminiDocument;
 
+/* Options for gemini_parse_with_options */
+#define GEMINI_PARSE_INCLUDES 0x1   /* Recognise "%include <path>" lines */
+
+/**
+ * Resolve an include line to rendered HTML
+ * @param ctx: Caller context from GeminiRenderOptions
+ * @param path: Path as written on the include line
+ * @return: HTML fragment to insert (owned by the resolver), or NULL to drop the line
+ */
+typedef const char *(*GeminiIncludeResolver)(void *ctx, const char *path);
+
+/**
+ * Receive an include path found by gemini_scan_includes
+ * @param ctx: Caller context
+ * @param path: Path as written on the include line (not NUL-terminated)
+ * @param len: Length of the path
+ */
+typedef void (*GeminiIncludeCallback)(void *ctx, const char *path, size_t len);
+
+/**
+ * Receive a link URL found by gemini_scan_links
+ * @param ctx: Caller context
+ * @param url: URL as written on the link line (not NUL-terminated)
+ * @param len: Length of the URL
+ */
+typedef void (*GeminiLinkCallback)(void *ctx, const char *url, size_t len);
+
+/**
+ * Receive a chunk of output from gemini_stream_html
+ * @param ctx: Caller context
+ * @param data: Output bytes (not NUL-terminated, only valid during the call)
+ * @param len: Number of bytes
+ * @return: 0 to continue, anything else to stop the conversion
+ */
+typedef int (*GeminiWriteFn)(void *ctx, const char *data, size_t len);
+
+/**
+ * Reused block output for the single-pass converter
+ *
+ * Documents are split into blocks at headings and blank lines outside
+ * preformatted text, once the current block has grown to a few kilobytes.
+ * Lists and quotes end at such lines, so a block always renders to the
+ * same HTML wherever it appears, and the HTML of unchanged blocks is reused
+ * when a document is edited or appended to. Blocks with include lines are
+ * always rendered, since the included files may have changed.
+ *
+ * The cache must key blocks on their source and on the minify option.
+ */
+typedef struct {
+    /* Write the HTML kept for a block to write; return 1 if found, 0 if not */
+    int (*lookup)(void *ctx, const char *source, size_t len,
+                  GeminiWriteFn write, void *write_ctx);
+    /* Keep the HTML rendered for a block (html is only valid during the call) */
+    void (*store)(void *ctx, const char *source, size_t len,
+                  const char *html, size_t html_len);
+    void *ctx;
+} GeminiBlockCache;
+
+typedef struct {
+    const char *stylesheet;    /* Custom CSS stylesheet (NULL to use built-in) */
+    const char *custom_head;   /* Custom <head> content (NULL to skip) */
+    GeminiIncludeResolver include_resolver;  /* NULL drops include lines */
+    void *include_ctx;         /* Passed to include_resolver */
+    int minify;                /* No whitespace between tags; the stylesheet is
+                                  used as given, so minify it with gemini_minify_css */
+    const GeminiBlockCache *block_cache;  /* Single-pass converter only (NULL for none) */
+} GeminiRenderOptions;
+
 /**
  * Parse a Gemini document from file content
  * @param content: The raw Gemini file content as a string
@@ -51,6 +120,46 @@ typedef struct {
  */
 GeminiDocument *gemini_parse(const char *content, size_t length);
 
+/**
+ * Parse a Gemini document with options
+ * @param content: The raw Gemini file content as a string
+ * @param length: Length of the content
+ * @param options: GEMINI_PARSE_* flags
+ * @return: Parsed GeminiDocument structure
+ */
+GeminiDocument *gemini_parse_with_options(const char *content, size_t length, int options);
+
+/**
+ * Find the include lines of a document without parsing it
+ * Uses the same rules as gemini_parse_with_options with GEMINI_PARSE_INCLUDES.
+ * @param content: The raw Gemini file content
+ * @param length: Length of the content
+ * @param callback: Called for each include line, in document order
+ * @param ctx: Passed to callback
+ */
+void gemini_scan_includes(const char *content, size_t length,
+                          GeminiIncludeCallback callback, void *ctx);
+
+/**
+ * Find the link lines of a document without parsing it
+ * Link lines inside preformatted blocks are skipped, as gemini_parse does.
+ * @param content: The raw Gemini file content
+ * @param length: Length of the content
+ * @param callback: Called with the URL of each link line, in document order
+ * @param ctx: Passed to callback
+ */
+void gemini_scan_links(const char *content, size_t length,
+                       GeminiLinkCallback callback, void *ctx);
+
+/**
+ * Find the title of a document without parsing all of it
+ * Stops at the first # heading; the result matches GeminiDocument.page_title.
+ * @param content: The raw Gemini file content
+ * @param length: Length of the content
+ * @return: Title (must be freed by caller), or NULL if there is no # heading
+ */
+char *gemini_extract_title(const char *content, size_t length);
+
 /**
  * Convert parsed Gemini document to HTML
  * @param doc: Parsed Gemini document
@@ -78,6 +187,71 @@ char *gemini_to_html_with_stylesheet(GeminiDocument *doc, const char *title, con
  */
 char *gemini_to_html_with_stylesheet_and_head(GeminiDocument *doc, const char *title, const char *stylesheet, const char *custom_head);
 
+/**
+ * Convert parsed Gemini document to HTML with render options
+ * @param doc: Parsed Gemini document
+ * @param title: Optional title for the HTML document
+ * @param options: Stylesheet, head content and include resolver (NULL for defaults)
+ * @return: HTML string (must be freed by caller)
+ */
+char *gemini_to_html_with_options(GeminiDocument *doc, const char *title, const GeminiRenderOptions *options);
+
+/**
+ * Convert parsed Gemini document to an HTML fragment (body content only)
+ * Used for included documents; stylesheet and head options are ignored.
+ * @param doc: Parsed Gemini document
+ * @param options: Include resolver for nested includes (NULL for defaults)
+ * @return: HTML string (must be freed by caller)
+ */
+char *gemini_to_html_fragment(GeminiDocument *doc, const GeminiRenderOptions *options);
+
+/**
+ * Convert Gemini source straight to a complete HTML page
+ * Classifies and renders each line in a single pass, without building a
+ * GeminiDocument. Output is identical to gemini_parse_with_options followed
+ * by gemini_to_html_with_options; include lines are recognised when
+ * options->include_resolver is set.
+ * @param content: The raw Gemini file content
+ * @param length: Length of the content
+ * @param title: Optional title, used when the document has no # heading
+ * @param options: Stylesheet, head content and include resolver (NULL for defaults)
+ * @return: HTML string (must be freed by caller), or NULL on allocation failure
+ */
+char *gemini_convert_to_html(const char *content, size_t length, const char *title,
+                             const GeminiRenderOptions *options);
+
+/**
+ * Convert Gemini source to HTML in a single pass, streaming the output
+ * As gemini_convert_to_html, but output is passed to write in chunks as it
+ * is produced. Everything before the first # heading is held back until
+ * the heading is seen, since it supplies the page title.
+ * @param content: The raw Gemini file content
+ * @param length: Length of the content
+ * @param title: Optional title, used when the document has no # heading
+ * @param options: Stylesheet, head content and include resolver (NULL for defaults)
+ * @param write: Receives the output
+ * @param ctx: Passed to write
+ * @return: 0 on success, -1 if write failed or memory ran out
+ */
+int gemini_stream_html(const char *content, size_t length, const char *title,
+                       const GeminiRenderOptions *options,
+                       GeminiWriteFn write, void *ctx);
+
+/**
+ * Get the built-in stylesheet used when no custom stylesheet is set
+ * @return: CSS text (static)
+ */
+const char *gemini_builtin_stylesheet(void);
+
+/**
+ * Minify CSS: drop comments and the whitespace that does not affect
+ * parsing, and the last semicolon of each block. Strings are left alone.
+ * @param css: Stylesheet text
+ * @param length: Length of the stylesheet
+ * @return: Minified CSS (must be freed by caller), or NULL if memory ran out
+ */
+char *gemini_minify_css(const char *css, size_t length);
+
 /**
  * Free a parsed Gemini document
  * @param doc: Document to free
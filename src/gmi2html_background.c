@@ -0,0 +1,120 @@
+/*
+ * gmi2html_background - Per-process background thread for deferred renders
+ */
+
+#include "gmi2html_background.h"
+#include "apr_thread_cond.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_proc.h"
+#include <pthread.h>
+#include <sched.h>
+
+/* Most tasks waiting at once; more are refused rather than piling up */
+#define BACKGROUND_QUEUE_SIZE 64
+
+/* A queued task */
+typedef struct {
+    gmi2html_background_fn run;
+    void *data;
+} background_task;
+
+/* Per-process queue (a ring buffer guarded by queue_lock) */
+static background_task queue[BACKGROUND_QUEUE_SIZE];
+static int queue_head;
+static int queue_count;
+static int stopping;
+static apr_thread_mutex_t *queue_lock;
+static apr_thread_cond_t *queue_ready;
+static apr_thread_t *background_thread;
+
+/* Let request threads go first: idle scheduling where the system has it */
+static void lower_priority(void) {
+#ifdef SCHED_IDLE
+    struct sched_param param = { 0 };
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+}
+
+/* Background thread: run queued tasks in order until the process stops */
+static void *APR_THREAD_FUNC run_tasks(apr_thread_t *thread, void *data) {
+    (void)data;  /* Unused */
+    lower_priority();
+
+    apr_thread_mutex_lock(queue_lock);
+    for (;;) {
+        while (!queue_count && !stopping) {
+            apr_thread_cond_wait(queue_ready, queue_lock);
+        }
+        if (stopping) {
+            break;
+        }
+
+        background_task task = queue[queue_head];
+        queue_head = (queue_head + 1) % BACKGROUND_QUEUE_SIZE;
+        queue_count--;
+
+        apr_thread_mutex_unlock(queue_lock);
+        task.run(task.data);
+        apr_thread_mutex_lock(queue_lock);
+    }
+    apr_thread_mutex_unlock(queue_lock);
+
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+/* Child pool pre-cleanup: stop the thread before anything it uses goes away */
+static apr_status_t stop_background(void *data) {
+    apr_status_t status;
+
+    (void)data;  /* Unused */
+    apr_thread_mutex_lock(queue_lock);
+    stopping = 1;
+    apr_thread_cond_signal(queue_ready);
+    apr_thread_mutex_unlock(queue_lock);
+
+    apr_thread_join(&status, background_thread);
+    background_thread = NULL;
+    return APR_SUCCESS;
+}
+
+/* Start the background thread of this process */
+apr_status_t gmi2html_background_child_init(apr_pool_t *p) {
+    apr_status_t status = apr_thread_mutex_create(&queue_lock, APR_THREAD_MUTEX_DEFAULT, p);
+    if (status != APR_SUCCESS) {
+        return status;
+    }
+    status = apr_thread_cond_create(&queue_ready, p);
+    if (status != APR_SUCCESS) {
+        return status;
+    }
+    status = apr_thread_create(&background_thread, NULL, run_tasks, NULL, p);
+    if (status != APR_SUCCESS) {
+        background_thread = NULL;
+        return status;
+    }
+
+    /* Pre-cleanup, so the thread is joined before its own pool is destroyed */
+    apr_pool_pre_cleanup_register(p, NULL, stop_background);
+    return APR_SUCCESS;
+}
+
+/* Queue a task for the background thread */
+int gmi2html_background_queue(gmi2html_background_fn run, void *data) {
+    int queued = 0;
+
+    if (!background_thread) {
+        return 0;
+    }
+
+    apr_thread_mutex_lock(queue_lock);
+    if (!stopping && queue_count < BACKGROUND_QUEUE_SIZE) {
+        queue[(queue_head + queue_count) % BACKGROUND_QUEUE_SIZE] = (background_task){ run, data };
+        queue_count++;
+        apr_thread_cond_signal(queue_ready);
+        queued = 1;
+    }
+    apr_thread_mutex_unlock(queue_lock);
+
+    return queued;
+}
@@ -0,0 +1,41 @@
+#ifndef GMI2HTML_BACKGROUND_H
+#define GMI2HTML_BACKGROUND_H
+
+#include "apr_pools.h"
+
+/**
+ * Per-process background thread for renders nobody is waiting for
+ *
+ * Pre-rendering linked documents and refreshing large pages after their
+ * previous version was sent are queued here instead of being done by the
+ * worker that handled the request. One thread per process runs the tasks
+ * in order, at the lowest scheduling priority where the system has one,
+ * so request threads always go first. Tasks must not refer to a request:
+ * they own copies of everything they use.
+ */
+
+/**
+ * A queued task
+ * @param data: Task data given to gmi2html_background_queue
+ */
+typedef void (*gmi2html_background_fn)(void *data);
+
+/**
+ * Start the background thread of this process (call from child_init)
+ * The thread is stopped when p is destroyed; tasks still queued then are
+ * not run. Without the thread, nothing can be queued.
+ * @param p: Child process pool
+ * @return: APR_SUCCESS or the mutex, condition variable or thread creation status
+ */
+apr_status_t gmi2html_background_child_init(apr_pool_t *p);
+
+/**
+ * Queue a task for the background thread
+ * @param run: Function to run on the background thread
+ * @param data: Its argument; once queued, run is responsible for freeing it
+ * @return: 1 if the task was queued, 0 if there is no background thread or
+ *          the queue is full (the caller keeps data)
+ */
+int gmi2html_background_queue(gmi2html_background_fn run, void *data);
+
+#endif
@@ -0,0 +1,155 @@
+/*
+ * gmi2html_blocks - Per-process LRU cache of rendered document blocks
+ */
+
+#include "gmi2html_blocks.h"
+#include "apr_hash.h"
+#include "apr_md5.h"
+#include "apr_thread_mutex.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* A block larger than this share of the cache is not kept */
+#define BLOCK_MAX_SHARE 4
+
+/* Rendered HTML of one block (malloc'd together with the HTML) */
+typedef struct block_entry {
+    unsigned char key[APR_MD5_DIGESTSIZE];
+    struct block_entry *prev;  /* Towards the most recently used */
+    struct block_entry *next;  /* Towards the least recently used */
+    size_t len;
+    char html[];
+} block_entry;
+
+/* Per-process cache: MD5 of minify flag and source -> block_entry */
+static apr_hash_t *blocks;
+static apr_thread_mutex_t *blocks_lock;
+static block_entry *most_recent;
+static block_entry *least_recent;
+static apr_size_t blocks_size;
+static apr_size_t blocks_max_size;
+
+/* Set up the per-process block cache */
+apr_status_t gmi2html_blocks_child_init(apr_pool_t *p, apr_size_t max_size) {
+    if (!max_size) {
+        return APR_SUCCESS;
+    }
+
+    apr_status_t status = apr_thread_mutex_create(&blocks_lock, APR_THREAD_MUTEX_DEFAULT, p);
+    if (status != APR_SUCCESS) {
+        blocks_lock = NULL;
+        return status;
+    }
+    blocks = apr_hash_make(p);
+    blocks_max_size = max_size;
+    return APR_SUCCESS;
+}
+
+/* Key of a block: the minify option changes its HTML */
+static void block_key(unsigned char key[APR_MD5_DIGESTSIZE], int minify,
+                      const char *source, size_t len) {
+    apr_md5_ctx_t ctx;
+    unsigned char flag = minify ? 1 : 0;
+
+    apr_md5_init(&ctx);
+    apr_md5_update(&ctx, &flag, 1);
+    apr_md5_update(&ctx, source, len);
+    apr_md5_final(key, &ctx);
+}
+
+/* Take an entry out of the recency list (called with blocks_lock held) */
+static void unlink_entry(block_entry *entry) {
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        most_recent = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        least_recent = entry->prev;
+    }
+}
+
+/* Put an entry at the front of the recency list (called with blocks_lock held) */
+static void push_entry(block_entry *entry) {
+    entry->prev = NULL;
+    entry->next = most_recent;
+    if (most_recent) {
+        most_recent->prev = entry;
+    } else {
+        least_recent = entry;
+    }
+    most_recent = entry;
+}
+
+/* GeminiBlockCache lookup: copy out a block's HTML under the lock */
+static int lookup_block(void *ctx, const char *source, size_t len,
+                        GeminiWriteFn write, void *write_ctx) {
+    unsigned char key[APR_MD5_DIGESTSIZE];
+    int found = 0;
+
+    block_key(key, *(const int *)ctx, source, len);
+
+    apr_thread_mutex_lock(blocks_lock);
+    block_entry *entry = apr_hash_get(blocks, key, APR_MD5_DIGESTSIZE);
+    if (entry) {
+        unlink_entry(entry);
+        push_entry(entry);
+        found = write(write_ctx, entry->html, entry->len) == 0;
+    }
+    apr_thread_mutex_unlock(blocks_lock);
+
+    return found;
+}
+
+/* GeminiBlockCache store: keep a block's HTML, dropping the least recently used */
+static void store_block(void *ctx, const char *source, size_t len,
+                        const char *html, size_t html_len) {
+    if (html_len > blocks_max_size / BLOCK_MAX_SHARE) {
+        return;
+    }
+
+    block_entry *entry = malloc(sizeof(block_entry) + html_len);
+    if (!entry) {
+        return;
+    }
+    block_key(entry->key, *(const int *)ctx, source, len);
+    memcpy(entry->html, html, html_len);
+    entry->len = html_len;
+
+    apr_thread_mutex_lock(blocks_lock);
+    if (apr_hash_get(blocks, entry->key, APR_MD5_DIGESTSIZE)) {
+        /* Another request rendered the same block meanwhile */
+        apr_thread_mutex_unlock(blocks_lock);
+        free(entry);
+        return;
+    }
+
+    /* The entry holds its own key, so it is removed before it is freed */
+    apr_hash_set(blocks, entry->key, APR_MD5_DIGESTSIZE, entry);
+    push_entry(entry);
+    blocks_size += sizeof(block_entry) + html_len;
+
+    while (blocks_size > blocks_max_size && least_recent != entry) {
+        block_entry *old = least_recent;
+        unlink_entry(old);
+        apr_hash_set(blocks, old->key, APR_MD5_DIGESTSIZE, NULL);
+        blocks_size -= sizeof(block_entry) + old->len;
+        free(old);
+    }
+    apr_thread_mutex_unlock(blocks_lock);
+}
+
+/* One cache handle per value of the minify option */
+static const int minify_off = 0;
+static const int minify_on = 1;
+static const GeminiBlockCache plain_blocks = { lookup_block, store_block, (void *)&minify_off };
+static const GeminiBlockCache minified_blocks = { lookup_block, store_block, (void *)&minify_on };
+
+/* Use the block cache for a conversion */
+void gmi2html_blocks_attach(GeminiRenderOptions *options) {
+    if (blocks_lock) {
+        options->block_cache = options->minify ? &minified_blocks : &plain_blocks;
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef GMI2HTML_BLOCKS_H
+#define GMI2HTML_BLOCKS_H
+
+#include "apr_pools.h"
+#include "gemini_parser.h"
+
+/**
+ * Per-process cache of rendered blocks for Gmi2HtmlBlockCacheSize
+ *
+ * Holds the HTML of document blocks (see GeminiBlockCache), keyed by an
+ * MD5 of the block source and the minify option, so a page that changed
+ * only re-renders its changed blocks. The least recently used blocks are
+ * dropped once the cache holds more than its size limit.
+ */
+
+/**
+ * Set up the per-process block cache (call from child_init)
+ * @param p: Child process pool
+ * @param max_size: Size limit in bytes of the kept HTML (0 disables the cache)
+ * @return: APR_SUCCESS or the mutex creation status
+ */
+apr_status_t gmi2html_blocks_child_init(apr_pool_t *p, apr_size_t max_size);
+
+/**
+ * Use the block cache for a conversion
+ * Leaves options unchanged if the cache is disabled.
+ * @param options: Render options, with minify already set
+ */
+void gmi2html_blocks_attach(GeminiRenderOptions *options);
+
+#endif
@@ -0,0 +1,263 @@
+/*
+ * gmi2html_cache - Persistent on-disk cache of rendered pages
+ */
+
+#include "gmi2html_cache.h"
+#include "apr_lib.h"
+#include "apr_strings.h"
+#include "apr_time.h"
+#include "apr_tables.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Bump when the renderer output changes so old entries stop matching */
+#define CACHE_FORMAT_VERSION "gmi2html-cache-1"
+
+#define CACHE_SUFFIX ".html"
+#define CACHE_TMP_PREFIX ".tmp"
+#define CACHE_TMP_TEMPLATE CACHE_TMP_PREFIX "XXXXXX"
+#define CACHE_KEY_LEN (APR_MD5_DIGESTSIZE * 2)
+
+/* Refresh an entry's mtime on hit at most this often (approximate LRU) */
+#define CACHE_TOUCH_INTERVAL apr_time_from_sec(3600)
+
+/* Temporary files older than this are leftovers from interrupted writes */
+#define CACHE_TMP_MAX_AGE apr_time_from_sec(3600)
+
+/* Evict down to this percentage of the limit so cleaning is not constant */
+#define CACHE_LOW_WATERMARK 90
+
+typedef struct {
+    const char *path;
+    apr_off_t size;
+    apr_time_t mtime;
+} cache_entry;
+
+/* Start a cache key */
+void gmi2html_cache_key_begin(apr_md5_ctx_t *ctx) {
+    apr_md5_init(ctx);
+    apr_md5_update(ctx, CACHE_FORMAT_VERSION, sizeof(CACHE_FORMAT_VERSION));
+}
+
+/* Add a length-prefixed field so adjacent fields cannot run together */
+void gmi2html_cache_key_add(apr_md5_ctx_t *ctx, const void *data, apr_size_t len) {
+    char prefix[32];
+
+    if (!data) {
+        apr_md5_update(ctx, "-", 1);
+        return;
+    }
+
+    apr_snprintf(prefix, sizeof(prefix), "%" APR_SIZE_T_FMT ":", len);
+    apr_md5_update(ctx, prefix, strlen(prefix));
+    apr_md5_update(ctx, data, len);
+}
+
+/* Finish a cache key as lowercase hex */
+const char *gmi2html_cache_key_end(apr_md5_ctx_t *ctx, apr_pool_t *p) {
+    static const char hex[] = "0123456789abcdef";
+    unsigned char digest[APR_MD5_DIGESTSIZE];
+    char *key = apr_palloc(p, APR_MD5_DIGESTSIZE * 2 + 1);
+
+    apr_md5_final(digest, ctx);
+    for (int i = 0; i < APR_MD5_DIGESTSIZE; i++) {
+        key[i * 2] = hex[digest[i] >> 4];
+        key[i * 2 + 1] = hex[digest[i] & 0x0f];
+    }
+    key[APR_MD5_DIGESTSIZE * 2] = '\0';
+
+    return key;
+}
+
+/* Directory holding entries that share the key's first two hex digits */
+static const char *cache_dir(apr_pool_t *p, const char *root, const char *key) {
+    return apr_pstrcat(p, root, "/", apr_pstrndup(p, key, 2), NULL);
+}
+
+static const char *cache_path(apr_pool_t *p, const char *root, const char *key) {
+    return apr_pstrcat(p, cache_dir(p, root, key), "/", key, CACHE_SUFFIX, NULL);
+}
+
+/* Open a cached page for sending */
+apr_status_t gmi2html_cache_open(apr_file_t **fd, apr_off_t *size,
+                                 const char *root, const char *key,
+                                 apr_pool_t *p) {
+    const char *path = cache_path(p, root, key);
+    apr_finfo_t finfo;
+    apr_status_t status;
+
+    status = apr_file_open(fd, path, APR_READ | APR_BINARY | APR_SENDFILE_ENABLED,
+                           APR_OS_DEFAULT, p);
+    if (status != APR_SUCCESS) {
+        return status;
+    }
+
+    status = apr_file_info_get(&finfo, APR_FINFO_SIZE | APR_FINFO_MTIME, *fd);
+    if (status != APR_SUCCESS) {
+        apr_file_close(*fd);
+        return status;
+    }
+
+    /* Keep frequently used entries young so eviction removes cold ones */
+    if (apr_time_now() - finfo.mtime > CACHE_TOUCH_INTERVAL) {
+        apr_file_mtime_set(path, apr_time_now(), p);
+    }
+
+    *size = finfo.size;
+    return APR_SUCCESS;
+}
+
+/* Store a rendered page atomically */
+apr_status_t gmi2html_cache_store(const char *root, const char *key,
+                                  const char *data, apr_size_t len,
+                                  apr_pool_t *p) {
+    const char *dir = cache_dir(p, root, key);
+    char *tmp_path = apr_pstrcat(p, dir, "/" CACHE_TMP_TEMPLATE, NULL);
+    apr_file_t *tmp;
+    apr_size_t written;
+    apr_status_t status;
+
+    status = apr_dir_make_recursive(dir, APR_OS_DEFAULT, p);
+    if (status != APR_SUCCESS && !APR_STATUS_IS_EEXIST(status)) {
+        return status;
+    }
+
+    status = apr_file_mktemp(&tmp, tmp_path,
+                             APR_CREATE | APR_WRITE | APR_EXCL | APR_BINARY, p);
+    if (status != APR_SUCCESS) {
+        return status;
+    }
+
+    status = apr_file_write_full(tmp, data, len, &written);
+    if (status == APR_SUCCESS) {
+        status = apr_file_close(tmp);
+    } else {
+        apr_file_close(tmp);
+    }
+
+    /* mktemp creates the file owner-only; cached pages are not secret */
+    if (status == APR_SUCCESS) {
+        apr_file_perms_set(tmp_path, APR_UREAD | APR_UWRITE | APR_GREAD | APR_WREAD);
+        status = apr_file_rename(tmp_path, cache_path(p, root, key), p);
+    }
+
+    if (status != APR_SUCCESS) {
+        apr_file_remove(tmp_path, p);
+    }
+
+    return status;
+}
+
+/* Check that the first len characters of name are hex digits */
+static int is_hex(const char *name, apr_size_t len) {
+    for (apr_size_t i = 0; i < len; i++) {
+        if (!apr_isxdigit(name[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Names the cache creates; anything else in its directories is left alone */
+static int is_fanout_dir(const char *name) {
+    return strlen(name) == 2 && is_hex(name, 2);
+}
+
+static int is_entry_file(const char *name) {
+    return strlen(name) == CACHE_KEY_LEN + strlen(CACHE_SUFFIX) &&
+           is_hex(name, CACHE_KEY_LEN) && !strcmp(name + CACHE_KEY_LEN, CACHE_SUFFIX);
+}
+
+static int is_tmp_file(const char *name) {
+    return strlen(name) == strlen(CACHE_TMP_TEMPLATE) &&
+           !strncmp(name, CACHE_TMP_PREFIX, strlen(CACHE_TMP_PREFIX));
+}
+
+static int compare_entry_mtime(const void *a, const void *b) {
+    const cache_entry *ea = (const cache_entry *)a;
+    const cache_entry *eb = (const cache_entry *)b;
+
+    if (ea->mtime < eb->mtime) return -1;
+    if (ea->mtime > eb->mtime) return 1;
+    return 0;
+}
+
+/* Collect the entries of one fan-out directory, removing stale temp files */
+static void scan_cache_dir(apr_array_header_t *entries, apr_off_t *total,
+                           const char *dir, apr_time_t now, apr_pool_t *p) {
+    apr_dir_t *handle;
+    apr_finfo_t finfo;
+
+    if (apr_dir_open(&handle, dir, p) != APR_SUCCESS) {
+        return;
+    }
+
+    while (apr_dir_read(&finfo, APR_FINFO_NAME | APR_FINFO_TYPE |
+                        APR_FINFO_SIZE | APR_FINFO_MTIME, handle) == APR_SUCCESS) {
+        if (finfo.filetype != APR_REG) {
+            continue;
+        }
+
+        const char *path = apr_pstrcat(p, dir, "/", finfo.name, NULL);
+
+        if (is_tmp_file(finfo.name)) {
+            if (now - finfo.mtime > CACHE_TMP_MAX_AGE) {
+                apr_file_remove(path, p);
+            }
+            continue;
+        }
+        if (!is_entry_file(finfo.name)) {
+            continue;
+        }
+
+        cache_entry *entry = apr_array_push(entries);
+        entry->path = path;
+        entry->size = finfo.size;
+        entry->mtime = finfo.mtime;
+        *total += finfo.size;
+    }
+
+    apr_dir_close(handle);
+}
+
+/* Evict the oldest entries until the cache fits in max_size bytes */
+apr_status_t gmi2html_cache_clean(const char *root, apr_off_t max_size,
+                                  apr_pool_t *p) {
+    apr_array_header_t *entries = apr_array_make(p, 256, sizeof(cache_entry));
+    apr_time_t now = apr_time_now();
+    apr_off_t total = 0;
+    apr_dir_t *handle;
+    apr_finfo_t finfo;
+    apr_status_t status;
+
+    status = apr_dir_open(&handle, root, p);
+    if (status != APR_SUCCESS) {
+        return APR_STATUS_IS_ENOENT(status) ? APR_SUCCESS : status;
+    }
+
+    while (apr_dir_read(&finfo, APR_FINFO_NAME | APR_FINFO_TYPE, handle) == APR_SUCCESS) {
+        /* Only the fan-out directories; this also skips "." and ".." */
+        if (finfo.filetype == APR_DIR && is_fanout_dir(finfo.name)) {
+            scan_cache_dir(entries, &total,
+                           apr_pstrcat(p, root, "/", finfo.name, NULL), now, p);
+        }
+    }
+    apr_dir_close(handle);
+
+    if (total <= max_size) {
+        return APR_SUCCESS;
+    }
+
+    /* Oldest first; hits refresh the mtime, so this approximates LRU */
+    qsort(entries->elts, entries->nelts, sizeof(cache_entry), compare_entry_mtime);
+
+    apr_off_t target = max_size / 100 * CACHE_LOW_WATERMARK;
+    for (int i = 0; i < entries->nelts && total > target; i++) {
+        cache_entry *entry = &APR_ARRAY_IDX(entries, i, cache_entry);
+        if (apr_file_remove(entry->path, p) == APR_SUCCESS) {
+            total -= entry->size;
+        }
+    }
+
+    return APR_SUCCESS;
+}
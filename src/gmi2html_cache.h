@@ -0,0 +1,77 @@
+#ifndef GMI2HTML_CACHE_H
+#define GMI2HTML_CACHE_H
+
+#include "apr_pools.h"
+#include "apr_file_io.h"
+#include "apr_md5.h"
+
+/**
+ * Persistent on-disk render cache
+ *
+ * Rendered pages are stored under the cache root as
+ * <root>/<first two hex digits>/<md5 hex>.html, keyed by a hash of the
+ * Gemini source and every setting that affects the output. Entries are
+ * written to a temporary file and renamed into place, so readers never
+ * see a partial page and the cache survives server restarts.
+ */
+
+/**
+ * Start a cache key
+ * @param ctx: MD5 context to initialise
+ */
+void gmi2html_cache_key_begin(apr_md5_ctx_t *ctx);
+
+/**
+ * Add a length-prefixed field to a cache key
+ * @param ctx: MD5 context started with gmi2html_cache_key_begin
+ * @param data: Field bytes (NULL is hashed as an absent field)
+ * @param len: Length of the field
+ */
+void gmi2html_cache_key_add(apr_md5_ctx_t *ctx, const void *data, apr_size_t len);
+
+/**
+ * Finish a cache key
+ * @param ctx: MD5 context
+ * @param p: Pool to allocate the key from
+ * @return: 32 character lowercase hex key
+ */
+const char *gmi2html_cache_key_end(apr_md5_ctx_t *ctx, apr_pool_t *p);
+
+/**
+ * Open a cached page for sending
+ * @param fd: Receives the open file (opened with sendfile enabled)
+ * @param size: Receives the size of the cached page
+ * @param root: Cache root directory
+ * @param key: Cache key from gmi2html_cache_key_end
+ * @param p: Pool for the file handle
+ * @return: APR_SUCCESS on a hit, an error status on a miss
+ */
+apr_status_t gmi2html_cache_open(apr_file_t **fd, apr_off_t *size,
+                                 const char *root, const char *key,
+                                 apr_pool_t *p);
+
+/**
+ * Store a rendered page atomically (write to a temporary file, then rename)
+ * @param root: Cache root directory
+ * @param key: Cache key from gmi2html_cache_key_end
+ * @param data: Rendered page
+ * @param len: Length of the rendered page
+ * @param p: Scratch pool
+ * @return: APR_SUCCESS or the status of the failing file operation
+ */
+apr_status_t gmi2html_cache_store(const char *root, const char *key,
+                                  const char *data, apr_size_t len,
+                                  apr_pool_t *p);
+
+/**
+ * Evict the oldest entries until the cache fits in max_size bytes
+ * Also removes temporary files left behind by interrupted writes.
+ * @param root: Cache root directory
+ * @param max_size: Size limit in bytes
+ * @param p: Scratch pool
+ * @return: APR_SUCCESS or the status of the failing directory operation
+ */
+apr_status_t gmi2html_cache_clean(const char *root, apr_off_t max_size,
+                                  apr_pool_t *p);
+
+#endif
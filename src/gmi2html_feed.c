@@ -0,0 +1,663 @@
+/*
+ * gmi2html_feed - Incrementally maintained Atom feeds for gemlog indexes
+ */
+
+#include "gmi2html_feed.h"
+#include "gmi2html_cache.h"
+#include "gemini_parser.h"
+#include "httpd.h"
+#include "http_request.h"
+#include "apr_strings.h"
+#include "apr_file_io.h"
+#include "apr_hash.h"
+#include "apr_lib.h"
+#include "apr_tables.h"
+#include "apr_thread_mutex.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Cached feeds re-check their files at most this often */
+#define FEED_RECHECK_INTERVAL apr_time_from_sec(5)
+
+/* Summaries are cut to about this many bytes */
+#define FEED_SUMMARY_MAX 300
+
+/* At most this many feeds are kept per process */
+#define FEED_CACHE_MAX 256
+
+/* Cached feeds are templates: these mark where each response's origin and
+   directory URI go. Control characters never appear in escaped text. */
+#define FEED_ORIGIN_MARK '\x01'
+#define FEED_DIR_MARK '\x02'
+
+/* Posts are dated by day; noon UTC keeps that day in most time zones */
+#define FEED_ENTRY_TIME "T12:00:00Z"
+
+/* A file a feed was built from; size -1 records that it did not exist */
+typedef struct {
+    char *path;
+    apr_time_t mtime;
+    apr_off_t size;
+} feed_dep;
+
+/* What a feed needs from one post, in the per-process cache (malloc'd) */
+typedef struct {
+    char *title;             /* First # heading, or NULL */
+    char *summary;           /* First text line, or NULL */
+    apr_time_t mtime;
+    apr_off_t size;
+} post_entry;
+
+/* A built feed template in the per-process cache (malloc'd) */
+typedef struct {
+    char *xml;
+    apr_size_t len;
+    unsigned char digest[APR_MD5_DIGESTSIZE];  /* Of the template */
+    apr_time_t mtime;
+    feed_dep *deps;          /* The index, then every local post */
+    int dep_count;
+    char *access;            /* '1' or '0' per post: readable when built */
+    apr_time_t checked;      /* Last time the deps were stat'ed */
+} feed_entry;
+
+/* Per-process caches: post path -> post_entry, "index root" -> feed_entry */
+static apr_hash_t *post_cache;
+static apr_hash_t *feed_cache;
+static apr_thread_mutex_t *feed_lock;
+
+/* Set up the per-process feed and summary caches */
+apr_status_t gmi2html_feed_child_init(apr_pool_t *p) {
+    apr_status_t status = apr_thread_mutex_create(&feed_lock, APR_THREAD_MUTEX_DEFAULT, p);
+    if (status != APR_SUCCESS) {
+        feed_lock = NULL;
+        return status;
+    }
+    post_cache = apr_hash_make(p);
+    feed_cache = apr_hash_make(p);
+    return APR_SUCCESS;
+}
+
+/* Read a whole file of known size into a pool buffer */
+static char *read_source(const char *path, apr_off_t size, apr_pool_t *p) {
+    apr_file_t *file;
+    apr_size_t bytes_read;
+    char *content;
+
+    if (apr_file_open(&file, path, APR_READ, APR_OS_DEFAULT, p) != APR_SUCCESS) {
+        return NULL;
+    }
+
+    content = apr_palloc(p, size + 1);
+    if (apr_file_read_full(file, content, size, &bytes_read) != APR_SUCCESS ||
+        bytes_read != (apr_size_t)size) {
+        content = NULL;
+    } else {
+        content[size] = '\0';
+    }
+
+    apr_file_close(file);
+    return content;
+}
+
+/* Escape text for XML content and double-quoted attributes
+   Control characters are not allowed in XML 1.0 and are dropped */
+static const char *xml_escape(apr_pool_t *p, const char *text) {
+    apr_size_t len = 0;
+    const char *s;
+
+    for (s = text; *s; s++) {
+        switch (*s) {
+            case '<': case '>': len += 4; break;
+            case '&': len += 5; break;
+            case '"': len += 6; break;
+            default: len++; break;
+        }
+    }
+
+    char *escaped = apr_palloc(p, len + 1);
+    char *d = escaped;
+    for (s = text; *s; s++) {
+        switch (*s) {
+            case '<': memcpy(d, "&lt;", 4); d += 4; break;
+            case '>': memcpy(d, "&gt;", 4); d += 4; break;
+            case '&': memcpy(d, "&amp;", 5); d += 5; break;
+            case '"': memcpy(d, "&quot;", 6); d += 6; break;
+            default:
+                if ((unsigned char)*s >= 0x20 || *s == '\t') {
+                    *d++ = *s;
+                }
+                break;
+        }
+    }
+    *d = '\0';
+    return escaped;
+}
+
+/* RFC 3339 timestamp in UTC */
+static const char *format_time(apr_pool_t *p, apr_time_t t) {
+    apr_time_exp_t tm;
+
+    apr_time_exp_gmt(&tm, t);
+    return apr_psprintf(p, "%04d-%02d-%02dT%02d:%02d:%02dZ",
+                        tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                        tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+/* First text line of a post, cut at a UTF-8 character boundary */
+static char *post_summary(const GeminiDocument *doc) {
+    for (size_t i = 0; i < doc->line_count; i++) {
+        const GeminiLine *line = &doc->lines[i];
+        if (line->type != LINE_TYPE_TEXT || !line->content || !*line->content) {
+            continue;
+        }
+
+        size_t len = strlen(line->content);
+        if (len <= FEED_SUMMARY_MAX) {
+            return strdup(line->content);
+        }
+
+        len = FEED_SUMMARY_MAX;
+        while (len > 0 && ((unsigned char)line->content[len] & 0xc0) == 0x80) {
+            len--;
+        }
+        char *summary = malloc(len + 4);
+        if (summary) {
+            memcpy(summary, line->content, len);
+            memcpy(summary + len, "...", 4);
+        }
+        return summary;
+    }
+    return NULL;
+}
+
+static void free_post(post_entry *post) {
+    if (!post) return;
+    free(post->title);
+    free(post->summary);
+    free(post);
+}
+
+/* Parse a post for its title and summary */
+static post_entry *parse_post(const char *path, const apr_finfo_t *finfo, apr_pool_t *p) {
+    const char *content = read_source(path, finfo->size, p);
+    if (!content) {
+        return NULL;
+    }
+
+    GeminiDocument *doc = gemini_parse(content, finfo->size);
+    post_entry *post = doc ? calloc(1, sizeof(post_entry)) : NULL;
+    if (post) {
+        post->title = doc->page_title ? strdup(doc->page_title) : NULL;
+        post->summary = post_summary(doc);
+        post->mtime = finfo->mtime;
+        post->size = finfo->size;
+    }
+    gemini_document_free(doc);
+    return post;
+}
+
+/* Title and summary of a post, re-parsed only when its size or mtime changed */
+static void post_info(const char *path, const apr_finfo_t *finfo, apr_pool_t *p,
+                      const char **title, const char **summary) {
+    *title = *summary = NULL;
+
+    if (feed_lock) {
+        int found = 0;
+
+        apr_thread_mutex_lock(feed_lock);
+        post_entry *post = apr_hash_get(post_cache, path, APR_HASH_KEY_STRING);
+        if (post && post->mtime == finfo->mtime && post->size == finfo->size) {
+            *title = post->title ? apr_pstrdup(p, post->title) : NULL;
+            *summary = post->summary ? apr_pstrdup(p, post->summary) : NULL;
+            found = 1;
+        }
+        apr_thread_mutex_unlock(feed_lock);
+
+        if (found) {
+            return;
+        }
+    }
+
+    post_entry *post = parse_post(path, finfo, p);
+    if (!post) {
+        return;
+    }
+    *title = post->title ? apr_pstrdup(p, post->title) : NULL;
+    *summary = post->summary ? apr_pstrdup(p, post->summary) : NULL;
+
+    if (!feed_lock) {
+        free_post(post);
+        return;
+    }
+
+    apr_thread_mutex_lock(feed_lock);
+    post_entry *old = apr_hash_get(post_cache, path, APR_HASH_KEY_STRING);
+    if (old) {
+        /* The hash keeps the key of the first insert, which is never freed */
+        apr_hash_set(post_cache, path, APR_HASH_KEY_STRING, post);
+        free_post(old);
+    } else {
+        apr_hash_set(post_cache, strdup(path), APR_HASH_KEY_STRING, post);
+    }
+    apr_thread_mutex_unlock(feed_lock);
+}
+
+/* Split a dated link label ("2026-10-01 Title") into date and title */
+static int parse_dated_label(const char *label, const char **title) {
+    static const char pattern[] = "dddd-dd-dd";
+
+    if (!label) {
+        return 0;
+    }
+    for (int i = 0; pattern[i]; i++) {
+        if (pattern[i] == 'd' ? !apr_isdigit(label[i]) : label[i] != pattern[i]) {
+            return 0;
+        }
+    }
+    if (label[10] && !apr_isspace(label[10])) {
+        return 0;
+    }
+
+    /* "2026-10-01 - Title" and "2026-10-01: Title" are common too */
+    const char *t = label + 10;
+    while (apr_isspace(*t)) t++;
+    if ((*t == '-' || *t == ':') && apr_isspace(t[1])) {
+        t++;
+        while (apr_isspace(*t)) t++;
+    }
+    *title = t;
+    return 1;
+}
+
+/* Whether a link starts with a URI scheme ("gemini:", "https:") */
+static int has_scheme(const char *url) {
+    const char *s = url;
+
+    if (!apr_isalpha(*s)) {
+        return 0;
+    }
+    while (apr_isalnum(*s) || *s == '+' || *s == '-' || *s == '.') {
+        s++;
+    }
+    return *s == ':';
+}
+
+/* Absolute URL of a link in the index, XML-escaped, with the origin and
+   directory URI left as marks */
+static const char *absolute_url(apr_pool_t *p, const char *url) {
+    static const char origin[] = { FEED_ORIGIN_MARK, '\0' };
+    static const char origin_dir[] = { FEED_ORIGIN_MARK, FEED_DIR_MARK, '\0' };
+
+    if (has_scheme(url) || (url[0] == '/' && url[1] == '/')) {
+        return xml_escape(p, url);
+    }
+    return apr_pstrcat(p, url[0] == '/' ? origin : origin_dir, xml_escape(p, url), NULL);
+}
+
+/* Path on disk of a local .gmi post, or NULL if it is not one */
+static const char *local_post_path(apr_pool_t *p, const char *root, const char *index_dir,
+                                   const char *url) {
+    apr_size_t root_len = strlen(root);
+    apr_size_t url_len = strlen(url);
+    char *full;
+
+    while (root_len > 1 && root[root_len - 1] == '/') {
+        root_len--;
+    }
+
+    if (has_scheme(url) || (url[0] == '/' && url[1] == '/') || strpbrk(url, "?#") ||
+        url_len < 4 || strcmp(url + url_len - 4, ".gmi")) {
+        return NULL;
+    }
+
+    char *decoded = apr_pstrdup(p, url);
+    if (ap_unescape_url(decoded) != OK) {
+        return NULL;
+    }
+
+    if (apr_filepath_merge(&full, decoded[0] == '/' ? apr_pstrndup(p, root, root_len) : index_dir,
+                           decoded[0] == '/' ? decoded + 1 : decoded, 0, p) != APR_SUCCESS) {
+        return NULL;
+    }
+    if (strncmp(full, root, root_len) || full[root_len] != '/') {
+        return NULL;
+    }
+    return full;
+}
+
+/* Check with a subrequest that the request may read a file */
+static int file_readable(request_rec *r, const char *path) {
+    request_rec *rr = ap_sub_req_lookup_file(path, r, NULL);
+    int allowed = rr->status == HTTP_OK && rr->finfo.filetype == APR_REG;
+
+    ap_destroy_sub_req(rr);
+    return allowed;
+}
+
+/* Access string of a feed's posts for a request (see feed_entry) */
+static char *post_access(request_rec *r, const feed_dep *deps, int dep_count) {
+    char *access = apr_palloc(r->pool, dep_count);
+
+    for (int i = 1; i < dep_count; i++) {
+        access[i - 1] = deps[i].size >= 0 && file_readable(r, deps[i].path) ? '1' : '0';
+    }
+    access[dep_count > 0 ? dep_count - 1 : 0] = '\0';
+    return access;
+}
+
+/* Record a file the feed depends on */
+static void add_dep(apr_array_header_t *deps, const char *path, const apr_finfo_t *finfo) {
+    feed_dep *dep = apr_array_push(deps);
+    dep->path = apr_pstrdup(deps->pool, path);
+    dep->mtime = finfo ? finfo->mtime : 0;
+    dep->size = finfo ? finfo->size : -1;
+}
+
+/* Build the Atom template for an index; posts the request may not read
+   are listed with the index's label only */
+static const char *build_feed(request_rec *r, const char *index_path, const char *root,
+                              apr_array_header_t *deps, apr_array_header_t *access,
+                              apr_time_t *mtime) {
+    apr_pool_t *p = r->pool;
+    apr_finfo_t finfo;
+
+    if (apr_stat(&finfo, index_path, APR_FINFO_SIZE | APR_FINFO_MTIME, p) != APR_SUCCESS ||
+        finfo.filetype != APR_REG) {
+        return NULL;
+    }
+
+    const char *content = read_source(index_path, finfo.size, p);
+    GeminiDocument *doc = content ? gemini_parse(content, finfo.size) : NULL;
+    if (!doc) {
+        return NULL;
+    }
+
+    add_dep(deps, index_path, &finfo);
+    *mtime = finfo.mtime;
+
+    const char *index_dir = ap_make_dirstr_parent(p, index_path);
+    const char *feed_url = absolute_url(p, "");
+    apr_array_header_t *entries = apr_array_make(p, 32, sizeof(const char *));
+    const char *subtitle = NULL;
+    const char *updated = NULL;
+    int seen_title = 0;
+
+    for (size_t i = 0; i < doc->line_count; i++) {
+        const GeminiLine *line = &doc->lines[i];
+        const char *title;
+
+        /* The companion spec takes the subtitle from the first ## after the # */
+        if (line->type == LINE_TYPE_HEADING) {
+            if (line->heading_level == 1) {
+                seen_title = 1;
+            } else if (line->heading_level == 2 && seen_title && !subtitle) {
+                subtitle = line->content;
+            }
+            continue;
+        }
+
+        if (line->type != LINE_TYPE_LINK || !line->link.url ||
+            !parse_dated_label(line->link.label, &title)) {
+            continue;
+        }
+
+        const char *date = apr_pstrndup(p, line->link.label, 10);
+        const char *url = absolute_url(p, line->link.url);
+        const char *summary = NULL;
+        const char *post_path = local_post_path(p, root, index_dir, line->link.url);
+
+        if (post_path) {
+            apr_finfo_t post_finfo;
+            if (apr_stat(&post_finfo, post_path, APR_FINFO_SIZE | APR_FINFO_MTIME, p) == APR_SUCCESS &&
+                post_finfo.filetype == APR_REG) {
+                int readable = file_readable(r, post_path);
+                if (readable) {
+                    const char *post_title;
+                    post_info(post_path, &post_finfo, p, &post_title, &summary);
+                    if (!*title && post_title) {
+                        title = post_title;
+                    }
+                    if (post_finfo.mtime > *mtime) {
+                        *mtime = post_finfo.mtime;
+                    }
+                }
+                add_dep(deps, post_path, &post_finfo);
+                APR_ARRAY_PUSH(access, char) = readable ? '1' : '0';
+            } else {
+                add_dep(deps, post_path, NULL);
+                APR_ARRAY_PUSH(access, char) = '0';
+            }
+        }
+
+        if (!updated || strcmp(date, updated) > 0) {
+            updated = date;
+        }
+
+        APR_ARRAY_PUSH(entries, const char *) = apr_pstrcat(p,
+            "  <entry>\n"
+            "    <title>", xml_escape(p, *title ? title : line->link.url), "</title>\n"
+            "    <link href=\"", url, "\" rel=\"alternate\"/>\n"
+            "    <id>", url, "</id>\n"
+            "    <updated>", date, FEED_ENTRY_TIME "</updated>\n",
+            summary ? "    <summary>" : "", summary ? xml_escape(p, summary) : "",
+            summary ? "</summary>\n" : "",
+            "  </entry>\n", NULL);
+    }
+
+    static const char dir_mark[] = { FEED_DIR_MARK, '\0' };
+    const char *feed_title = doc->page_title ? xml_escape(p, doc->page_title) : dir_mark;
+    if (subtitle) {
+        subtitle = apr_pstrcat(p, "  <subtitle>", xml_escape(p, subtitle), "</subtitle>\n", NULL);
+    }
+    gemini_document_free(doc);
+
+    const char *head = apr_pstrcat(p,
+        "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+        "<feed xmlns=\"http://www.w3.org/2005/Atom\">\n"
+        "  <title>", feed_title, "</title>\n",
+        subtitle ? subtitle : "",
+        "  <link href=\"", feed_url, "\" rel=\"alternate\"/>\n"
+        "  <link href=\"", feed_url, GMI2HTML_FEED_NAME "\" rel=\"self\"/>\n"
+        "  <id>", feed_url, "</id>\n"
+        "  <updated>", updated ? apr_pstrcat(p, updated, FEED_ENTRY_TIME, NULL) : format_time(p, *mtime),
+        "</updated>\n", NULL);
+
+    return apr_pstrcat(p, head, apr_array_pstrcat(p, entries, 0), "</feed>\n", NULL);
+}
+
+static void free_feed(feed_entry *feed) {
+    if (!feed) return;
+    for (int i = 0; i < feed->dep_count; i++) {
+        free(feed->deps[i].path);
+    }
+    free(feed->deps);
+    free(feed->access);
+    free(feed->xml);
+    free(feed);
+}
+
+/* Whether every file the feed was built from is unchanged */
+static int feed_is_current(const feed_entry *feed, apr_pool_t *p) {
+    for (int i = 0; i < feed->dep_count; i++) {
+        apr_finfo_t finfo;
+        int exists = apr_stat(&finfo, feed->deps[i].path,
+                              APR_FINFO_SIZE | APR_FINFO_MTIME, p) == APR_SUCCESS;
+        if (exists != (feed->deps[i].size >= 0) ||
+            (exists && (finfo.mtime != feed->deps[i].mtime || finfo.size != feed->deps[i].size))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Fill in a feed template for one response */
+static gmi2html_feed *expand_feed(apr_pool_t *p, const char *xml, apr_size_t len,
+                                  const unsigned char *digest, apr_time_t mtime,
+                                  const char *origin, const char *dir_uri) {
+    const char *origin_xml = xml_escape(p, origin);
+    const char *dir_xml = xml_escape(p, dir_uri);
+    apr_size_t origin_len = strlen(origin_xml), dir_len = strlen(dir_xml);
+    apr_size_t out_len = len;
+    apr_md5_ctx_t md5;
+
+    for (apr_size_t i = 0; i < len; i++) {
+        if (xml[i] == FEED_ORIGIN_MARK) {
+            out_len += origin_len - 1;
+        } else if (xml[i] == FEED_DIR_MARK) {
+            out_len += dir_len - 1;
+        }
+    }
+
+    gmi2html_feed *feed = apr_palloc(p, sizeof(gmi2html_feed));
+    char *out = apr_palloc(p, out_len + 1);
+    char *d = out;
+    for (apr_size_t i = 0; i < len; i++) {
+        if (xml[i] == FEED_ORIGIN_MARK) {
+            memcpy(d, origin_xml, origin_len);
+            d += origin_len;
+        } else if (xml[i] == FEED_DIR_MARK) {
+            memcpy(d, dir_xml, dir_len);
+            d += dir_len;
+        } else {
+            *d++ = xml[i];
+        }
+    }
+    *d = '\0';
+
+    feed->xml = out;
+    feed->len = out_len;
+    feed->mtime = mtime;
+
+    gmi2html_cache_key_begin(&md5);
+    gmi2html_cache_key_add(&md5, digest, APR_MD5_DIGESTSIZE);
+    gmi2html_cache_key_add(&md5, origin, strlen(origin));
+    gmi2html_cache_key_add(&md5, dir_uri, strlen(dir_uri));
+    feed->etag = apr_pstrcat(p, "\"", gmi2html_cache_key_end(&md5, p), "\"", NULL);
+    return feed;
+}
+
+/* Make room for one more feed (called with feed_lock held) */
+static void evict_feed(void) {
+    apr_hash_index_t *hi = apr_hash_first(NULL, feed_cache);
+    const void *key;
+    void *entry;
+
+    if (hi) {
+        apr_hash_this(hi, &key, NULL, &entry);
+        apr_hash_set(feed_cache, key, APR_HASH_KEY_STRING, NULL);
+        free((void *)key);
+        free_feed(entry);
+    }
+}
+
+/* Get the Atom feed for a gemlog index */
+const gmi2html_feed *gmi2html_feed_get(request_rec *r, const char *index_path,
+                                       const char *root, const char *origin,
+                                       const char *dir_uri) {
+    apr_pool_t *p = r->pool;
+
+    /* Only the files the feed is built from are in the key; the request's
+       origin and URI are filled in per response, and what it may read is
+       checked against the entry */
+    const char *key = apr_pstrcat(p, index_path, " ", root, NULL);
+    apr_time_t now = apr_time_now();
+
+    if (!file_readable(r, index_path)) {
+        return NULL;
+    }
+
+    if (feed_lock) {
+        const char *xml = NULL;
+        apr_size_t len = 0;
+        unsigned char digest[APR_MD5_DIGESTSIZE];
+        apr_time_t mtime = 0;
+        feed_dep *deps = NULL;
+        int dep_count = 0;
+        const char *access = NULL;
+
+        apr_thread_mutex_lock(feed_lock);
+        feed_entry *entry = apr_hash_get(feed_cache, key, APR_HASH_KEY_STRING);
+        if (entry && (now - entry->checked < FEED_RECHECK_INTERVAL ||
+                      feed_is_current(entry, p))) {
+            entry->checked = now;
+            xml = apr_pmemdup(p, entry->xml, entry->len);
+            len = entry->len;
+            memcpy(digest, entry->digest, sizeof(digest));
+            mtime = entry->mtime;
+            deps = apr_pmemdup(p, entry->deps, entry->dep_count * sizeof(feed_dep));
+            dep_count = entry->dep_count;
+            for (int i = 0; i < dep_count; i++) {
+                deps[i].path = apr_pstrdup(p, deps[i].path);
+            }
+            access = apr_pstrdup(p, entry->access);
+        }
+        apr_thread_mutex_unlock(feed_lock);
+
+        /* A feed built for a request that could read other posts is rebuilt */
+        if (xml && !strcmp(post_access(r, deps, dep_count), access)) {
+            return expand_feed(p, xml, len, digest, mtime, origin, dir_uri);
+        }
+    }
+
+    apr_array_header_t *deps = apr_array_make(p, 32, sizeof(feed_dep));
+    apr_array_header_t *access = apr_array_make(p, 32, sizeof(char));
+    unsigned char digest[APR_MD5_DIGESTSIZE];
+    apr_md5_ctx_t md5;
+    apr_time_t mtime;
+
+    const char *xml = build_feed(r, index_path, root, deps, access, &mtime);
+    if (!xml) {
+        return NULL;
+    }
+    APR_ARRAY_PUSH(access, char) = '\0';
+
+    apr_size_t len = strlen(xml);
+    apr_md5_init(&md5);
+    apr_md5_update(&md5, xml, len);
+    apr_md5_final(digest, &md5);
+
+    gmi2html_feed *feed = expand_feed(p, xml, len, digest, mtime, origin, dir_uri);
+    if (!feed_lock) {
+        return feed;
+    }
+
+    feed_entry *entry = calloc(1, sizeof(feed_entry));
+    if (!entry ||
+        !(entry->deps = calloc(deps->nelts, sizeof(feed_dep))) ||
+        !(entry->access = strdup(access->elts)) ||
+        !(entry->xml = malloc(len))) {
+        free_feed(entry);
+        return feed;
+    }
+    memcpy(entry->xml, xml, len);
+    memcpy(entry->digest, digest, sizeof(digest));
+    entry->len = len;
+    entry->mtime = mtime;
+    entry->checked = now;
+    for (int i = 0; i < deps->nelts; i++) {
+        feed_dep *dep = &APR_ARRAY_IDX(deps, i, feed_dep);
+        entry->deps[i] = *dep;
+        entry->deps[i].path = strdup(dep->path);
+        entry->dep_count++;
+    }
+
+    apr_thread_mutex_lock(feed_lock);
+    feed_entry *old = apr_hash_get(feed_cache, key, APR_HASH_KEY_STRING);
+    if (old) {
+        apr_hash_set(feed_cache, key, APR_HASH_KEY_STRING, entry);
+        free_feed(old);
+    } else {
+        char *name = strdup(key);
+        if (!name) {
+            free_feed(entry);
+        } else {
+            if (apr_hash_count(feed_cache) >= FEED_CACHE_MAX) {
+                evict_feed();
+            }
+            apr_hash_set(feed_cache, name, APR_HASH_KEY_STRING, entry);
+        }
+    }
+    apr_thread_mutex_unlock(feed_lock);
+
+    return feed;
+}
@@ -0,0 +1,61 @@
+#ifndef GMI2HTML_FEED_H
+#define GMI2HTML_FEED_H
+
+#include "httpd.h"
+#include "apr_time.h"
+
+/**
+ * Atom feeds for gemlog directories
+ *
+ * A gemlog index lists its posts with dated links, as in the Gemini
+ * subscription companion spec:
+ *
+ *   => 2026-10-01-post.gmi 2026-10-01 Title
+ *
+ * The feed is built from the link lines of the parsed index. Each local
+ * post is parsed once for its summary (first paragraph) and title, and
+ * only parsed again when its size or mtime changes. Finished feeds are
+ * kept per process with the identity of every file they were built from,
+ * which is re-checked at most every few seconds. The kept feeds leave out
+ * the site origin and directory URI, which are filled in per response, so
+ * requests under other host names share one entry.
+ *
+ * Posts are only summarised for requests that may read them: each one is
+ * checked with a subrequest, and a kept feed is only reused for requests
+ * with the same access to its posts.
+ */
+
+/* The feed is served under this name in the gemlog directory */
+#define GMI2HTML_FEED_NAME "atom.xml"
+
+typedef struct {
+    const char *xml;         /* Atom document */
+    apr_size_t len;
+    const char *etag;        /* Quoted strong validator */
+    apr_time_t mtime;        /* Newest mtime of the index and its posts */
+} gmi2html_feed;
+
+/**
+ * Set up the per-process feed and summary caches (call from child_init)
+ * Without them, feeds are built on every request.
+ * @param p: Child process pool
+ * @return: APR_SUCCESS or the mutex creation status
+ */
+apr_status_t gmi2html_feed_child_init(apr_pool_t *p);
+
+/**
+ * Get the Atom feed for a gemlog index
+ * Posts the request may not read are listed with their index label only.
+ * @param r: Request for the feed; files are checked as its subrequests
+ * @param index_path: Path of the gemlog's index.gmi on disk
+ * @param root: Document root; posts outside it get no summary
+ * @param origin: Scheme, host and port of the site, without a trailing slash
+ * @param dir_uri: URI of the gemlog directory, with a trailing slash
+ * @return: Feed (in r->pool), or NULL if the index cannot be read or the
+ *          request may not read it
+ */
+const gmi2html_feed *gmi2html_feed_get(request_rec *r, const char *index_path,
+                                       const char *root, const char *origin,
+                                       const char *dir_uri);
+
+#endif
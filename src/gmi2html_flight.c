@@ -0,0 +1,215 @@
+/*
+ * gmi2html_flight - Per-process single-flight rendering and conversion limits
+ */
+
+#include "gmi2html_flight.h"
+#include "apr_strings.h"
+#include "apr_hash.h"
+#include "apr_thread_cond.h"
+#include "apr_thread_mutex.h"
+#include "apr_time.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Longest a request waits for another thread's render */
+#define FLIGHT_WAIT_TIMEOUT apr_time_from_sec(10)
+
+/* Room for a render cache key (32 hex digits) */
+#define FLIGHT_KEY_SIZE 33
+
+/* Most pages the registry keeps; past it, idle pages make room */
+#define FLIGHT_MAX_PAGES 1024
+
+/* Render state of one page (malloc'd); empty keys mean none */
+typedef struct {
+    char *page;                       /* Registry key (malloc'd) */
+    char served[FLIGHT_KEY_SIZE];     /* Output last stored or served */
+    char rendering[FLIGHT_KEY_SIZE];  /* Output being rendered */
+} flight_entry;
+
+/* Per-process registry: page -> flight_entry */
+static apr_hash_t *flights;
+static int flight_pages;
+static apr_thread_mutex_t *flight_lock;
+static apr_thread_cond_t *flight_done;
+
+/* Large conversions in progress (guarded by flight_lock) */
+static int large_renders;
+
+/* Set up the per-process render registry */
+apr_status_t gmi2html_flight_child_init(apr_pool_t *p) {
+    apr_status_t status = apr_thread_mutex_create(&flight_lock, APR_THREAD_MUTEX_DEFAULT, p);
+    if (status != APR_SUCCESS) {
+        flight_lock = NULL;
+        return status;
+    }
+    status = apr_thread_cond_create(&flight_done, p);
+    if (status != APR_SUCCESS) {
+        flight_lock = NULL;
+        return status;
+    }
+    flights = apr_hash_make(p);
+    return APR_SUCCESS;
+}
+
+/* Remove a page's entry (called with flight_lock held) */
+static void drop_entry(flight_entry *entry) {
+    apr_hash_set(flights, entry->page, APR_HASH_KEY_STRING, NULL);
+    free(entry->page);
+    free(entry);
+    flight_pages--;
+}
+
+/* Drop the entry of a page with no render in progress, if there is one
+ * (called with flight_lock held) */
+static int make_room(void) {
+    for (apr_hash_index_t *hi = apr_hash_first(NULL, flights); hi; hi = apr_hash_next(hi)) {
+        void *val;
+
+        apr_hash_this(hi, NULL, NULL, &val);
+        if (!*((flight_entry *)val)->rendering) {
+            drop_entry(val);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Find or add a page's entry (called with flight_lock held) */
+static flight_entry *get_entry(const char *page) {
+    flight_entry *entry = apr_hash_get(flights, page, APR_HASH_KEY_STRING);
+    if (entry) {
+        return entry;
+    }
+    if (flight_pages >= FLIGHT_MAX_PAGES && !make_room()) {
+        return NULL;
+    }
+
+    char *name = strdup(page);
+    entry = calloc(1, sizeof(flight_entry));
+    if (!name || !entry) {
+        free(name);
+        free(entry);
+        return NULL;
+    }
+    entry->page = name;
+    apr_hash_set(flights, name, APR_HASH_KEY_STRING, entry);
+    flight_pages++;
+    return entry;
+}
+
+/* Claim the render of a page's output */
+int gmi2html_flight_claim(apr_pool_t *p, const char *page, const char *key,
+                          const char **stale) {
+    int claimed = 1;
+
+    *stale = NULL;
+    if (!flight_lock) {
+        return 1;
+    }
+
+    apr_thread_mutex_lock(flight_lock);
+    flight_entry *entry = get_entry(page);
+    if (entry) {
+        if (*entry->served && strcmp(entry->served, key)) {
+            *stale = apr_pstrdup(p, entry->served);
+        }
+        if (!strcmp(entry->rendering, key)) {
+            claimed = 0;
+        } else {
+            /* A render of older output, if any, is left to finish unclaimed */
+            apr_cpystrn(entry->rendering, key, FLIGHT_KEY_SIZE);
+        }
+    }
+    apr_thread_mutex_unlock(flight_lock);
+
+    return claimed;
+}
+
+/* Wait for another thread to finish rendering a page's output */
+void gmi2html_flight_wait(const char *page, const char *key) {
+    if (!flight_lock) {
+        return;
+    }
+
+    apr_time_t deadline = apr_time_now() + FLIGHT_WAIT_TIMEOUT;
+
+    apr_thread_mutex_lock(flight_lock);
+    for (;;) {
+        flight_entry *entry = apr_hash_get(flights, page, APR_HASH_KEY_STRING);
+        apr_interval_time_t remaining = deadline - apr_time_now();
+        if (!entry || strcmp(entry->rendering, key) || remaining <= 0) {
+            break;
+        }
+        apr_thread_cond_timedwait(flight_done, flight_lock, remaining);
+    }
+    apr_thread_mutex_unlock(flight_lock);
+}
+
+/* End a claimed render and wake waiting threads */
+void gmi2html_flight_release(const char *page, const char *key, int stored) {
+    if (!flight_lock) {
+        return;
+    }
+
+    apr_thread_mutex_lock(flight_lock);
+    flight_entry *entry = apr_hash_get(flights, page, APR_HASH_KEY_STRING);
+    if (entry) {
+        if (!strcmp(entry->rendering, key)) {
+            *entry->rendering = '\0';
+        }
+        if (stored) {
+            apr_cpystrn(entry->served, key, FLIGHT_KEY_SIZE);
+        }
+        /* Nothing in flight and no version to fall back on: forget the page */
+        if (!*entry->rendering && !*entry->served) {
+            drop_entry(entry);
+        }
+    }
+    apr_thread_cond_broadcast(flight_done);
+    apr_thread_mutex_unlock(flight_lock);
+}
+
+/* Note that a page's output was served from the render cache */
+void gmi2html_flight_seen(const char *page, const char *key) {
+    if (!flight_lock) {
+        return;
+    }
+
+    apr_thread_mutex_lock(flight_lock);
+    flight_entry *entry = get_entry(page);
+    if (entry && strcmp(entry->served, key)) {
+        apr_cpystrn(entry->served, key, FLIGHT_KEY_SIZE);
+    }
+    apr_thread_mutex_unlock(flight_lock);
+}
+
+/* Start a large conversion, if fewer than limit are in progress */
+int gmi2html_flight_admit(int limit) {
+    int admitted = 1;
+
+    if (!flight_lock) {
+        return 1;
+    }
+
+    apr_thread_mutex_lock(flight_lock);
+    if (limit > 0 && large_renders >= limit) {
+        admitted = 0;
+    } else {
+        large_renders++;
+    }
+    apr_thread_mutex_unlock(flight_lock);
+
+    return admitted;
+}
+
+/* End a large conversion */
+void gmi2html_flight_leave(void) {
+    if (!flight_lock) {
+        return;
+    }
+
+    apr_thread_mutex_lock(flight_lock);
+    large_renders--;
+    apr_thread_mutex_unlock(flight_lock);
+}
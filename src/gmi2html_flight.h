@@ -0,0 +1,75 @@
+#ifndef GMI2HTML_FLIGHT_H
+#define GMI2HTML_FLIGHT_H
+
+#include "apr_pools.h"
+
+/**
+ * Single-flight rendering and admission control for render cache misses
+ *
+ * When a page changes, the first request to miss the render cache claims
+ * the new output and renders it. Requests for the same output that arrive
+ * meanwhile get the version of the page this process served last, or wait
+ * for the render to finish if it has none. Conversions of large sources
+ * are also counted, so a burst of them cannot occupy every worker.
+ *
+ * All state is per process. The registry remembers a bounded number of
+ * pages; those with no render in progress are forgotten to make room.
+ */
+
+/**
+ * Set up the per-process render registry (call from child_init)
+ * Without it, every request renders for itself and nothing is counted.
+ * @param p: Child process pool
+ * @return: APR_SUCCESS or the mutex or condition variable creation status
+ */
+apr_status_t gmi2html_flight_child_init(apr_pool_t *p);
+
+/**
+ * Claim the render of a page's output
+ * @param p: Pool for *stale
+ * @param page: Source the output is rendered from (usually r->filename)
+ * @param key: Render cache key of the output
+ * @param stale: Receives the cache key of the last output stored or served
+ *               for page, or NULL if there was none or it was key itself
+ * @return: 1 if the caller is to render key and then call
+ *          gmi2html_flight_release, 0 if another thread is rendering it
+ */
+int gmi2html_flight_claim(apr_pool_t *p, const char *page, const char *key,
+                          const char **stale);
+
+/**
+ * Wait for another thread to finish rendering a page's output
+ * Gives up after a few seconds, so a stuck render cannot hold requests.
+ * @param page: Source the output is rendered from
+ * @param key: Render cache key of the output
+ */
+void gmi2html_flight_wait(const char *page, const char *key);
+
+/**
+ * End a render claimed with gmi2html_flight_claim and wake waiting threads
+ * @param page: Source the output was rendered from
+ * @param key: Render cache key of the output
+ * @param stored: Whether the output is now in the render cache
+ */
+void gmi2html_flight_release(const char *page, const char *key, int stored);
+
+/**
+ * Note that a page's output was served from the render cache
+ * @param page: Source the output was rendered from
+ * @param key: Render cache key of the output
+ */
+void gmi2html_flight_seen(const char *page, const char *key);
+
+/**
+ * Start a large conversion, if fewer than limit are in progress
+ * @param limit: Maximum number of concurrent large conversions (0 for no limit)
+ * @return: 1 if the caller may convert (call gmi2html_flight_leave when done), 0 if not
+ */
+int gmi2html_flight_admit(int limit);
+
+/**
+ * End a large conversion started with gmi2html_flight_admit
+ */
+void gmi2html_flight_leave(void);
+
+#endif
@@ -0,0 +1,399 @@
+/*
+ * gmi2html_include - Cached rendering of included gemtext fragments
+ */
+
+#include "gmi2html_include.h"
+#include "gmi2html_cache.h"
+#include "gemini_parser.h"
+#include "httpd.h"
+#include "http_request.h"
+#include "apr_strings.h"
+#include "apr_file_io.h"
+#include "apr_hash.h"
+#include "apr_tables.h"
+#include "apr_thread_mutex.h"
+#include "apr_time.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Nested includes deeper than this are dropped */
+#define MAX_INCLUDE_DEPTH 8
+
+/* Cached fragments re-check their files at most this often */
+#define FRAGMENT_RECHECK_INTERVAL apr_time_from_sec(1)
+
+/* A file a fragment was rendered from */
+typedef struct {
+    char *path;
+    apr_time_t mtime;
+    apr_off_t size;
+} fragment_dep;
+
+/* A rendered fragment in the per-process cache (malloc'd, outlives requests) */
+typedef struct {
+    char *html;
+    apr_size_t html_len;
+    unsigned char digest[APR_MD5_DIGESTSIZE];
+    fragment_dep *deps;      /* The fragment itself, then everything it includes */
+    int dep_count;
+    apr_time_t checked;      /* Last time the deps were stat'ed */
+} fragment_entry;
+
+/* A fragment resolved for one page (pool copies) */
+typedef struct {
+    const char *html;
+    unsigned char digest[APR_MD5_DIGESTSIZE];
+} resolved_fragment;
+
+struct gmi2html_include_ctx {
+    apr_pool_t *pool;
+    request_rec *r;              /* Request includes are looked up for (NULL: none) */
+    const char *filename;        /* Page or fragment being rendered */
+    const char *base_dir;        /* Relative include paths start here */
+    const gmi2html_include_ctx *parent;  /* Including document, for cycles */
+    apr_hash_t *resolved;        /* Path as written -> resolved_fragment */
+    apr_array_header_t *deps;    /* fragment_dep of everything resolved so far */
+    int depth;                   /* Nesting level of the page being rendered */
+    int minify;                  /* Fragments are rendered minified, like the page */
+    int cut;                     /* An include was dropped by access rules or a cycle */
+    apr_md5_ctx_t *key;          /* Cache key being built by key_add */
+};
+
+/* Per-process fragment caches, readable and minified output:
+   absolute path -> fragment_entry */
+static apr_hash_t *fragment_cache[2];
+static apr_thread_mutex_t *fragment_lock;
+
+/* Set up the per-process fragment cache */
+apr_status_t gmi2html_include_child_init(apr_pool_t *p) {
+    apr_status_t status = apr_thread_mutex_create(&fragment_lock, APR_THREAD_MUTEX_DEFAULT, p);
+    if (status != APR_SUCCESS) {
+        fragment_lock = NULL;
+        return status;
+    }
+    fragment_cache[0] = apr_hash_make(p);
+    fragment_cache[1] = apr_hash_make(p);
+    return APR_SUCCESS;
+}
+
+static gmi2html_include_ctx *make_ctx(apr_pool_t *p, request_rec *r, const char *filename,
+                                      const gmi2html_include_ctx *parent, int minify) {
+    gmi2html_include_ctx *ctx = apr_pcalloc(p, sizeof(gmi2html_include_ctx));
+
+    ctx->pool = p;
+    ctx->r = r;
+    ctx->filename = filename;
+    ctx->base_dir = ap_make_dirstr_parent(p, filename);
+    ctx->parent = parent;
+    ctx->depth = parent ? parent->depth + 1 : 0;
+    ctx->minify = minify != 0;
+    ctx->resolved = apr_hash_make(p);
+    ctx->deps = apr_array_make(p, 4, sizeof(fragment_dep));
+    return ctx;
+}
+
+/* Create the include context for one page */
+gmi2html_include_ctx *gmi2html_include_ctx_make(request_rec *r, int minify) {
+    return make_ctx(r->pool, r, r->filename, NULL, minify);
+}
+
+/* Whether a file is the page or one of the fragments being rendered */
+static int in_include_stack(const gmi2html_include_ctx *ctx, const char *path) {
+    for (; ctx; ctx = ctx->parent) {
+        if (!strcmp(ctx->filename, path)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int has_gmi_suffix(const char *path) {
+    apr_size_t len = strlen(path);
+    return len > 4 && !strcmp(path + len - 4, ".gmi");
+}
+
+/* Check with a subrequest that the request may read an included file */
+static int lookup_file(gmi2html_include_ctx *ctx, const char *filename) {
+    if (!ctx->r) {
+        return 0;
+    }
+
+    request_rec *rr = ap_sub_req_lookup_file(filename, ctx->r, NULL);
+    int allowed = rr->status == HTTP_OK && rr->finfo.filetype == APR_REG;
+
+    ap_destroy_sub_req(rr);
+    return allowed;
+}
+
+/* Absolute path of an include the request may read, or NULL */
+static const char *resolve_path(gmi2html_include_ctx *ctx, const char *path) {
+    const char *full = NULL;
+    request_rec *rr;
+
+    if (!has_gmi_suffix(path)) {
+        return NULL;
+    }
+    if (!ctx->r) {
+        ctx->cut = 1;
+        return NULL;
+    }
+
+    /* The lookup applies Apache's mapping and access rules to the include:
+       "/x.gmi" is a URL path, anything else is relative to the document */
+    if (path[0] == '/') {
+        rr = ap_sub_req_lookup_uri(path, ctx->r, NULL);
+    } else {
+        char *merged;
+        if (apr_filepath_merge(&merged, ctx->base_dir, path, 0, ctx->pool) != APR_SUCCESS) {
+            return NULL;
+        }
+        rr = ap_sub_req_lookup_file(merged, ctx->r, NULL);
+    }
+
+    if (rr->status != HTTP_OK) {
+        ctx->cut = 1;
+    } else if (rr->finfo.filetype == APR_REG && rr->filename && has_gmi_suffix(rr->filename)) {
+        full = apr_pstrdup(ctx->pool, rr->filename);
+    }
+    ap_destroy_sub_req(rr);
+
+    /* A file that includes itself, directly or not, is included once */
+    if (full && in_include_stack(ctx, full)) {
+        ctx->cut = 1;
+        return NULL;
+    }
+    return full;
+}
+
+static void free_entry(fragment_entry *entry) {
+    if (!entry) return;
+    for (int i = 0; i < entry->dep_count; i++) {
+        free(entry->deps[i].path);
+    }
+    free(entry->deps);
+    free(entry->html);
+    free(entry);
+}
+
+/* Whether every file the fragment was rendered from is unchanged */
+static int entry_is_current(const fragment_entry *entry, apr_pool_t *p) {
+    for (int i = 0; i < entry->dep_count; i++) {
+        apr_finfo_t finfo;
+        if (apr_stat(&finfo, entry->deps[i].path, APR_FINFO_SIZE | APR_FINFO_MTIME, p) != APR_SUCCESS ||
+            finfo.mtime != entry->deps[i].mtime || finfo.size != entry->deps[i].size) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Copy a cached fragment into the page's pool and record its dependencies */
+static void copy_entry(gmi2html_include_ctx *ctx, resolved_fragment *out,
+                       const fragment_entry *entry) {
+    out->html = apr_pstrmemdup(ctx->pool, entry->html, entry->html_len);
+    memcpy(out->digest, entry->digest, sizeof(out->digest));
+
+    for (int i = 0; i < entry->dep_count; i++) {
+        fragment_dep *dep = apr_array_push(ctx->deps);
+        dep->path = apr_pstrdup(ctx->pool, entry->deps[i].path);
+        dep->mtime = entry->deps[i].mtime;
+        dep->size = entry->deps[i].size;
+    }
+}
+
+/* Check the files a cached fragment includes, from index first of ctx->deps:
+   the request must be allowed to read them, and none may be in the stack */
+static int deps_allowed(gmi2html_include_ctx *ctx, int first) {
+    for (int i = first; i < ctx->deps->nelts; i++) {
+        const char *path = APR_ARRAY_IDX(ctx->deps, i, fragment_dep).path;
+        if (in_include_stack(ctx, path) || !lookup_file(ctx, path)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Parse and render one fragment file into a new cache entry
+ * (*cut is set if an include inside it was dropped for this request only) */
+static fragment_entry *render_fragment(gmi2html_include_ctx *ctx, const char *path, int *cut) {
+    apr_pool_t *scratch;
+    apr_finfo_t finfo;
+    fragment_entry *entry = NULL;
+
+    if (ctx->depth >= MAX_INCLUDE_DEPTH ||
+        apr_pool_create(&scratch, ctx->pool) != APR_SUCCESS) {
+        return NULL;
+    }
+
+    apr_file_t *file;
+    char *content = NULL;
+    apr_size_t bytes_read;
+    if (apr_stat(&finfo, path, APR_FINFO_SIZE | APR_FINFO_MTIME, scratch) == APR_SUCCESS &&
+        finfo.filetype == APR_REG &&
+        apr_file_open(&file, path, APR_READ, APR_OS_DEFAULT, scratch) == APR_SUCCESS) {
+        content = apr_palloc(scratch, finfo.size + 1);
+        if (apr_file_read_full(file, content, finfo.size, &bytes_read) != APR_SUCCESS ||
+            bytes_read != (apr_size_t)finfo.size) {
+            content = NULL;
+        }
+        apr_file_close(file);
+    }
+
+    if (!content) {
+        apr_pool_destroy(scratch);
+        return NULL;
+    }
+    content[finfo.size] = '\0';
+
+    /* Nested includes resolve relative to the fragment's own directory */
+    gmi2html_include_ctx *nested = make_ctx(scratch, ctx->r, path, ctx, ctx->minify);
+
+    GeminiRenderOptions options = {0};
+    options.minify = ctx->minify;
+    options.include_resolver = gmi2html_include_resolve;
+    options.include_ctx = nested;
+
+    GeminiDocument *doc = gemini_parse_with_options(content, finfo.size, GEMINI_PARSE_INCLUDES);
+    char *html = gemini_to_html_fragment(doc, &options);
+    gemini_document_free(doc);
+    *cut = nested->cut;
+
+    if (html && (entry = calloc(1, sizeof(fragment_entry))) &&
+        (entry->deps = calloc(nested->deps->nelts + 1, sizeof(fragment_dep)))) {
+        apr_md5_ctx_t md5;
+
+        entry->html = html;
+        entry->html_len = strlen(html);
+        apr_md5_init(&md5);
+        apr_md5_update(&md5, html, entry->html_len);
+        apr_md5_final(entry->digest, &md5);
+        html = NULL;
+
+        entry->deps[0].path = strdup(path);
+        entry->deps[0].mtime = finfo.mtime;
+        entry->deps[0].size = finfo.size;
+        entry->dep_count = 1;
+        for (int i = 0; i < nested->deps->nelts; i++) {
+            fragment_dep *dep = &APR_ARRAY_IDX(nested->deps, i, fragment_dep);
+            entry->deps[i + 1] = *dep;
+            entry->deps[i + 1].path = strdup(dep->path);
+            entry->dep_count++;
+        }
+        entry->checked = apr_time_now();
+    } else if (entry) {
+        free(entry);
+        entry = NULL;
+    }
+
+    gemini_html_free(html);
+    apr_pool_destroy(scratch);
+    return entry;
+}
+
+/* Look up a fragment in the process cache, rendering it if missing or stale */
+static int get_fragment(gmi2html_include_ctx *ctx, const char *path,
+                        resolved_fragment *out) {
+    if (fragment_lock) {
+        apr_time_t now = apr_time_now();
+        int first = ctx->deps->nelts + 1;
+        int found = 0;
+
+        apr_thread_mutex_lock(fragment_lock);
+        fragment_entry *entry = apr_hash_get(fragment_cache[ctx->minify], path,
+                                             APR_HASH_KEY_STRING);
+        if (entry && (now - entry->checked < FRAGMENT_RECHECK_INTERVAL ||
+                      entry_is_current(entry, ctx->pool))) {
+            entry->checked = now;
+            copy_entry(ctx, out, entry);
+            found = 1;
+        }
+        apr_thread_mutex_unlock(fragment_lock);
+
+        /* The fragment itself was checked by the caller, its includes are
+           checked here; if one is refused, render it for this request */
+        if (found && deps_allowed(ctx, first)) {
+            return 1;
+        }
+        if (found) {
+            ctx->deps->nelts = first - 1;
+            out->html = NULL;
+        }
+    }
+
+    /* Render without holding the lock; nested includes take it again */
+    int cut;
+    fragment_entry *entry = render_fragment(ctx, path, &cut);
+    if (!entry) {
+        return 0;
+    }
+    copy_entry(ctx, out, entry);
+
+    /* A fragment missing an include only this request may not see, or one
+       cut short by a cycle, is not kept for other pages */
+    if (cut) {
+        ctx->cut = 1;
+    }
+    if (!fragment_lock || cut) {
+        free_entry(entry);
+        return 1;
+    }
+
+    apr_thread_mutex_lock(fragment_lock);
+    apr_hash_t *cache = fragment_cache[ctx->minify];
+    fragment_entry *old = apr_hash_get(cache, path, APR_HASH_KEY_STRING);
+    if (old) {
+        /* The hash keeps the key of the first insert, which is never freed */
+        apr_hash_set(cache, path, APR_HASH_KEY_STRING, entry);
+        free_entry(old);
+    } else {
+        apr_hash_set(cache, strdup(path), APR_HASH_KEY_STRING, entry);
+    }
+    apr_thread_mutex_unlock(fragment_lock);
+
+    return 1;
+}
+
+/* Resolve an include path once per page */
+static resolved_fragment *resolve(gmi2html_include_ctx *ctx, const char *path) {
+    resolved_fragment *fragment = apr_hash_get(ctx->resolved, path, APR_HASH_KEY_STRING);
+    if (fragment) {
+        return fragment->html ? fragment : NULL;
+    }
+
+    fragment = apr_pcalloc(ctx->pool, sizeof(resolved_fragment));
+    apr_hash_set(ctx->resolved, apr_pstrdup(ctx->pool, path), APR_HASH_KEY_STRING, fragment);
+
+    const char *full = resolve_path(ctx, path);
+    if (!full || !get_fragment(ctx, full, fragment)) {
+        return NULL;
+    }
+    return fragment;
+}
+
+/* GeminiIncludeResolver for an include context */
+const char *gmi2html_include_resolve(void *ctx, const char *path) {
+    resolved_fragment *fragment = resolve((gmi2html_include_ctx *)ctx, path);
+    return fragment ? fragment->html : NULL;
+}
+
+/* gemini_scan_includes callback: fold each fragment's digest into the key */
+static void add_include_to_key(void *data, const char *path, size_t len) {
+    gmi2html_include_ctx *ctx = (gmi2html_include_ctx *)data;
+    const char *written = apr_pstrmemdup(ctx->pool, path, len);
+    resolved_fragment *fragment = resolve(ctx, written);
+
+    gmi2html_cache_key_add(ctx->key, written, len);
+    if (fragment) {
+        gmi2html_cache_key_add(ctx->key, fragment->digest, sizeof(fragment->digest));
+    } else {
+        gmi2html_cache_key_add(ctx->key, NULL, 0);
+    }
+}
+
+/* Resolve every include line of a page and add the fragment digests to a key */
+void gmi2html_include_key_add(gmi2html_include_ctx *ctx, apr_md5_ctx_t *key,
+                              const char *content, apr_size_t len) {
+    ctx->key = key;
+    gemini_scan_includes(content, len, add_include_to_key, ctx);
+    ctx->key = NULL;
+}
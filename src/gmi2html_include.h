@@ -0,0 +1,63 @@
+#ifndef GMI2HTML_INCLUDE_H
+#define GMI2HTML_INCLUDE_H
+
+#include "httpd.h"
+#include "apr_pools.h"
+#include "apr_md5.h"
+
+/**
+ * Gemtext include support ("%include <path>" lines)
+ *
+ * Included documents are parsed and rendered once per process and kept
+ * as HTML fragments, together with the identity (size and mtime) of the
+ * fragment and of everything it includes in turn. A fragment is only
+ * re-rendered when one of those files changes, and pages that include
+ * it pick up the new version through the fragment digest in their
+ * render cache key.
+ *
+ * Only .gmi files are included, and only if a subrequest for them
+ * succeeds, so Apache's mapping and access rules apply to every file a
+ * page includes. A file already being rendered higher up is not
+ * included again.
+ */
+
+typedef struct gmi2html_include_ctx gmi2html_include_ctx;
+
+/**
+ * Set up the per-process fragment cache (call from child_init)
+ * Without it, fragments are rendered on every use.
+ * @param p: Child process pool
+ * @return: APR_SUCCESS or the mutex creation status
+ */
+apr_status_t gmi2html_include_child_init(apr_pool_t *p);
+
+/**
+ * Create the include context for one page
+ * Relative include paths start from the directory of r->filename.
+ * @param r: Request for the page; includes are looked up as its subrequests
+ * @param minify: Render fragments minified (pass the page's minify option;
+ *                each setting has its own fragment cache)
+ * @return: New context (in the request pool)
+ */
+gmi2html_include_ctx *gmi2html_include_ctx_make(request_rec *r, int minify);
+
+/**
+ * Resolve every include line of a page and add the fragment digests to a
+ * render cache key, so the key changes whenever an included file does
+ * @param ctx: Include context for the page
+ * @param key: Cache key being built
+ * @param content: Raw Gemini source of the page
+ * @param len: Length of the source
+ */
+void gmi2html_include_key_add(gmi2html_include_ctx *ctx, apr_md5_ctx_t *key,
+                              const char *content, apr_size_t len);
+
+/**
+ * GeminiIncludeResolver for an include context
+ * @param ctx: gmi2html_include_ctx for the page
+ * @param path: Path as written on the include line
+ * @return: Rendered fragment (in the context pool), or NULL if it cannot be included
+ */
+const char *gmi2html_include_resolve(void *ctx, const char *path);
+
+#endif
@@ -0,0 +1,339 @@
+/*
+ * gmi2html_index - Cached gemtext listings of directories without an index.gmi
+ */
+
+#include "gmi2html_index.h"
+#include "gemini_parser.h"
+#include "httpd.h"
+#include "http_request.h"
+#include "apr_strings.h"
+#include "apr_file_io.h"
+#include "apr_hash.h"
+#include "apr_tables.h"
+#include "apr_thread_mutex.h"
+#include "apr_time.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Cached listings are re-scanned at most this often for in-place edits */
+#define LISTING_RECHECK_INTERVAL apr_time_from_sec(5)
+
+/* A child document's title in the per-process cache (malloc'd) */
+typedef struct {
+    char *title;             /* NULL if the document has no # heading */
+    apr_time_t mtime;
+    apr_off_t size;
+} title_entry;
+
+/* A scanned directory in the per-process cache (malloc'd); items are
+   records of a type character ('d' or 'f'), then the name and the title
+   (empty if none), each NUL-terminated, sorted for display */
+typedef struct {
+    char *items;
+    apr_size_t len;
+    apr_time_t dir_mtime;
+    apr_time_t checked;      /* When the listing was generated */
+} listing_entry;
+
+/* One directory entry while building a listing */
+typedef struct {
+    const char *name;
+    const char *title;
+    int is_dir;
+} index_item;
+
+/* Per-process caches: file path -> title_entry, directory -> listing_entry */
+static apr_hash_t *title_cache;
+static apr_hash_t *listing_cache;
+static apr_thread_mutex_t *index_lock;
+
+/* Set up the per-process listing and title caches */
+apr_status_t gmi2html_index_child_init(apr_pool_t *p) {
+    apr_status_t status = apr_thread_mutex_create(&index_lock, APR_THREAD_MUTEX_DEFAULT, p);
+    if (status != APR_SUCCESS) {
+        index_lock = NULL;
+        return status;
+    }
+    title_cache = apr_hash_make(p);
+    listing_cache = apr_hash_make(p);
+    return APR_SUCCESS;
+}
+
+/* Read a document and find its title (malloc'd, NULL if none) */
+static char *read_title(const char *path, apr_off_t size, apr_pool_t *p) {
+    apr_file_t *file;
+    apr_size_t bytes_read;
+    char *title = NULL;
+
+    if (apr_file_open(&file, path, APR_READ, APR_OS_DEFAULT, p) != APR_SUCCESS) {
+        return NULL;
+    }
+
+    char *content = apr_palloc(p, size + 1);
+    if (apr_file_read_full(file, content, size, &bytes_read) == APR_SUCCESS &&
+        bytes_read == (apr_size_t)size) {
+        title = gemini_extract_title(content, size);
+    }
+
+    apr_file_close(file);
+    return title;
+}
+
+/* Title of a child document, re-read only when its size or mtime changed */
+static const char *child_title(const char *path, const apr_finfo_t *finfo, apr_pool_t *p) {
+    if (index_lock) {
+        const char *title = NULL;
+        int found = 0;
+
+        apr_thread_mutex_lock(index_lock);
+        title_entry *entry = apr_hash_get(title_cache, path, APR_HASH_KEY_STRING);
+        if (entry && entry->mtime == finfo->mtime && entry->size == finfo->size) {
+            title = entry->title ? apr_pstrdup(p, entry->title) : NULL;
+            found = 1;
+        }
+        apr_thread_mutex_unlock(index_lock);
+
+        if (found) {
+            return title;
+        }
+    }
+
+    char *title = read_title(path, finfo->size, p);
+    const char *result = title ? apr_pstrdup(p, title) : NULL;
+
+    if (!index_lock) {
+        free(title);
+        return result;
+    }
+
+    title_entry *entry = malloc(sizeof(title_entry));
+    if (!entry) {
+        free(title);
+        return result;
+    }
+    entry->title = title;
+    entry->mtime = finfo->mtime;
+    entry->size = finfo->size;
+
+    apr_thread_mutex_lock(index_lock);
+    title_entry *old = apr_hash_get(title_cache, path, APR_HASH_KEY_STRING);
+    if (old) {
+        /* The hash keeps the key of the first insert, which is never freed */
+        apr_hash_set(title_cache, path, APR_HASH_KEY_STRING, entry);
+        free(old->title);
+        free(old);
+    } else {
+        apr_hash_set(title_cache, strdup(path), APR_HASH_KEY_STRING, entry);
+    }
+    apr_thread_mutex_unlock(index_lock);
+
+    return result;
+}
+
+/* Directories first, then by name */
+static int compare_items(const void *a, const void *b) {
+    const index_item *ia = (const index_item *)a;
+    const index_item *ib = (const index_item *)b;
+
+    if (ia->is_dir != ib->is_dir) {
+        return ib->is_dir - ia->is_dir;
+    }
+    return strcmp(ia->name, ib->name);
+}
+
+/* Link label text: one gemtext line, so no line breaks */
+static const char *label_text(const char *text, apr_pool_t *p) {
+    if (!strpbrk(text, "\r\n")) {
+        return text;
+    }
+
+    char *label = apr_pstrdup(p, text);
+    for (char *c = label; *c; c++) {
+        if (*c == '\r' || *c == '\n') {
+            *c = ' ';
+        }
+    }
+    return label;
+}
+
+/* Scan a directory into sorted item records (see listing_entry) */
+static char *scan_directory(const char *dir, apr_pool_t *p, apr_size_t *len) {
+    apr_array_header_t *items = apr_array_make(p, 32, sizeof(index_item));
+    apr_dir_t *handle;
+    apr_finfo_t finfo;
+    apr_int32_t wanted = APR_FINFO_NAME | APR_FINFO_TYPE | APR_FINFO_SIZE | APR_FINFO_MTIME;
+
+    if (apr_dir_open(&handle, dir, p) != APR_SUCCESS) {
+        return NULL;
+    }
+
+    while (apr_dir_read(&finfo, wanted, handle) == APR_SUCCESS) {
+        /* Skip hidden files along with "." and ".." */
+        if (finfo.name[0] == '.') {
+            continue;
+        }
+
+        const char *path = apr_pstrcat(p, dir, finfo.name, NULL);
+
+        /* List what a symlink points to, and leave out dangling ones */
+        if (finfo.filetype == APR_LNK) {
+            const char *name = finfo.name;
+            if (apr_stat(&finfo, path, wanted & ~APR_FINFO_NAME, p) != APR_SUCCESS) {
+                continue;
+            }
+            finfo.name = name;
+        }
+
+        if (finfo.filetype != APR_REG && finfo.filetype != APR_DIR) {
+            continue;
+        }
+
+        index_item *item = apr_array_push(items);
+        item->name = apr_pstrdup(p, finfo.name);
+        item->is_dir = finfo.filetype == APR_DIR;
+        item->title = NULL;
+
+        size_t name_len = strlen(item->name);
+        if (!item->is_dir && name_len > 4 && !strcmp(item->name + name_len - 4, ".gmi")) {
+            item->title = child_title(path, &finfo, p);
+        }
+    }
+    apr_dir_close(handle);
+
+    qsort(items->elts, items->nelts, sizeof(index_item), compare_items);
+
+    apr_size_t total = 0;
+    for (int i = 0; i < items->nelts; i++) {
+        index_item *item = &APR_ARRAY_IDX(items, i, index_item);
+        total += strlen(item->name) + (item->title ? strlen(item->title) : 0) + 3;
+    }
+
+    char *block = apr_palloc(p, total + 1);
+    char *d = block;
+    for (int i = 0; i < items->nelts; i++) {
+        index_item *item = &APR_ARRAY_IDX(items, i, index_item);
+        *d++ = item->is_dir ? 'd' : 'f';
+        d = apr_cpystrn(d, item->name, strlen(item->name) + 1) + 1;
+        d = apr_cpystrn(d, item->title ? item->title : "", total + 1 - (d - block)) + 1;
+    }
+    *len = total;
+    return block;
+}
+
+/* Whether the request may see a directory entry, as mod_autoindex decides:
+   its subrequest must succeed, or for a directory, redirect */
+static int entry_visible(request_rec *r, const char *name, int is_dir) {
+    apr_finfo_t dirent;
+
+    memset(&dirent, 0, sizeof(dirent));
+    dirent.name = name;
+    dirent.filetype = is_dir ? APR_DIR : APR_REG;
+
+    request_rec *rr = ap_sub_req_lookup_dirent(&dirent, r, AP_SUBREQ_NO_ARGS, NULL);
+    int visible = (rr->finfo.filetype == APR_REG || rr->finfo.filetype == APR_DIR) &&
+                  (rr->status == HTTP_OK ||
+                   (rr->finfo.filetype == APR_DIR && ap_is_HTTP_REDIRECT(rr->status)));
+    ap_destroy_sub_req(rr);
+    return visible;
+}
+
+/* Write the listing of the entries the request may see as gemtext */
+static char *format_listing(request_rec *r, const char *items, apr_size_t len) {
+    apr_pool_t *p = r->pool;
+    apr_array_header_t *lines = apr_array_make(p, 32, sizeof(const char *));
+
+    /* The URI is shown percent-encoded, since page titles are not escaped */
+    APR_ARRAY_PUSH(lines, const char *) = apr_pstrcat(p, "# Index of ", ap_escape_uri(p, r->uri),
+                                                      "\n\n", NULL);
+    if (strcmp(r->uri, "/")) {
+        APR_ARRAY_PUSH(lines, const char *) = "=> ../ Parent directory\n";
+    }
+
+    for (const char *record = items; record < items + len; ) {
+        int is_dir = record[0] == 'd';
+        const char *name = record + 1;
+        const char *title = name + strlen(name) + 1;
+        record = title + strlen(title) + 1;
+
+        if (!entry_visible(r, name, is_dir)) {
+            continue;
+        }
+
+        const char *suffix = is_dir ? "/" : "";
+        const char *label = *title ? title : apr_pstrcat(p, name, suffix, NULL);
+
+        APR_ARRAY_PUSH(lines, const char *) =
+            apr_pstrcat(p, "=> ", ap_escape_path_segment(p, name), suffix,
+                        " ", label_text(label, p), "\n", NULL);
+    }
+
+    return apr_array_pstrcat(p, lines, 0);
+}
+
+/* Get the gemtext listing of a directory */
+const char *gmi2html_index_listing(request_rec *r, apr_size_t *len) {
+    apr_pool_t *p = r->pool;
+    const char *dir = r->filename;
+    apr_finfo_t dir_finfo;
+    apr_time_t now = apr_time_now();
+
+    if (apr_stat(&dir_finfo, dir, APR_FINFO_MTIME, p) != APR_SUCCESS) {
+        return NULL;
+    }
+
+    if (index_lock) {
+        const char *items = NULL;
+        apr_size_t items_len = 0;
+
+        apr_thread_mutex_lock(index_lock);
+        listing_entry *entry = apr_hash_get(listing_cache, dir, APR_HASH_KEY_STRING);
+        if (entry && entry->dir_mtime == dir_finfo.mtime &&
+            now - entry->checked < LISTING_RECHECK_INTERVAL) {
+            items = apr_pmemdup(p, entry->items, entry->len);
+            items_len = entry->len;
+        }
+        apr_thread_mutex_unlock(index_lock);
+
+        if (items) {
+            const char *gemtext = format_listing(r, items, items_len);
+            *len = strlen(gemtext);
+            return gemtext;
+        }
+    }
+
+    apr_size_t items_len;
+    char *items = scan_directory(dir, p, &items_len);
+    if (!items) {
+        return NULL;
+    }
+
+    const char *gemtext = format_listing(r, items, items_len);
+    *len = strlen(gemtext);
+
+    if (!index_lock) {
+        return gemtext;
+    }
+
+    listing_entry *entry = malloc(sizeof(listing_entry));
+    if (!entry || !(entry->items = malloc(items_len + 1))) {
+        free(entry);
+        return gemtext;
+    }
+    memcpy(entry->items, items, items_len);
+    entry->len = items_len;
+    entry->dir_mtime = dir_finfo.mtime;
+    entry->checked = now;
+
+    apr_thread_mutex_lock(index_lock);
+    listing_entry *old = apr_hash_get(listing_cache, dir, APR_HASH_KEY_STRING);
+    if (old) {
+        apr_hash_set(listing_cache, dir, APR_HASH_KEY_STRING, entry);
+        free(old->items);
+        free(old);
+    } else {
+        apr_hash_set(listing_cache, strdup(dir), APR_HASH_KEY_STRING, entry);
+    }
+    apr_thread_mutex_unlock(index_lock);
+
+    return gemtext;
+}
@@ -0,0 +1,39 @@
+#ifndef GMI2HTML_INDEX_H
+#define GMI2HTML_INDEX_H
+
+#include "httpd.h"
+
+/**
+ * Generated directory listings
+ *
+ * A directory without an index.gmi is listed as gemtext: one link line
+ * per entry, labelled with the first # heading of .gmi files. Listings
+ * are kept per process and rebuilt when the directory's mtime changes.
+ * Editing a file in place does not touch the directory, so a listing is
+ * also rebuilt at most every few seconds; child titles come from a
+ * per-file title cache, so a rebuild only re-reads files that changed.
+ *
+ * What is cached is the scanned directory; the entries each request may
+ * see are picked per request, the way mod_autoindex does it, by a
+ * subrequest for each entry.
+ */
+
+/**
+ * Set up the per-process listing and title caches (call from child_init)
+ * Without them, listings are generated on every request.
+ * @param p: Child process pool
+ * @return: APR_SUCCESS or the mutex creation status
+ */
+apr_status_t gmi2html_index_child_init(apr_pool_t *p);
+
+/**
+ * Get the gemtext listing of a directory
+ * Entries are listed only if their subrequest succeeds (or, for a
+ * directory, redirects), so access rules hide them as they hide pages.
+ * @param r: Request for the directory; r->filename and r->uri both end in a slash
+ * @param len: Receives the length of the listing
+ * @return: Gemtext listing (in r->pool), or NULL if the directory cannot be read
+ */
+const char *gmi2html_index_listing(request_rec *r, apr_size_t *len);
+
+#endif
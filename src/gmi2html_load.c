@@ -0,0 +1,498 @@
+/*
+ * gmi2html-load - Concurrent HTTP/1.1 load generator for the benchmark suite
+ *
+ * Each of -c threads holds one keep-alive connection and sends a GET as
+ * soon as the previous response has been read (a closed loop), picking
+ * URLs at random from a list. Latency is measured from sending the
+ * request to reading the last byte of the body. Requests that start
+ * during the warmup period are not counted.
+ *
+ * The last line of output is machine-readable "key=value" pairs for
+ * bench/run.sh.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define READ_BUFFER_SIZE 65536
+#define LINE_MAX_SIZE 8192
+#define REQUEST_MAX 4096
+#define DEFAULT_CONNECTIONS 16
+#define DEFAULT_DURATION 10
+#define DEFAULT_WARMUP 2
+
+/* Run-wide settings, fixed before the threads start */
+typedef struct {
+    struct addrinfo *addr;
+    const char *host;        /* Host header */
+    char **urls;
+    size_t url_count;
+    uint64_t warmup_end;     /* Monotonic µs; requests started before are not counted */
+    uint64_t stop;           /* Monotonic µs; no request is started after */
+} LoadConfig;
+
+/* Per-thread connection, response reader and results */
+typedef struct {
+    int fd;
+    char buf[READ_BUFFER_SIZE];
+    size_t start, end;
+    uint32_t seed;
+
+    uint32_t *latencies;     /* µs, counted requests only */
+    size_t count, capacity;
+    uint64_t errors;
+    uint64_t reconnects;
+    uint64_t bytes;
+} Worker;
+
+static LoadConfig config;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/* xorshift32, so threads do not share random state */
+static uint32_t next_random(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static int open_connection(Worker *w) {
+    int one = 1;
+
+    w->fd = socket(config.addr->ai_family, config.addr->ai_socktype | SOCK_CLOEXEC,
+                   config.addr->ai_protocol);
+    if (w->fd < 0) {
+        return -1;
+    }
+    if (connect(w->fd, config.addr->ai_addr, config.addr->ai_addrlen) != 0) {
+        close(w->fd);
+        w->fd = -1;
+        return -1;
+    }
+    setsockopt(w->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    w->start = w->end = 0;
+    return 0;
+}
+
+static void close_connection(Worker *w) {
+    if (w->fd >= 0) {
+        close(w->fd);
+        w->fd = -1;
+    }
+}
+
+/* Read more of the response; returns bytes buffered, 0 at EOF, -1 on error */
+static ssize_t fill(Worker *w) {
+    if (w->start == w->end) {
+        w->start = w->end = 0;
+    } else if (w->end == sizeof(w->buf)) {
+        memmove(w->buf, w->buf + w->start, w->end - w->start);
+        w->end -= w->start;
+        w->start = 0;
+    }
+
+    ssize_t n;
+    do {
+        n = read(w->fd, w->buf + w->end, sizeof(w->buf) - w->end);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0) {
+        w->end += n;
+    }
+    return n;
+}
+
+/* Read one CRLF-terminated line without its terminator */
+static int read_line(Worker *w, char *line, size_t size) {
+    for (;;) {
+        char *eol = memchr(w->buf + w->start, '\n', w->end - w->start);
+        if (eol) {
+            size_t len = eol - (w->buf + w->start);
+            if (len && eol[-1] == '\r') {
+                len--;
+            }
+            if (len >= size) {
+                return -1;
+            }
+            memcpy(line, w->buf + w->start, len);
+            line[len] = '\0';
+            w->start = eol + 1 - w->buf;
+            return 0;
+        }
+        if (w->end - w->start >= LINE_MAX_SIZE || fill(w) <= 0) {
+            return -1;
+        }
+    }
+}
+
+/* Consume len body bytes (or everything up to EOF if len is -1) */
+static int skip_body(Worker *w, long long len) {
+    while (len != 0) {
+        if (w->start == w->end) {
+            ssize_t n = fill(w);
+            if (n < 0 || (n == 0 && len > 0)) {
+                return -1;
+            }
+            if (n == 0) {
+                return 0;
+            }
+        }
+        size_t avail = w->end - w->start;
+        size_t take = (len < 0 || (long long)avail < len) ? avail : (size_t)len;
+        w->start += take;
+        w->bytes += take;
+        if (len > 0) {
+            len -= take;
+        }
+    }
+    return 0;
+}
+
+static int skip_chunked(Worker *w) {
+    char line[LINE_MAX_SIZE];
+
+    for (;;) {
+        if (read_line(w, line, sizeof(line)) != 0) {
+            return -1;
+        }
+        char *end;
+        long long size = strtoll(line, &end, 16);
+        if (end == line || size < 0) {
+            return -1;
+        }
+        if (size == 0) {
+            break;
+        }
+        if (skip_body(w, size) != 0 || read_line(w, line, sizeof(line)) != 0) {
+            return -1;
+        }
+    }
+
+    /* Trailer fields, up to the empty line */
+    do {
+        if (read_line(w, line, sizeof(line)) != 0) {
+            return -1;
+        }
+    } while (*line);
+    return 0;
+}
+
+/*
+ * Send one request and read the whole response
+ * Returns the HTTP status, 0 if the connection was closed before any of
+ * the response arrived (a keep-alive race), or -1 on error.
+ */
+static int do_request(Worker *w, const char *url, int *keep_alive) {
+    char request[REQUEST_MAX];
+    char line[LINE_MAX_SIZE];
+    int len = snprintf(request, sizeof(request),
+                       "GET %s HTTP/1.1\r\nHost: %s\r\nAccept: text/html\r\n"
+                       "User-Agent: gmi2html-load\r\n\r\n", url, config.host);
+    if (len < 0 || (size_t)len >= sizeof(request)) {
+        return -1;
+    }
+
+    for (int sent = 0; sent < len; ) {
+        ssize_t n = send(w->fd, request + sent, len - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EPIPE || errno == ECONNRESET ? 0 : -1;
+        }
+        sent += n;
+    }
+
+    if (w->start == w->end) {
+        ssize_t n = fill(w);
+        if (n <= 0) {
+            return n == 0 || errno == ECONNRESET ? 0 : -1;
+        }
+    }
+
+    int status;
+    if (read_line(w, line, sizeof(line)) != 0 ||
+        sscanf(line, "HTTP/%*d.%*d %d", &status) != 1) {
+        return -1;
+    }
+    *keep_alive = strncmp(line, "HTTP/1.0", 8) != 0;
+
+    long long content_length = -1;
+    int chunked = 0;
+    for (;;) {
+        if (read_line(w, line, sizeof(line)) != 0) {
+            return -1;
+        }
+        if (!*line) {
+            break;
+        }
+        char *value = strchr(line, ':');
+        if (!value) {
+            continue;
+        }
+        *value++ = '\0';
+        value += strspn(value, " \t");
+        if (!strcasecmp(line, "Content-Length")) {
+            content_length = strtoll(value, NULL, 10);
+        } else if (!strcasecmp(line, "Transfer-Encoding")) {
+            chunked = strcasestr(value, "chunked") != NULL;
+        } else if (!strcasecmp(line, "Connection")) {
+            if (strcasestr(value, "close")) {
+                *keep_alive = 0;
+            } else if (strcasestr(value, "keep-alive")) {
+                *keep_alive = 1;
+            }
+        }
+    }
+
+    if (status == 204 || status == 304) {
+        return status;
+    }
+    if (chunked) {
+        return skip_chunked(w) == 0 ? status : -1;
+    }
+    if (content_length < 0) {
+        *keep_alive = 0;
+    }
+    return skip_body(w, content_length) == 0 ? status : -1;
+}
+
+static void record(Worker *w, uint32_t latency) {
+    if (w->count == w->capacity) {
+        size_t capacity = w->capacity ? w->capacity * 2 : 65536;
+        uint32_t *grown = realloc(w->latencies, capacity * sizeof(uint32_t));
+        if (!grown) {
+            return;
+        }
+        w->latencies = grown;
+        w->capacity = capacity;
+    }
+    w->latencies[w->count++] = latency;
+}
+
+static void *worker_main(void *arg) {
+    Worker *w = (Worker *)arg;
+
+    w->fd = -1;
+    for (;;) {
+        uint64_t begin = now_us();
+        if (begin >= config.stop) {
+            break;
+        }
+        int counted = begin >= config.warmup_end;
+
+        if (w->fd < 0 && open_connection(w) != 0) {
+            if (counted) w->errors++;
+            usleep(1000);
+            continue;
+        }
+
+        const char *url = config.urls[next_random(&w->seed) % config.url_count];
+        uint64_t bytes = w->bytes;
+        int keep_alive = 1;
+        int status = do_request(w, url, &keep_alive);
+        if (status == 0) {
+            /* The server closed an idle connection; retry on a new one */
+            close_connection(w);
+            w->reconnects++;
+            continue;
+        }
+
+        uint64_t end = now_us();
+        if (counted && end <= config.stop) {
+            if (status == 200) {
+                record(w, (uint32_t)(end - begin));
+            } else {
+                w->errors++;
+            }
+        } else {
+            w->bytes = bytes;
+        }
+        if (status < 0 || !keep_alive) {
+            close_connection(w);
+        }
+    }
+    close_connection(w);
+    return NULL;
+}
+
+/* Read the URL list, one path per line */
+static int read_urls(const char *path) {
+    FILE *f = fopen(path, "r");
+    char line[REQUEST_MAX];
+    size_t capacity = 0;
+
+    if (!f) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (!*line || *line == '#') {
+            continue;
+        }
+        if (config.url_count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            char **grown = realloc(config.urls, capacity * sizeof(char *));
+            if (!grown) {
+                fclose(f);
+                return -1;
+            }
+            config.urls = grown;
+        }
+        if (!(config.urls[config.url_count++] = strdup(line))) {
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+static int compare_latency(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of sorted latencies */
+static uint32_t percentile(const uint32_t *sorted, size_t count, double p) {
+    if (!count) {
+        return 0;
+    }
+    size_t rank = (size_t)(p / 100.0 * count + 0.999999);
+    return sorted[rank ? rank - 1 : 0];
+}
+
+static void usage(void) {
+    fprintf(stderr,
+        "Usage: gmi2html-load -u FILE [options]\n"
+        "  -u FILE   URL paths to request, one per line\n"
+        "  -a HOST   server address (default: 127.0.0.1)\n"
+        "  -p PORT   server port (default: 8080)\n"
+        "  -c N      concurrent connections (default: %d)\n"
+        "  -d SECS   measured duration (default: %d)\n"
+        "  -w SECS   warmup before measuring (default: %d)\n",
+        DEFAULT_CONNECTIONS, DEFAULT_DURATION, DEFAULT_WARMUP);
+}
+
+int main(int argc, char **argv) {
+    const char *urls = NULL;
+    const char *host = "127.0.0.1";
+    const char *port = "8080";
+    int connections = DEFAULT_CONNECTIONS;
+    int duration = DEFAULT_DURATION;
+    int warmup = DEFAULT_WARMUP;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "u:a:p:c:d:w:h")) != -1) {
+        switch (opt) {
+            case 'u': urls = optarg; break;
+            case 'a': host = optarg; break;
+            case 'p': port = optarg; break;
+            case 'c': connections = atoi(optarg); break;
+            case 'd': duration = atoi(optarg); break;
+            case 'w': warmup = atoi(optarg); break;
+            default:
+                usage();
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+
+    if (!urls || connections < 1 || duration < 1 || warmup < 0 || optind != argc) {
+        usage();
+        return 2;
+    }
+
+    if (read_urls(urls) != 0 || !config.url_count) {
+        fprintf(stderr, "gmi2html-load: %s: no URLs\n", urls);
+        return 1;
+    }
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    int rc = getaddrinfo(host, port, &hints, &config.addr);
+    if (rc != 0) {
+        fprintf(stderr, "gmi2html-load: %s: %s\n", host, gai_strerror(rc));
+        return 1;
+    }
+    config.host = host;
+
+    Worker *workers = calloc(connections, sizeof(Worker));
+    pthread_t *threads = calloc(connections, sizeof(pthread_t));
+    if (!workers || !threads) {
+        perror("gmi2html-load");
+        return 1;
+    }
+
+    uint64_t started = now_us();
+    config.warmup_end = started + (uint64_t)warmup * 1000000;
+    config.stop = config.warmup_end + (uint64_t)duration * 1000000;
+
+    for (int i = 0; i < connections; i++) {
+        workers[i].seed = 0x9e3779b9u * (uint32_t)(i + 1);
+        if (pthread_create(&threads[i], NULL, worker_main, &workers[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    size_t total = 0;
+    uint64_t errors = 0, reconnects = 0, bytes = 0;
+    for (int i = 0; i < connections; i++) {
+        pthread_join(threads[i], NULL);
+        total += workers[i].count;
+        errors += workers[i].errors;
+        reconnects += workers[i].reconnects;
+        bytes += workers[i].bytes;
+    }
+
+    uint32_t *all = malloc((total ? total : 1) * sizeof(uint32_t));
+    if (!all) {
+        perror("gmi2html-load");
+        return 1;
+    }
+    size_t n = 0;
+    double sum = 0;
+    for (int i = 0; i < connections; i++) {
+        memcpy(all + n, workers[i].latencies, workers[i].count * sizeof(uint32_t));
+        n += workers[i].count;
+        free(workers[i].latencies);
+    }
+    for (size_t i = 0; i < total; i++) {
+        sum += all[i];
+    }
+    qsort(all, total, sizeof(uint32_t), compare_latency);
+
+    double rps = (double)total / duration;
+    fprintf(stderr, "gmi2html-load: %zu requests in %ds over %d connections, %llu errors\n",
+            total, duration, connections, (unsigned long long)errors);
+    fprintf(stderr, "  %.1f requests/sec, %.1f MB/sec\n", rps, bytes / 1048576.0 / duration);
+    fprintf(stderr, "  latency p50 %.2fms  p99 %.2fms  p999 %.2fms  max %.2fms\n",
+            percentile(all, total, 50) / 1000.0, percentile(all, total, 99) / 1000.0,
+            percentile(all, total, 99.9) / 1000.0, total ? all[total - 1] / 1000.0 : 0.0);
+
+    printf("requests=%zu errors=%llu reconnects=%llu bytes=%llu rps=%.1f "
+           "mean_us=%.0f p50_us=%u p99_us=%u p999_us=%u max_us=%u\n",
+           total, (unsigned long long)errors, (unsigned long long)reconnects,
+           (unsigned long long)bytes, rps, total ? sum / total : 0.0,
+           percentile(all, total, 50), percentile(all, total, 99),
+           percentile(all, total, 99.9), total ? all[total - 1] : 0);
+
+    free(all);
+    freeaddrinfo(config.addr);
+    return errors && !total ? 1 : 0;
+}
@@ -0,0 +1,175 @@
+/*
+ * gmi2html_prerender - Link selection and per-process record for Gmi2HtmlPrerender
+ */
+
+#include "gmi2html_prerender.h"
+#include "gemini_parser.h"
+#include "apr_strings.h"
+#include "apr_hash.h"
+#include "apr_thread_mutex.h"
+#include "apr_time.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* An unchanged file is pre-rendered again at most this often, in case its
+   cache entry was evicted or the stylesheet or head content changed */
+#define PRERENDER_RECHECK_INTERVAL apr_time_from_sec(60)
+
+/* Most files the record keeps; past it, files with no pre-render pending make room */
+#define PRERENDER_MAX_FILES 1024
+
+/* Version of a file this process pre-rendered (malloc'd) */
+typedef struct {
+    char *filename;          /* Record key (malloc'd) */
+    apr_time_t mtime;
+    apr_off_t size;
+    apr_time_t rendered;     /* 0 if never */
+    int pending;             /* A pre-render is queued or running */
+} prerender_entry;
+
+/* Per-process record: filename -> prerender_entry */
+static apr_hash_t *prerendered;
+static int prerendered_files;
+static apr_thread_mutex_t *prerender_lock;
+
+/* Set up the per-process record of pre-rendered files */
+apr_status_t gmi2html_prerender_child_init(apr_pool_t *p) {
+    apr_status_t status = apr_thread_mutex_create(&prerender_lock, APR_THREAD_MUTEX_DEFAULT, p);
+    if (status != APR_SUCCESS) {
+        prerender_lock = NULL;
+        return status;
+    }
+    prerendered = apr_hash_make(p);
+    return APR_SUCCESS;
+}
+
+/* Forget a file with no pre-render pending, if there is one
+ * (called with prerender_lock held) */
+static int make_room(void) {
+    for (apr_hash_index_t *hi = apr_hash_first(NULL, prerendered); hi; hi = apr_hash_next(hi)) {
+        void *val;
+
+        apr_hash_this(hi, NULL, NULL, &val);
+        prerender_entry *entry = val;
+        if (!entry->pending) {
+            apr_hash_set(prerendered, entry->filename, APR_HASH_KEY_STRING, NULL);
+            free(entry->filename);
+            free(entry);
+            prerendered_files--;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Link collection state for gemini_scan_links */
+typedef struct {
+    apr_pool_t *pool;
+    apr_array_header_t *links;
+    int max;
+} link_scan;
+
+/* gemini_scan_links callback: keep relative and root-relative .gmi links */
+static void collect_link(void *data, const char *url, size_t len) {
+    link_scan *scan = (link_scan *)data;
+    size_t path_len = 0;
+
+    if (scan->links->nelts >= scan->max || (len >= 2 && url[0] == '/' && url[1] == '/')) {
+        return;
+    }
+
+    /* A colon before any slash, query or fragment starts a scheme */
+    while (path_len < len && !strchr(":/?#", url[path_len])) {
+        path_len++;
+    }
+    if (path_len < len && url[path_len] == ':') {
+        return;
+    }
+
+    while (path_len < len && url[path_len] != '?' && url[path_len] != '#') {
+        path_len++;
+    }
+    if ((path_len < len && url[path_len] == '?') ||
+        path_len < 5 || memcmp(url + path_len - 4, ".gmi", 4) != 0) {
+        return;
+    }
+
+    for (int i = 0; i < scan->links->nelts; i++) {
+        const char *seen = APR_ARRAY_IDX(scan->links, i, const char *);
+        if (strlen(seen) == path_len && !memcmp(seen, url, path_len)) {
+            return;
+        }
+    }
+    APR_ARRAY_PUSH(scan->links, const char *) = apr_pstrmemdup(scan->pool, url, path_len);
+}
+
+/* Find the first local .gmi links of a document */
+apr_array_header_t *gmi2html_prerender_links(apr_pool_t *p, const char *content,
+                                             apr_size_t len, int max) {
+    link_scan scan = { p, apr_array_make(p, max > 0 ? max : 1, sizeof(const char *)), max };
+
+    if (max > 0) {
+        gemini_scan_links(content, len, collect_link, &scan);
+    }
+    return scan.links;
+}
+
+/* Check whether a linked file is due for pre-rendering, and mark it pending */
+int gmi2html_prerender_due(const char *filename, const apr_finfo_t *finfo) {
+    apr_time_t now = apr_time_now();
+    int due = 1;
+
+    if (!prerender_lock) {
+        return 1;
+    }
+
+    apr_thread_mutex_lock(prerender_lock);
+    prerender_entry *entry = apr_hash_get(prerendered, filename, APR_HASH_KEY_STRING);
+    if (!entry) {
+        /* With every recorded file pending, this one waits for a later page */
+        if (prerendered_files >= PRERENDER_MAX_FILES && !make_room()) {
+            apr_thread_mutex_unlock(prerender_lock);
+            return 0;
+        }
+        char *name = strdup(filename);
+        entry = calloc(1, sizeof(prerender_entry));
+        if (!name || !entry) {
+            free(name);
+            free(entry);
+            apr_thread_mutex_unlock(prerender_lock);
+            return 1;
+        }
+        entry->filename = name;
+        apr_hash_set(prerendered, name, APR_HASH_KEY_STRING, entry);
+        prerendered_files++;
+    } else if (entry->pending ||
+               (entry->mtime == finfo->mtime && entry->size == finfo->size &&
+                entry->rendered && now - entry->rendered < PRERENDER_RECHECK_INTERVAL)) {
+        due = 0;
+    }
+    if (due) {
+        entry->pending = 1;
+    }
+    apr_thread_mutex_unlock(prerender_lock);
+
+    return due;
+}
+
+/* End a pre-render started after gmi2html_prerender_due */
+void gmi2html_prerender_done(const char *filename, const apr_finfo_t *finfo, int rendered) {
+    if (!prerender_lock) {
+        return;
+    }
+
+    apr_thread_mutex_lock(prerender_lock);
+    prerender_entry *entry = apr_hash_get(prerendered, filename, APR_HASH_KEY_STRING);
+    if (entry) {
+        entry->pending = 0;
+        if (rendered) {
+            entry->mtime = finfo->mtime;
+            entry->size = finfo->size;
+            entry->rendered = apr_time_now();
+        }
+    }
+    apr_thread_mutex_unlock(prerender_lock);
+}
@@ -0,0 +1,61 @@
+#ifndef GMI2HTML_PRERENDER_H
+#define GMI2HTML_PRERENDER_H
+
+#include "apr_pools.h"
+#include "apr_tables.h"
+#include "apr_file_info.h"
+
+/**
+ * Speculative rendering of linked documents for Gmi2HtmlPrerender
+ *
+ * A page's first local .gmi links are the documents a reader is most
+ * likely to open next. Once the page itself has been sent, the module
+ * queues them for the background thread, which renders them into the
+ * render cache. Each process remembers which versions of which files it
+ * has pre-rendered, or is about to, so popular pages do not make it look
+ * at the same linked files on every request. The record is bounded: past
+ * 1024 files, files with no pre-render pending are forgotten to make room.
+ */
+
+/**
+ * Set up the per-process record of pre-rendered files (call from child_init)
+ * Without it, linked documents are checked after every page.
+ * @param p: Child process pool
+ * @return: APR_SUCCESS or the mutex creation status
+ */
+apr_status_t gmi2html_prerender_child_init(apr_pool_t *p);
+
+/**
+ * Find the first local .gmi links of a document
+ * Links with a scheme, a host or a query are left out, as are repeats.
+ * @param p: Pool for the result
+ * @param content: Gemini source
+ * @param len: Length of the source
+ * @param max: Maximum number of links to return
+ * @return: Array of const char * URLs without their #fragment, in document order
+ */
+apr_array_header_t *gmi2html_prerender_links(apr_pool_t *p, const char *content,
+                                             apr_size_t len, int max);
+
+/**
+ * Check whether a linked file is due for pre-rendering, and mark it pending
+ * A file is due when no pre-render of it is pending and it changed since
+ * this process last pre-rendered it, or that was over a minute ago.
+ * @param filename: Linked file
+ * @param finfo: Its size and mtime
+ * @return: 1 if the caller should pre-render it and then call
+ *          gmi2html_prerender_done, 0 if not
+ */
+int gmi2html_prerender_due(const char *filename, const apr_finfo_t *finfo);
+
+/**
+ * End a pre-render started after gmi2html_prerender_due
+ * Only a successful one is recorded, so a failed render is retried the
+ * next time the file is linked from a page.
+ * @param filename: Linked file
+ * @param finfo: Size and mtime it was checked with
+ * @param rendered: Whether the file's output is now in the render cache
+ */
+void gmi2html_prerender_done(const char *filename, const apr_finfo_t *finfo, int rendered);
+
+#endif
@@ -0,0 +1,210 @@
+/*
+ * gmi2html_query - Search results pages over per-process mapped indexes
+ */
+
+#include "gmi2html_query.h"
+#include "gmi2html_search.h"
+#include "httpd.h"
+#include "http_request.h"
+#include "apr_strings.h"
+#include "apr_file_info.h"
+#include "apr_hash.h"
+#include "apr_tables.h"
+#include "apr_thread_mutex.h"
+#include "apr_time.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* A mapped index is checked for replacement at most this often */
+#define INDEX_RECHECK_INTERVAL apr_time_from_sec(1)
+
+/* Results shown on one page */
+#define QUERY_RESULTS_MAX 50
+
+/* A mapped index in the per-process registry (malloc'd) */
+typedef struct {
+    gmi2html_search_index *index;
+    apr_ino_t inode;
+    apr_time_t mtime;
+    apr_off_t size;
+    apr_time_t checked;      /* When the file was last stat'd */
+    unsigned refs;           /* Queries using the mapping */
+    int stale;               /* Replaced; unmap when refs reaches 0 */
+} open_index;
+
+/* Per-process registry: index path -> current open_index */
+static apr_hash_t *index_registry;
+static apr_thread_mutex_t *query_lock;
+
+/* Set up the per-process index registry */
+apr_status_t gmi2html_query_child_init(apr_pool_t *p) {
+    apr_status_t status = apr_thread_mutex_create(&query_lock, APR_THREAD_MUTEX_DEFAULT, p);
+    if (status != APR_SUCCESS) {
+        query_lock = NULL;
+        return status;
+    }
+    index_registry = apr_hash_make(p);
+    return APR_SUCCESS;
+}
+
+/* Unmap an index nobody uses any more (called with query_lock held) */
+static void retire_index(open_index *entry) {
+    entry->stale = 1;
+    if (!entry->refs) {
+        gmi2html_search_close(entry->index);
+        free(entry);
+    }
+}
+
+/* Take a reference to the current mapping of an index file */
+static open_index *acquire_index(const char *path, apr_pool_t *p) {
+    apr_time_t now = apr_time_now();
+    apr_finfo_t finfo;
+
+    apr_thread_mutex_lock(query_lock);
+    open_index *entry = apr_hash_get(index_registry, path, APR_HASH_KEY_STRING);
+    if (entry && now - entry->checked < INDEX_RECHECK_INTERVAL) {
+        entry->refs++;
+        apr_thread_mutex_unlock(query_lock);
+        return entry;
+    }
+    apr_thread_mutex_unlock(query_lock);
+
+    /* A missing file leaves the last mapping in place until one appears */
+    if (apr_stat(&finfo, path, APR_FINFO_INODE | APR_FINFO_MTIME | APR_FINFO_SIZE,
+                 p) != APR_SUCCESS) {
+        return NULL;
+    }
+
+    apr_thread_mutex_lock(query_lock);
+    entry = apr_hash_get(index_registry, path, APR_HASH_KEY_STRING);
+    if (entry && entry->inode == finfo.inode && entry->mtime == finfo.mtime &&
+        entry->size == finfo.size) {
+        entry->checked = now;
+        entry->refs++;
+        apr_thread_mutex_unlock(query_lock);
+        return entry;
+    }
+
+    /* New or rebuilt: map it under the lock so only one thread does */
+    open_index *fresh = malloc(sizeof(open_index));
+    if (!fresh || !(fresh->index = gmi2html_search_open(path))) {
+        free(fresh);
+        apr_thread_mutex_unlock(query_lock);
+        return NULL;
+    }
+    fresh->inode = finfo.inode;
+    fresh->mtime = finfo.mtime;
+    fresh->size = finfo.size;
+    fresh->checked = now;
+    fresh->refs = 1;
+    fresh->stale = 0;
+
+    if (entry) {
+        /* The hash keeps the key of the first insert, which is never freed */
+        apr_hash_set(index_registry, path, APR_HASH_KEY_STRING, fresh);
+        retire_index(entry);
+    } else {
+        apr_hash_set(index_registry, strdup(path), APR_HASH_KEY_STRING, fresh);
+    }
+    apr_thread_mutex_unlock(query_lock);
+
+    return fresh;
+}
+
+/* Drop a reference taken by acquire_index */
+static void release_index(open_index *entry) {
+    apr_thread_mutex_lock(query_lock);
+    entry->refs--;
+    if (entry->stale) {
+        retire_index(entry);
+    }
+    apr_thread_mutex_unlock(query_lock);
+}
+
+/* gmi2html_search_filter: whether the request may fetch a result, checked
+   with a subrequest for its URL path; ctx is the request */
+static int result_visible(void *ctx, const char *path) {
+    request_rec *r = (request_rec *)ctx;
+    request_rec *rr = ap_sub_req_lookup_uri(ap_escape_uri(r->pool, path), r, NULL);
+    int visible = rr->status == HTTP_OK && rr->finfo.filetype == APR_REG;
+
+    ap_destroy_sub_req(rr);
+    return visible;
+}
+
+/* Format the results; strings are copied, as they point into the mapping */
+static const char *results_page(request_rec *r, const gmi2html_search_index *index,
+                                const char *query, int form) {
+    apr_pool_t *p = r->pool;
+    apr_array_header_t *lines = apr_array_make(p, QUERY_RESULTS_MAX + 4, sizeof(const char *));
+    gmi2html_search_result results[QUERY_RESULTS_MAX];
+    apr_size_t total = 0;
+    int count = 0;
+
+    /* Page titles are not escaped, so the query stays out of the heading */
+    APR_ARRAY_PUSH(lines, const char *) = "# Search\n\n";
+    if (form) {
+        APR_ARRAY_PUSH(lines, const char *) = "%include " GMI2HTML_QUERY_FORM "\n\n";
+    }
+
+    if (!*query) {
+        return apr_array_pstrcat(p, lines, 0);
+    }
+
+    /* Documents the request may not fetch are left out, and not counted */
+    count = gmi2html_search_query(index, query, results, QUERY_RESULTS_MAX, &total,
+                                  result_visible, r);
+    if (count < 0) {
+        return NULL;
+    }
+
+    APR_ARRAY_PUSH(lines, const char *) =
+        apr_psprintf(p, "%" APR_SIZE_T_FMT " %s for \"%s\"%s\n\n", total,
+                     total == 1 ? "result" : "results", query,
+                     total > (apr_size_t)count ? apr_psprintf(p, ", showing the best %d", count) : "");
+
+    for (int i = 0; i < count; i++) {
+        const char *label = *results[i].title ? results[i].title : results[i].path;
+        APR_ARRAY_PUSH(lines, const char *) =
+            apr_pstrcat(p, "=> ", ap_escape_uri(p, results[i].path), " ", label, "\n", NULL);
+    }
+
+    return apr_array_pstrcat(p, lines, 0);
+}
+
+/* Search an index and write the results as gemtext */
+const char *gmi2html_query_page(request_rec *r, const char *index_path, const char *query,
+                                int form, apr_size_t *len) {
+    apr_pool_t *p = r->pool;
+    const char *page;
+
+    /* One line of text: control characters would start new gemtext lines */
+    char *words = apr_pstrdup(p, query);
+    for (char *c = words; *c; c++) {
+        if ((unsigned char)*c < 0x20 || *c == 0x7f) {
+            *c = ' ';
+        }
+    }
+
+    if (!query_lock) {
+        gmi2html_search_index *index = gmi2html_search_open(index_path);
+        if (!index) {
+            return NULL;
+        }
+        page = results_page(r, index, words, form);
+        gmi2html_search_close(index);
+    } else {
+        open_index *entry = acquire_index(index_path, p);
+        if (!entry) {
+            return NULL;
+        }
+        page = results_page(r, entry->index, words, form);
+        release_index(entry);
+    }
+
+    if (page) {
+        *len = strlen(page);
+    }
+    return page;
+}
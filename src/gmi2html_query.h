@@ -0,0 +1,41 @@
+#ifndef GMI2HTML_QUERY_H
+#define GMI2HTML_QUERY_H
+
+#include "httpd.h"
+
+/**
+ * Search results pages for Gmi2HtmlSearchIndex
+ *
+ * Each process keeps the index files it has searched mapped, and checks
+ * at most once a second whether gmi2html-index has replaced one. A
+ * replaced index is unmapped once the last query still using it ends,
+ * so rebuilding never disturbs searches in progress.
+ */
+
+/* Include path that stands for the search form on a results page */
+#define GMI2HTML_QUERY_FORM "search-form"
+
+/**
+ * Set up the per-process index registry (call from child_init)
+ * Without it, the index is mapped for every search.
+ * @param p: Child process pool
+ * @return: APR_SUCCESS or the mutex creation status
+ */
+apr_status_t gmi2html_query_child_init(apr_pool_t *p);
+
+/**
+ * Search an index and write the results as gemtext
+ * Results link to the URL paths the documents were indexed under. Each
+ * match is looked up as a subrequest for that path, and only documents
+ * the request may fetch are listed or counted.
+ * @param r: Search request
+ * @param index_path: Index file built by gmi2html-index
+ * @param query: Search words (may be empty)
+ * @param form: Start the page with a "%include search-form" line
+ * @param len: Receives the length of the page
+ * @return: Gemtext page (in r->pool), or NULL if the index cannot be opened
+ */
+const char *gmi2html_query_page(request_rec *r, const char *index_path, const char *query,
+                                int form, apr_size_t *len);
+
+#endif
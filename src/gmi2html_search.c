@@ -0,0 +1,1000 @@
+/*
+ * gmi2html_search - Memory-mapped inverted index over Gemini documents
+ */
+
+#define _GNU_SOURCE
+
+#include "gmi2html_search.h"
+#include "gemini_parser.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* File format:
+ *
+ *   header
+ *   documents   search_doc[doc_count], in build order
+ *   terms       search_term[term_count], sorted by term text
+ *   postings    per term: df x (varint doc delta, varint tf)
+ *   forward     per document: varint term number, varint tf (rebuild only)
+ *   strings     NUL-terminated paths, titles and terms
+ *
+ * Integers are in host byte order; an index is only read on the machine
+ * that built it, and the byte order mark rejects anything else. */
+#define SEARCH_MAGIC "GMISRCH1"
+#define SEARCH_BYTE_ORDER 0x01020304u
+
+/* Words in headings count this many times */
+#define HEADING_WEIGHT 3
+
+/* Shorter and longer tokens are not indexed */
+#define TERM_MIN 2
+#define TERM_MAX 48
+
+/* BM25 parameters */
+#define BM25_K1 1.2
+#define BM25_B 0.75
+
+/* Query words beyond this many are ignored */
+#define QUERY_TERMS_MAX 16
+
+typedef struct {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t doc_count;
+    uint32_t term_count;
+    uint32_t reserved;
+    uint64_t total_length;      /* Sum of document lengths, for BM25 */
+    uint64_t docs_offset;
+    uint64_t terms_offset;
+    uint64_t postings_offset;
+    uint64_t forward_offset;
+    uint64_t strings_offset;
+    uint64_t file_size;
+} search_header;
+
+typedef struct {
+    int64_t mtime;              /* Nanoseconds */
+    int64_t size;
+    uint32_t path;              /* String offsets */
+    uint32_t title;
+    uint32_t length;            /* Weighted token count */
+    uint32_t forward_count;     /* Entries in the forward list */
+    uint64_t forward;           /* Offset into the forward section */
+} search_doc;
+
+typedef struct {
+    uint32_t text;              /* String offset */
+    uint32_t df;                /* Documents containing the term */
+    uint64_t postings;          /* Offset into the postings section */
+} search_term;
+
+struct gmi2html_search_index {
+    const unsigned char *map;
+    size_t size;
+    const search_header *header;
+    const search_doc *docs;
+    const search_term *terms;
+    const unsigned char *postings;
+    const unsigned char *forward;
+    const char *strings;
+    size_t postings_size;
+    size_t forward_size;
+    size_t strings_size;
+};
+
+/* --- Varints --- */
+
+/* Append an unsigned LEB128 varint; buf needs 10 bytes of room */
+static size_t varint_put(unsigned char *buf, uint64_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        buf[n++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    buf[n++] = (unsigned char)value;
+    return n;
+}
+
+/* Read a varint, refusing to run past end */
+static const unsigned char *varint_get(const unsigned char *p, const unsigned char *end,
+                                       uint64_t *value) {
+    uint64_t result = 0;
+    int shift = 0;
+
+    while (p < end && shift < 64) {
+        result |= (uint64_t)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80)) {
+            *value = result;
+            return p;
+        }
+        shift += 7;
+    }
+    return NULL;
+}
+
+/* --- Tokenizer --- */
+
+typedef void (*token_fn)(void *ctx, const char *term, size_t len, unsigned weight);
+
+/* Split text into lowercase ASCII alphanumeric runs; UTF-8 bytes are kept
+   as they are, so non-ASCII words are searchable but case-sensitive */
+static void tokenize(const char *text, unsigned weight, token_fn fn, void *ctx) {
+    char term[TERM_MAX];
+    size_t len = 0;
+    int too_long = 0;
+
+    for (const char *p = text; ; p++) {
+        unsigned char c = (unsigned char)*p;
+        int word = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                   (c >= '0' && c <= '9') || c >= 0x80;
+
+        if (word) {
+            if (len < TERM_MAX) {
+                term[len++] = (c >= 'A' && c <= 'Z') ? (char)(c - 'A' + 'a') : (char)c;
+            } else {
+                too_long = 1;
+            }
+            continue;
+        }
+
+        if (len >= TERM_MIN && !too_long) {
+            fn(ctx, term, len, weight);
+        }
+        len = 0;
+        too_long = 0;
+
+        if (!c) {
+            break;
+        }
+    }
+}
+
+/* --- Reading --- */
+
+static void search_unmap(gmi2html_search_index *index) {
+    munmap((void *)index->map, index->size);
+    free(index);
+}
+
+/* Map an index file into memory */
+gmi2html_search_index *gmi2html_search_open(const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(search_header)) {
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    gmi2html_search_index *index = calloc(1, sizeof(gmi2html_search_index));
+    if (!index) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    index->map = map;
+    index->size = st.st_size;
+    index->header = map;
+
+    /* Check every section lies inside the file, in order */
+    const search_header *h = index->header;
+    if (memcmp(h->magic, SEARCH_MAGIC, sizeof(h->magic)) ||
+        h->byte_order != SEARCH_BYTE_ORDER || h->file_size != index->size ||
+        h->docs_offset != sizeof(search_header) ||
+        h->terms_offset != h->docs_offset + (uint64_t)h->doc_count * sizeof(search_doc) ||
+        h->postings_offset != h->terms_offset + (uint64_t)h->term_count * sizeof(search_term) ||
+        h->forward_offset < h->postings_offset || h->strings_offset < h->forward_offset ||
+        h->file_size < h->strings_offset || h->file_size == h->strings_offset ||
+        index->map[h->file_size - 1] != '\0') {
+        search_unmap(index);
+        return NULL;
+    }
+
+    index->docs = (const search_doc *)(index->map + h->docs_offset);
+    index->terms = (const search_term *)(index->map + h->terms_offset);
+    index->postings = index->map + h->postings_offset;
+    index->postings_size = h->forward_offset - h->postings_offset;
+    index->forward = index->map + h->forward_offset;
+    index->forward_size = h->strings_offset - h->forward_offset;
+    index->strings = (const char *)index->map + h->strings_offset;
+    index->strings_size = h->file_size - h->strings_offset;
+
+    for (uint32_t i = 0; i < h->doc_count; i++) {
+        if (index->docs[i].path >= index->strings_size ||
+            index->docs[i].title >= index->strings_size ||
+            index->docs[i].forward > index->forward_size) {
+            search_unmap(index);
+            return NULL;
+        }
+    }
+    for (uint32_t i = 0; i < h->term_count; i++) {
+        if (index->terms[i].text >= index->strings_size ||
+            index->terms[i].postings > index->postings_size) {
+            search_unmap(index);
+            return NULL;
+        }
+    }
+
+    return index;
+}
+
+/* Unmap an index */
+void gmi2html_search_close(gmi2html_search_index *index) {
+    if (index) {
+        search_unmap(index);
+    }
+}
+
+/* Binary search of the term dictionary */
+static const search_term *find_term(const gmi2html_search_index *index,
+                                    const char *term, size_t len) {
+    size_t lo = 0, hi = index->header->term_count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const char *text = index->strings + index->terms[mid].text;
+        int cmp = strncmp(text, term, len);
+        if (!cmp && text[len]) {
+            cmp = 1;
+        }
+        if (!cmp) {
+            return &index->terms[mid];
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+/* Query words, deduplicated */
+typedef struct {
+    char text[QUERY_TERMS_MAX][TERM_MAX + 1];
+    int count;
+} query_terms;
+
+static void add_query_term(void *ctx, const char *term, size_t len, unsigned weight) {
+    query_terms *q = (query_terms *)ctx;
+    (void)weight;
+
+    if (q->count >= QUERY_TERMS_MAX) {
+        return;
+    }
+    for (int i = 0; i < q->count; i++) {
+        if (!strncmp(q->text[i], term, len) && !q->text[i][len]) {
+            return;
+        }
+    }
+    memcpy(q->text[q->count], term, len);
+    q->text[q->count][len] = '\0';
+    q->count++;
+}
+
+/* Insert into the best-first result list if the score makes the cut */
+static void keep_result(gmi2html_search_result *results, int *count, int max,
+                        const gmi2html_search_index *index, uint32_t doc, double score) {
+    int pos = *count < max ? *count : max;
+
+    if (pos == max && (max == 0 || score <= results[max - 1].score)) {
+        return;
+    }
+    while (pos > 0 && results[pos - 1].score < score) {
+        if (pos < max) {
+            results[pos] = results[pos - 1];
+        }
+        pos--;
+    }
+    results[pos].path = index->strings + index->docs[doc].path;
+    results[pos].title = index->strings + index->docs[doc].title;
+    results[pos].score = score;
+    if (*count < max) {
+        (*count)++;
+    }
+}
+
+/* Find the documents containing every word of a query, best first */
+int gmi2html_search_query(const gmi2html_search_index *index, const char *query,
+                          gmi2html_search_result *results, int max_results,
+                          size_t *total, gmi2html_search_filter filter, void *filter_ctx) {
+    const search_header *h = index->header;
+    query_terms q = { .count = 0 };
+    const search_term *terms[QUERY_TERMS_MAX];
+    size_t matches = 0;
+    int count = 0;
+
+    if (total) *total = 0;
+
+    tokenize(query, 1, add_query_term, &q);
+    if (!q.count || !h->doc_count) {
+        return 0;
+    }
+
+    /* Every word must be in the index, or nothing matches */
+    for (int i = 0; i < q.count; i++) {
+        terms[i] = find_term(index, q.text[i], strlen(q.text[i]));
+        if (!terms[i]) {
+            return 0;
+        }
+    }
+
+    double *scores = calloc(h->doc_count, sizeof(double));
+    unsigned char *hits = calloc(h->doc_count, 1);
+    if (!scores || !hits) {
+        free(scores);
+        free(hits);
+        return -1;
+    }
+
+    double avg_length = h->total_length ? (double)h->total_length / h->doc_count : 1.0;
+
+    for (int i = 0; i < q.count; i++) {
+        const unsigned char *p = index->postings + terms[i]->postings;
+        const unsigned char *end = index->postings + index->postings_size;
+        double df = terms[i]->df;
+        double idf = log(1.0 + (h->doc_count - df + 0.5) / (df + 0.5));
+        uint64_t doc = 0;
+
+        for (uint32_t n = 0; n < terms[i]->df; n++) {
+            uint64_t delta, tf;
+            if (!(p = varint_get(p, end, &delta)) || !(p = varint_get(p, end, &tf))) {
+                break;
+            }
+            doc += delta;
+            if (doc >= h->doc_count) {
+                break;
+            }
+
+            double norm = 1.0 - BM25_B + BM25_B * index->docs[doc].length / avg_length;
+            scores[doc] += idf * (tf * (BM25_K1 + 1.0)) / (tf + BM25_K1 * norm);
+            hits[doc]++;
+        }
+    }
+
+    for (uint32_t doc = 0; doc < h->doc_count; doc++) {
+        if (hits[doc] == q.count &&
+            (!filter || filter(filter_ctx, index->strings + index->docs[doc].path))) {
+            matches++;
+            keep_result(results, &count, max_results, index, doc, scores[doc]);
+        }
+    }
+
+    free(scores);
+    free(hits);
+    if (total) *total = matches;
+    return count;
+}
+
+/* --- Building --- */
+
+/* Growable byte buffer */
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+} byte_buffer;
+
+static int buffer_reserve(byte_buffer *buf, size_t extra) {
+    if (buf->len + extra <= buf->cap) return 0;
+
+    size_t cap = buf->cap ? buf->cap : 256;
+    while (buf->len + extra > cap) {
+        cap *= 2;
+    }
+    unsigned char *data = realloc(buf->data, cap);
+    if (!data) return -1;
+    buf->data = data;
+    buf->cap = cap;
+    return 0;
+}
+
+static int buffer_append(byte_buffer *buf, const void *data, size_t len) {
+    if (buffer_reserve(buf, len) != 0) return -1;
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return 0;
+}
+
+static int buffer_varint(byte_buffer *buf, uint64_t value) {
+    if (buffer_reserve(buf, 10) != 0) return -1;
+    buf->len += varint_put(buf->data + buf->len, value);
+    return 0;
+}
+
+/* A term while building */
+typedef struct {
+    char *text;
+    uint32_t id;                /* Position in the sorted dictionary */
+    uint32_t df;
+    uint32_t last_doc;          /* Last document that used the term ... */
+    size_t last_entry;          /* ... and its entry there */
+    byte_buffer postings;
+    uint32_t prev_doc;          /* For delta coding the postings */
+} build_term;
+
+/* One term of one document */
+typedef struct {
+    build_term *term;
+    uint32_t tf;
+} doc_entry;
+
+/* A document while building */
+typedef struct {
+    char *path;
+    char *title;
+    int64_t mtime;
+    int64_t size;
+    uint32_t length;
+    doc_entry *entries;
+    size_t entry_count;
+    size_t entry_cap;
+} build_doc;
+
+typedef struct {
+    build_term **slots;         /* Open-addressing hash table of terms */
+    size_t slot_count;
+    size_t term_count;
+    build_doc *docs;
+    size_t doc_count;
+    size_t doc_cap;
+    const gmi2html_search_index *old;
+    size_t parsed;
+    int failed;
+} builder;
+
+static uint64_t hash_term(const char *term, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;  /* FNV-1a */
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)term[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static int grow_terms(builder *b) {
+    size_t count = b->slot_count ? b->slot_count * 2 : 4096;
+    build_term **slots = calloc(count, sizeof(build_term *));
+    if (!slots) return -1;
+
+    for (size_t i = 0; i < b->slot_count; i++) {
+        build_term *term = b->slots[i];
+        if (!term) continue;
+        size_t j = hash_term(term->text, strlen(term->text)) & (count - 1);
+        while (slots[j]) j = (j + 1) & (count - 1);
+        slots[j] = term;
+    }
+    free(b->slots);
+    b->slots = slots;
+    b->slot_count = count;
+    return 0;
+}
+
+/* Look up a term, adding it if it is new */
+static build_term *intern_term(builder *b, const char *text, size_t len) {
+    if ((b->term_count + 1) * 2 > b->slot_count && grow_terms(b) != 0) {
+        return NULL;
+    }
+
+    size_t i = hash_term(text, len) & (b->slot_count - 1);
+    while (b->slots[i]) {
+        if (!strncmp(b->slots[i]->text, text, len) && !b->slots[i]->text[len]) {
+            return b->slots[i];
+        }
+        i = (i + 1) & (b->slot_count - 1);
+    }
+
+    build_term *term = calloc(1, sizeof(build_term));
+    if (!term || !(term->text = strndup(text, len))) {
+        free(term);
+        return NULL;
+    }
+    term->last_doc = UINT32_MAX;
+    b->slots[i] = term;
+    b->term_count++;
+    return term;
+}
+
+/* Add weight occurrences of a term to the newest document */
+static void add_to_doc(builder *b, build_term *term, uint32_t tf) {
+    uint32_t doc_id = (uint32_t)(b->doc_count - 1);
+    build_doc *doc = &b->docs[doc_id];
+
+    /* The entry check catches documents that were reset or dropped */
+    if (term->last_doc == doc_id && term->last_entry < doc->entry_count &&
+        doc->entries[term->last_entry].term == term) {
+        doc->entries[term->last_entry].tf += tf;
+        return;
+    }
+
+    if (doc->entry_count == doc->entry_cap) {
+        size_t cap = doc->entry_cap ? doc->entry_cap * 2 : 64;
+        doc_entry *entries = realloc(doc->entries, cap * sizeof(doc_entry));
+        if (!entries) {
+            b->failed = 1;
+            return;
+        }
+        doc->entries = entries;
+        doc->entry_cap = cap;
+    }
+
+    term->last_doc = doc_id;
+    term->last_entry = doc->entry_count;
+    doc->entries[doc->entry_count].term = term;
+    doc->entries[doc->entry_count].tf = tf;
+    doc->entry_count++;
+}
+
+static void add_token(void *ctx, const char *text, size_t len, unsigned weight) {
+    builder *b = (builder *)ctx;
+    build_term *term = intern_term(b, text, len);
+
+    if (!term) {
+        b->failed = 1;
+        return;
+    }
+    add_to_doc(b, term, weight);
+    b->docs[b->doc_count - 1].length += weight;
+}
+
+static build_doc *new_doc(builder *b, const char *path, const struct stat *st) {
+    if (b->doc_count == b->doc_cap) {
+        size_t cap = b->doc_cap ? b->doc_cap * 2 : 256;
+        build_doc *docs = realloc(b->docs, cap * sizeof(build_doc));
+        if (!docs) return NULL;
+        b->docs = docs;
+        b->doc_cap = cap;
+    }
+
+    build_doc *doc = &b->docs[b->doc_count];
+    memset(doc, 0, sizeof(*doc));
+    if (!(doc->path = strdup(path))) {
+        return NULL;
+    }
+    doc->mtime = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    doc->size = st->st_size;
+    b->doc_count++;
+    return doc;
+}
+
+/* Take an unchanged document's terms from the previous index */
+static int reuse_doc(builder *b, const search_doc *old_doc) {
+    const gmi2html_search_index *old = b->old;
+    const unsigned char *p = old->forward + old_doc->forward;
+    const unsigned char *end = old->forward + old->forward_size;
+    build_doc *doc = &b->docs[b->doc_count - 1];
+
+    if (!(doc->title = strdup(old->strings + old_doc->title))) {
+        return -1;
+    }
+    doc->length = old_doc->length;
+
+    for (uint32_t i = 0; i < old_doc->forward_count; i++) {
+        uint64_t id, tf;
+        if (!(p = varint_get(p, end, &id)) || !(p = varint_get(p, end, &tf)) ||
+            id >= old->header->term_count) {
+            return -1;
+        }
+        const char *text = old->strings + old->terms[id].text;
+        build_term *term = intern_term(b, text, strlen(text));
+        if (!term) {
+            return -1;
+        }
+        add_to_doc(b, term, (uint32_t)tf);
+    }
+    return b->failed ? -1 : 0;
+}
+
+/* Read and tokenize a new or changed document */
+static int parse_doc(builder *b, const char *file, const char *name, const struct stat *st) {
+    build_doc *doc = &b->docs[b->doc_count - 1];
+    char *content = malloc(st->st_size + 1);
+    FILE *f = fopen(file, "rb");
+
+    if (!content || !f || fread(content, 1, st->st_size, f) != (size_t)st->st_size) {
+        free(content);
+        if (f) fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    GeminiDocument *gdoc = gemini_parse(content, st->st_size);
+    free(content);
+    if (!gdoc) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < gdoc->line_count; i++) {
+        const GeminiLine *line = &gdoc->lines[i];
+        if (!line->content) continue;
+
+        switch (line->type) {
+            case LINE_TYPE_HEADING:
+                tokenize(line->content, HEADING_WEIGHT, add_token, b);
+                break;
+            case LINE_TYPE_TEXT:
+            case LINE_TYPE_LIST_ITEM:
+            case LINE_TYPE_QUOTE:
+                tokenize(line->content, 1, add_token, b);
+                break;
+            default:
+                break;
+        }
+    }
+
+    doc->title = strdup(gdoc->page_title ? gdoc->page_title : name);
+    gemini_document_free(gdoc);
+    b->parsed++;
+    return doc->title && !b->failed ? 0 : -1;
+}
+
+/* The previous index's entry for a path, if it is still current */
+static const search_doc *find_old_doc(const builder *b, const char *path, const struct stat *st) {
+    const gmi2html_search_index *old = b->old;
+    int64_t mtime = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+
+    if (!old) {
+        return NULL;
+    }
+
+    /* Documents are stored in walk order, which is sorted by path */
+    size_t lo = 0, hi = old->header->doc_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(old->strings + old->docs[mid].path, path);
+        if (!cmp) {
+            const search_doc *doc = &old->docs[mid];
+            return doc->mtime == mtime && doc->size == st->st_size ? doc : NULL;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+/* A directory entry while walking */
+typedef struct {
+    char *name;
+    struct stat st;
+} walk_entry;
+
+/* By name, with directories compared as if they ended in "/", so a
+   depth-first walk visits documents in URL path order */
+static int compare_walk_entries(const void *a, const void *b) {
+    const walk_entry *ea = (const walk_entry *)a;
+    const walk_entry *eb = (const walk_entry *)b;
+    const unsigned char *na = (const unsigned char *)ea->name;
+    const unsigned char *nb = (const unsigned char *)eb->name;
+
+    while (*na && *na == *nb) {
+        na++;
+        nb++;
+    }
+    int ca = *na ? *na : (S_ISDIR(ea->st.st_mode) ? '/' : 0);
+    int cb = *nb ? *nb : (S_ISDIR(eb->st.st_mode) ? '/' : 0);
+    return ca - cb;
+}
+
+/* Forget the newest document, after its file could not be read */
+static void drop_doc(builder *b) {
+    build_doc *doc = &b->docs[--b->doc_count];
+    free(doc->path);
+    free(doc->title);
+    free(doc->entries);
+}
+
+/* Add one .gmi file, reusing its previous terms if it is unchanged */
+static int index_file(builder *b, const char *file, const char *path, const char *name,
+                      const struct stat *st) {
+    const search_doc *old_doc = find_old_doc(b, path, st);
+    build_doc *doc = new_doc(b, path, st);
+
+    if (!doc) {
+        return -1;
+    }
+    if (old_doc && reuse_doc(b, old_doc) == 0) {
+        return 0;
+    }
+
+    /* A damaged old entry is discarded and the file parsed instead */
+    free(doc->title);
+    doc->title = NULL;
+    doc->entry_count = 0;
+    doc->length = 0;
+    if (parse_doc(b, file, name, st) != 0) {
+        drop_doc(b);
+        return b->failed ? -1 : 0;
+    }
+    return 0;
+}
+
+/* Index every .gmi file below dir; url is dir's URL path */
+static int walk(builder *b, const char *dir, const char *url, int depth) {
+    DIR *handle;
+    struct dirent *dirent;
+    walk_entry *entries = NULL;
+    size_t count = 0, cap = 0;
+    int status = 0;
+
+    /* Symlink loops end here */
+    if (depth > 32 || !(handle = opendir(dir))) {
+        return depth ? 0 : -1;
+    }
+
+    while ((dirent = readdir(handle))) {
+        char file[PATH_MAX];
+        struct stat st;
+
+        if (dirent->d_name[0] == '.' ||
+            snprintf(file, sizeof(file), "%s/%s", dir, dirent->d_name) >= (int)sizeof(file) ||
+            stat(file, &st) != 0 || !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) {
+            continue;
+        }
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            walk_entry *grown = realloc(entries, cap * sizeof(walk_entry));
+            if (!grown) {
+                status = -1;
+                break;
+            }
+            entries = grown;
+        }
+        if (!(entries[count].name = strdup(dirent->d_name))) {
+            status = -1;
+            break;
+        }
+        entries[count].st = st;
+        count++;
+    }
+    closedir(handle);
+
+    qsort(entries, count, sizeof(walk_entry), compare_walk_entries);
+
+    for (size_t i = 0; i < count && status == 0; i++) {
+        const char *name = entries[i].name;
+        const struct stat *st = &entries[i].st;
+        size_t len = strlen(name);
+        char file[PATH_MAX], path[PATH_MAX];
+
+        if (snprintf(file, sizeof(file), "%s/%s", dir, name) >= (int)sizeof(file) ||
+            snprintf(path, sizeof(path), "%s%s%s", url, name,
+                     S_ISDIR(st->st_mode) ? "/" : "") >= (int)sizeof(path)) {
+            continue;
+        }
+
+        if (S_ISDIR(st->st_mode)) {
+            status = walk(b, file, path, depth + 1);
+        } else if (len > 4 && !strcmp(name + len - 4, ".gmi")) {
+            status = index_file(b, file, path, name, st);
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        free(entries[i].name);
+    }
+    free(entries);
+    return status;
+}
+
+static int compare_terms(const void *a, const void *b) {
+    return strcmp((*(build_term *const *)a)->text, (*(build_term *const *)b)->text);
+}
+
+static int compare_entries(const void *a, const void *b) {
+    uint32_t ia = ((const doc_entry *)a)->term->id;
+    uint32_t ib = ((const doc_entry *)b)->term->id;
+    return ia < ib ? -1 : ia > ib;
+}
+
+/* Add a NUL-terminated string to the string section */
+static uint32_t add_string(byte_buffer *strings, const char *text) {
+    uint32_t offset = (uint32_t)strings->len;
+    if (buffer_append(strings, text, strlen(text) + 1) != 0) {
+        return UINT32_MAX;
+    }
+    return offset;
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Lay out the built index and write it to fd */
+static int write_index(builder *b, int fd) {
+    build_term **sorted = malloc((b->term_count ? b->term_count : 1) * sizeof(build_term *));
+    search_doc *docs = calloc(b->doc_count ? b->doc_count : 1, sizeof(search_doc));
+    search_term *terms = calloc(b->term_count ? b->term_count : 1, sizeof(search_term));
+    byte_buffer postings = {0}, forward = {0}, strings = {0};
+    search_header header;
+    uint64_t total_length = 0;
+    int status = -1;
+
+    if (!sorted || !docs || !terms) {
+        goto done;
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < b->slot_count; i++) {
+        if (b->slots[i]) sorted[n++] = b->slots[i];
+    }
+    qsort(sorted, n, sizeof(build_term *), compare_terms);
+    for (size_t i = 0; i < n; i++) {
+        sorted[i]->id = (uint32_t)i;
+    }
+
+    /* Postings are appended document by document, so ids ascend */
+    for (size_t d = 0; d < b->doc_count; d++) {
+        build_doc *doc = &b->docs[d];
+
+        qsort(doc->entries, doc->entry_count, sizeof(doc_entry), compare_entries);
+        docs[d].mtime = doc->mtime;
+        docs[d].size = doc->size;
+        docs[d].path = add_string(&strings, doc->path);
+        docs[d].title = add_string(&strings, doc->title ? doc->title : "");
+        docs[d].length = doc->length;
+        docs[d].forward_count = (uint32_t)doc->entry_count;
+        docs[d].forward = forward.len;
+        total_length += doc->length;
+
+        for (size_t e = 0; e < doc->entry_count; e++) {
+            build_term *term = doc->entries[e].term;
+            if (buffer_varint(&forward, term->id) != 0 ||
+                buffer_varint(&forward, doc->entries[e].tf) != 0 ||
+                buffer_varint(&term->postings, d - (term->df ? term->prev_doc : 0)) != 0 ||
+                buffer_varint(&term->postings, doc->entries[e].tf) != 0) {
+                goto done;
+            }
+            term->prev_doc = (uint32_t)d;
+            term->df++;
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        terms[i].text = add_string(&strings, sorted[i]->text);
+        terms[i].df = sorted[i]->df;
+        terms[i].postings = postings.len;
+        if (buffer_append(&postings, sorted[i]->postings.data, sorted[i]->postings.len) != 0) {
+            goto done;
+        }
+    }
+
+    if (strings.len >= UINT32_MAX || buffer_append(&strings, "", 1) != 0) {
+        errno = EFBIG;
+        goto done;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SEARCH_MAGIC, sizeof(header.magic));
+    header.byte_order = SEARCH_BYTE_ORDER;
+    header.doc_count = (uint32_t)b->doc_count;
+    header.term_count = (uint32_t)n;
+    header.total_length = total_length;
+    header.docs_offset = sizeof(header);
+    header.terms_offset = header.docs_offset + b->doc_count * sizeof(search_doc);
+    header.postings_offset = header.terms_offset + n * sizeof(search_term);
+    header.forward_offset = header.postings_offset + postings.len;
+    header.strings_offset = header.forward_offset + forward.len;
+    header.file_size = header.strings_offset + strings.len;
+
+    if (write_all(fd, &header, sizeof(header)) == 0 &&
+        write_all(fd, docs, b->doc_count * sizeof(search_doc)) == 0 &&
+        write_all(fd, terms, n * sizeof(search_term)) == 0 &&
+        write_all(fd, postings.data, postings.len) == 0 &&
+        write_all(fd, forward.data, forward.len) == 0 &&
+        write_all(fd, strings.data, strings.len) == 0) {
+        status = 0;
+    }
+
+done:
+    if (status != 0 && !errno) errno = ENOMEM;
+    free(sorted);
+    free(docs);
+    free(terms);
+    free(postings.data);
+    free(forward.data);
+    free(strings.data);
+    return status;
+}
+
+static void free_builder(builder *b) {
+    for (size_t i = 0; i < b->slot_count; i++) {
+        if (b->slots[i]) {
+            free(b->slots[i]->text);
+            free(b->slots[i]->postings.data);
+            free(b->slots[i]);
+        }
+    }
+    for (size_t i = 0; i < b->doc_count; i++) {
+        free(b->docs[i].path);
+        free(b->docs[i].title);
+        free(b->docs[i].entries);
+    }
+    free(b->slots);
+    free(b->docs);
+}
+
+/* Build or incrementally update an index */
+int gmi2html_search_build(const char *root, const char *index_path,
+                          gmi2html_search_stats *stats) {
+    builder b;
+    char tmp_path[PATH_MAX];
+    int status = -1;
+    int saved_errno;
+
+    memset(&b, 0, sizeof(b));
+    b.old = gmi2html_search_open(index_path);
+
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmpXXXXXX", index_path) >= (int)sizeof(tmp_path)) {
+        errno = ENAMETOOLONG;
+        goto done;
+    }
+
+    errno = 0;
+    if (walk(&b, root, "/", 0) != 0 || b.failed) {
+        if (!errno) errno = ENOMEM;
+        goto done;
+    }
+
+    int fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        goto done;
+    }
+    errno = 0;
+    if (write_index(&b, fd) != 0 || fchmod(fd, 0644) != 0 || fsync(fd) != 0) {
+        saved_errno = errno;
+        close(fd);
+        unlink(tmp_path);
+        errno = saved_errno;
+        goto done;
+    }
+    if (close(fd) != 0 || rename(tmp_path, index_path) != 0) {
+        saved_errno = errno;
+        unlink(tmp_path);
+        errno = saved_errno;
+        goto done;
+    }
+
+    if (stats) {
+        stats->documents = (unsigned)b.doc_count;
+        stats->parsed = (unsigned)b.parsed;
+        stats->terms = (unsigned)b.term_count;
+    }
+    status = 0;
+
+done:
+    saved_errno = errno;
+    gmi2html_search_close((gmi2html_search_index *)b.old);
+    free_builder(&b);
+    errno = saved_errno;
+    return status;
+}
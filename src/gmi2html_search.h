@@ -0,0 +1,84 @@
+#ifndef GMI2HTML_SEARCH_H
+#define GMI2HTML_SEARCH_H
+
+#include <stddef.h>
+
+/**
+ * Full-text search over a tree of Gemini documents
+ *
+ * gmi2html_search_build tokenizes the text, heading, list and quote lines
+ * of every .gmi file under a directory into a single index file, which
+ * gmi2html_search_open maps into memory. The file holds a sorted term
+ * dictionary and one posting list per term (delta-coded document numbers
+ * and term frequencies as varints), so a query is a binary search per
+ * term plus a walk over the matching postings.
+ *
+ * The index also keeps each document's terms with the file's size and
+ * mtime. A rebuild only parses files whose size or mtime changed and
+ * takes the terms of the others from the previous index.
+ *
+ * This code only depends on libc and POSIX, so the module and the
+ * gmi2html-index command-line tool share it.
+ */
+
+typedef struct gmi2html_search_index gmi2html_search_index;
+
+typedef struct {
+    const char *path;    /* URL path of the document (points into the index) */
+    const char *title;   /* First # heading, or the file name */
+    double score;
+} gmi2html_search_result;
+
+/* Decides whether a matching document may be returned (1) or not (0) */
+typedef int (*gmi2html_search_filter)(void *ctx, const char *path);
+
+typedef struct {
+    unsigned documents;  /* Documents in the new index */
+    unsigned parsed;     /* Of those, parsed because they were new or changed */
+    unsigned terms;      /* Distinct terms */
+} gmi2html_search_stats;
+
+/**
+ * Build or incrementally update an index
+ * The new index is written next to index_path and renamed over it, so
+ * readers never see a partial file.
+ * @param root: Directory to index; documents are named by their path below it
+ * @param index_path: Index file to update (need not exist yet)
+ * @param stats: Receives build statistics (may be NULL)
+ * @return: 0 on success, -1 with errno set on failure
+ */
+int gmi2html_search_build(const char *root, const char *index_path,
+                          gmi2html_search_stats *stats);
+
+/**
+ * Map an index file into memory
+ * @param path: Index file
+ * @return: Index handle, or NULL if the file is missing or not a valid index
+ */
+gmi2html_search_index *gmi2html_search_open(const char *path);
+
+/**
+ * Find the documents containing every word of a query, best first
+ * Ranking is BM25, with words in headings counting three times.
+ * Safe to call from several threads on the same index.
+ * @param index: Open index
+ * @param query: Words to search for
+ * @param results: Receives up to max_results results
+ * @param max_results: Size of the results array
+ * @param total: Receives the number of matching documents (may be NULL)
+ * @param filter: Called for every matching document; those it rejects are
+ *                neither returned nor counted (NULL keeps them all)
+ * @param filter_ctx: First argument of filter
+ * @return: Number of results stored, or -1 if memory ran out
+ */
+int gmi2html_search_query(const gmi2html_search_index *index, const char *query,
+                          gmi2html_search_result *results, int max_results,
+                          size_t *total, gmi2html_search_filter filter, void *filter_ctx);
+
+/**
+ * Unmap an index
+ * @param index: Index to close (NULL is ignored)
+ */
+void gmi2html_search_close(gmi2html_search_index *index);
+
+#endif
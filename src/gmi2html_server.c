@@ -0,0 +1,745 @@
+/*
+ * gmi2html-server - Standalone HTTP/1.1 server for Gemini files
+ *
+ * Serves .gmi files as HTML using the same parser and renderer as
+ * mod_gmi2html, for hosts without Apache and as a local load-testing
+ * target. Linux only: one shared epoll instance is driven by a fixed
+ * pool of worker threads, connections are kept alive between requests
+ * and static assets are sent with sendfile.
+ */
+
+#define _GNU_SOURCE
+
+#include "gemini_parser.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REQUEST_MAX 8192          /* Largest accepted request head */
+#define RESPONSE_HEAD_MAX 1024    /* Room for the response status and headers */
+#define CONNECTIONS_MAX 65536     /* Upper bound on tracked descriptors */
+#define DEFAULT_PORT "8080"
+#define DEFAULT_KEEPALIVE_TIMEOUT 5
+
+/* Server-wide settings, fixed after startup */
+typedef struct {
+    char root[PATH_MAX];     /* Document root (resolved) */
+    char *stylesheet;        /* Custom CSS (NULL uses the built-in stylesheet) */
+    char *custom_head;       /* Custom <head> content (NULL to skip) */
+    int minify;              /* Compact output; stylesheet is minified at startup */
+    int keepalive_timeout;   /* Seconds an idle connection is kept open */
+} ServerConfig;
+
+/* Per-connection state; only one worker owns a connection at a time */
+typedef struct {
+    int fd;
+    char in[REQUEST_MAX];
+    size_t in_len;
+
+    /* Pending response: head, then either a memory body or a file body */
+    char head[RESPONSE_HEAD_MAX];
+    size_t head_len, head_sent;
+    char *body;
+    size_t body_len, body_sent;
+    int body_owned;          /* body was allocated by the renderer */
+    int file_fd;
+    off_t file_off, file_end;
+
+    int keep_alive;
+    time_t last_active;
+} Connection;
+
+static ServerConfig config;
+static int listen_fd = -1;
+static int epoll_fd = -1;
+
+/* Open connections by descriptor, for the idle connection reaper */
+static Connection **connections;
+static int connections_max;
+static pthread_mutex_t connections_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Read a whole file into a NUL-terminated heap buffer */
+static char *read_file(const char *path, size_t *length) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+
+    char *content = malloc(st.st_size + 1);
+    size_t pos = 0;
+    while (content && pos < (size_t)st.st_size) {
+        ssize_t n = read(fd, content + pos, st.st_size - pos);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            free(content);
+            content = NULL;
+            break;
+        }
+        pos += n;
+    }
+    close(fd);
+
+    if (content) {
+        content[pos] = '\0';
+        if (length) *length = pos;
+    }
+    return content;
+}
+
+/* Content type for a static asset, by extension */
+static const char *content_type_for(const char *path) {
+    static const struct { const char *ext; const char *type; } types[] = {
+        { ".html", "text/html; charset=utf-8" },
+        { ".css",  "text/css; charset=utf-8" },
+        { ".js",   "text/javascript; charset=utf-8" },
+        { ".txt",  "text/plain; charset=utf-8" },
+        { ".xml",  "application/xml" },
+        { ".json", "application/json" },
+        { ".png",  "image/png" },
+        { ".jpg",  "image/jpeg" },
+        { ".jpeg", "image/jpeg" },
+        { ".gif",  "image/gif" },
+        { ".svg",  "image/svg+xml" },
+        { ".ico",  "image/x-icon" },
+        { ".webp", "image/webp" },
+        { ".woff2", "font/woff2" },
+        { NULL, NULL }
+    };
+
+    const char *dot = strrchr(path, '.');
+    if (dot && !strchr(dot, '/')) {
+        for (int i = 0; types[i].ext; i++) {
+            if (!strcasecmp(dot, types[i].ext)) {
+                return types[i].type;
+            }
+        }
+    }
+    return "application/octet-stream";
+}
+
+/* Decode a request target path (query and fragment dropped) into dst
+ * (-1 for bad escapes, control bytes, relative paths or "..") */
+static int decode_path(char *dst, size_t dst_size, const char *src, size_t src_len) {
+    size_t pos = 0;
+
+    for (size_t i = 0; i < src_len && src[i] != '?' && src[i] != '#'; i++) {
+        char ch = src[i];
+
+        if (ch == '%') {
+            if (i + 2 >= src_len || !isxdigit((unsigned char)src[i + 1]) ||
+                !isxdigit((unsigned char)src[i + 2])) {
+                return -1;
+            }
+            char hex[3] = { src[i + 1], src[i + 2], '\0' };
+            ch = (char)strtol(hex, NULL, 16);
+            i += 2;
+        }
+
+        /* Control bytes (CR and LF among them) would end up in the Location
+           of a directory redirect, so a path with any is refused */
+        if ((unsigned char)ch < 0x20 || ch == 0x7f || pos + 1 >= dst_size) {
+            return -1;
+        }
+        dst[pos++] = ch;
+    }
+    dst[pos] = '\0';
+
+    /* Must be absolute and must not climb out of the document root */
+    if (dst[0] != '/') return -1;
+    for (const char *p = dst; (p = strstr(p, "/..")); p += 3) {
+        if (p[3] == '/' || p[3] == '\0') return -1;
+    }
+    return 0;
+}
+
+static void reset_response(Connection *c) {
+    if (c->body_owned) {
+        gemini_html_free(c->body);
+    }
+    if (c->file_fd >= 0) {
+        close(c->file_fd);
+    }
+    c->head_len = c->head_sent = 0;
+    c->body = NULL;
+    c->body_len = c->body_sent = 0;
+    c->body_owned = 0;
+    c->file_fd = -1;
+    c->file_off = c->file_end = 0;
+}
+
+/* Queue the status line and headers of a response */
+static void set_response_head(Connection *c, int status, const char *reason,
+                              const char *type, size_t length, const char *location) {
+    c->head_len = snprintf(c->head, sizeof(c->head),
+        "HTTP/1.1 %d %s\r\n"
+        "Server: gmi2html-server\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %zu\r\n"
+        "%s%s%s"
+        "Connection: %s\r\n"
+        "\r\n",
+        status, reason, type, length,
+        location ? "Location: " : "", location ? location : "", location ? "\r\n" : "",
+        c->keep_alive ? "keep-alive" : "close");
+    if (c->head_len >= sizeof(c->head)) {
+        c->head_len = sizeof(c->head) - 1;
+    }
+}
+
+/* Queue a short HTML error page */
+static void set_error_response(Connection *c, int status, int head_only) {
+    static const struct { int status; const char *reason; const char *body; } errors[] = {
+        { 400, "Bad Request", "<h1>400 Bad Request</h1>\n" },
+        { 403, "Forbidden", "<h1>403 Forbidden</h1>\n" },
+        { 404, "Not Found", "<h1>404 Not Found</h1>\n" },
+        { 405, "Method Not Allowed", "<h1>405 Method Not Allowed</h1>\n" },
+        { 500, "Internal Server Error", "<h1>500 Internal Server Error</h1>\n" },
+    };
+    size_t i = 0;
+
+    while (i < sizeof(errors) / sizeof(errors[0]) - 1 && errors[i].status != status) {
+        i++;
+    }
+
+    /* Error bodies are static, so nothing is owned or freed */
+    size_t length = strlen(errors[i].body);
+    set_response_head(c, errors[i].status, errors[i].reason,
+                      "text/html; charset=utf-8", length, NULL);
+    if (!head_only) {
+        c->body = (char *)errors[i].body;
+        c->body_len = length;
+    }
+}
+
+/* Render a .gmi file into the response body */
+static void serve_gemini(Connection *c, const char *fs_path, int head_only) {
+    size_t length;
+    char *content = read_file(fs_path, &length);
+    if (!content) {
+        set_error_response(c, errno == EACCES ? 403 : 404, head_only);
+        return;
+    }
+
+    /* Title from the file name, without directory or .gmi extension */
+    char title[NAME_MAX + 1];
+    const char *slash = strrchr(fs_path, '/');
+    snprintf(title, sizeof(title), "%s", slash ? slash + 1 : fs_path);
+    char *dot = strrchr(title, '.');
+    if (dot && !strcmp(dot, ".gmi")) {
+        *dot = '\0';
+    }
+
+    GeminiRenderOptions options = {0};
+    options.stylesheet = config.stylesheet;
+    options.custom_head = config.custom_head;
+    options.minify = config.minify;
+    char *html = gemini_convert_to_html(content, length, title, &options);
+    free(content);
+
+    if (!html) {
+        set_error_response(c, 500, head_only);
+        return;
+    }
+
+    size_t html_len = strlen(html);
+    set_response_head(c, 200, "OK", "text/html; charset=utf-8", html_len, NULL);
+    if (head_only) {
+        gemini_html_free(html);
+        return;
+    }
+    c->body = html;
+    c->body_len = html_len;
+    c->body_owned = 1;
+}
+
+/* Queue a static file to be sent with sendfile */
+static void serve_static(Connection *c, const char *fs_path, off_t size, int head_only) {
+    int fd = open(fs_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        set_error_response(c, 403, head_only);
+        return;
+    }
+
+    set_response_head(c, 200, "OK", content_type_for(fs_path), (size_t)size, NULL);
+    if (head_only) {
+        close(fd);
+        return;
+    }
+    c->file_fd = fd;
+    c->file_off = 0;
+    c->file_end = size;
+}
+
+/* Check that a file, after following symlinks, is inside the document root */
+static int inside_root(const char *fs_path) {
+    char resolved[PATH_MAX];
+    size_t root_len = strlen(config.root);
+
+    if (!realpath(fs_path, resolved)) {
+        return 0;
+    }
+    if (root_len == 1) {
+        return 1;  /* The root is "/" */
+    }
+    return !strncmp(resolved, config.root, root_len) &&
+           (resolved[root_len] == '/' || resolved[root_len] == '\0');
+}
+
+/* Map a decoded URL path onto the document root and queue the response */
+static void serve_path(Connection *c, const char *path, int head_only) {
+    char fs_path[PATH_MAX];
+    struct stat st;
+
+    if (snprintf(fs_path, sizeof(fs_path), "%s%s", config.root, path) >= (int)sizeof(fs_path) ||
+        stat(fs_path, &st) < 0) {
+        set_error_response(c, 404, head_only);
+        return;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        size_t len = strlen(fs_path);
+
+        /* Directories need a trailing slash so relative links resolve */
+        if (path[strlen(path) - 1] != '/') {
+            char location[PATH_MAX + 1];
+            snprintf(location, sizeof(location), "%s/", path);
+            set_response_head(c, 301, "Moved Permanently", "text/plain", 0, location);
+            return;
+        }
+
+        if (len + sizeof("index.gmi") > sizeof(fs_path)) {
+            set_error_response(c, 404, head_only);
+            return;
+        }
+        strcpy(fs_path + len, "index.gmi");
+        if (stat(fs_path, &st) < 0) {
+            set_error_response(c, 404, head_only);
+            return;
+        }
+    }
+
+    if (!S_ISREG(st.st_mode) || !inside_root(fs_path)) {
+        set_error_response(c, 404, head_only);
+        return;
+    }
+
+    size_t len = strlen(fs_path);
+    if (len > 4 && !strcmp(fs_path + len - 4, ".gmi")) {
+        serve_gemini(c, fs_path, head_only);
+    } else {
+        serve_static(c, fs_path, st.st_size, head_only);
+    }
+}
+
+/* Whether a header line (without CRLF) is "name: value" containing token */
+static int header_has_token(const char *line, size_t len, const char *name, const char *token) {
+    size_t name_len = strlen(name);
+    if (len <= name_len || strncasecmp(line, name, name_len) || line[name_len] != ':') {
+        return 0;
+    }
+
+    size_t token_len = strlen(token);
+    for (size_t i = name_len + 1; i + token_len <= len; i++) {
+        if (!strncasecmp(line + i, token, token_len)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Handle one complete request head of length len at the start of c->in */
+static void handle_request(Connection *c, size_t len) {
+    const char *req = c->in;
+    const char *end = req + len;
+    const char *line_end = memchr(req, '\r', len);
+
+    /* Request line: METHOD SP target SP HTTP/x.y */
+    const char *sp1 = line_end ? memchr(req, ' ', line_end - req) : NULL;
+    const char *sp2 = sp1 ? memchr(sp1 + 1, ' ', line_end - sp1 - 1) : NULL;
+    if (!sp2 || line_end - sp2 - 1 != 8 || strncmp(sp2 + 1, "HTTP/1.", 7)) {
+        c->keep_alive = 0;
+        set_error_response(c, 400, 0);
+        return;
+    }
+
+    int http11 = sp2[8] == '1';
+    int head_only = (sp1 - req == 4 && !strncmp(req, "HEAD", 4));
+    int is_get = (sp1 - req == 3 && !strncmp(req, "GET", 3));
+    int has_body = 0;
+
+    /* HTTP/1.1 defaults to keep-alive, HTTP/1.0 must ask for it */
+    c->keep_alive = http11;
+    for (const char *p = line_end + 2; p < end; ) {
+        const char *eol = memchr(p, '\r', end - p);
+        if (!eol || eol == p) break;
+        size_t n = eol - p;
+
+        if (header_has_token(p, n, "Connection", "close")) {
+            c->keep_alive = 0;
+        } else if (header_has_token(p, n, "Connection", "keep-alive")) {
+            c->keep_alive = 1;
+        } else if (header_has_token(p, n, "Content-Length", "") ||
+                   header_has_token(p, n, "Transfer-Encoding", "")) {
+            has_body = 1;
+        }
+        p = eol + 2;
+    }
+
+    if (!is_get && !head_only) {
+        /* Request bodies are never read, so the stream cannot be reused */
+        if (has_body) c->keep_alive = 0;
+        set_error_response(c, 405, 0);
+        return;
+    }
+
+    char path[PATH_MAX];
+    if (decode_path(path, sizeof(path), sp1 + 1, sp2 - sp1 - 1) < 0) {
+        set_error_response(c, 400, head_only);
+        return;
+    }
+
+    serve_path(c, path, head_only);
+}
+
+/* Length of the first complete request head in c->in, or 0 */
+static size_t request_length(const Connection *c) {
+    for (size_t i = 3; i < c->in_len; i++) {
+        if (c->in[i] == '\n' && c->in[i - 1] == '\r' &&
+            c->in[i - 2] == '\n' && c->in[i - 3] == '\r') {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+/* Send as much of the pending response as possible: 1 done, 0 blocked, -1 error */
+static int send_response(Connection *c) {
+    while (c->head_sent < c->head_len) {
+        int more = (c->body_len > c->body_sent || c->file_end > c->file_off) ? MSG_MORE : 0;
+        ssize_t n = send(c->fd, c->head + c->head_sent, c->head_len - c->head_sent,
+                         MSG_NOSIGNAL | more);
+        if (n < 0) goto blocked;
+        c->head_sent += n;
+    }
+
+    while (c->body_sent < c->body_len) {
+        ssize_t n = send(c->fd, c->body + c->body_sent, c->body_len - c->body_sent,
+                         MSG_NOSIGNAL);
+        if (n < 0) goto blocked;
+        c->body_sent += n;
+    }
+
+    while (c->file_off < c->file_end) {
+        ssize_t n = sendfile(c->fd, c->file_fd, &c->file_off, c->file_end - c->file_off);
+        if (n < 0) goto blocked;
+        if (n == 0) return -1;  /* File shrank underneath us */
+    }
+
+    return 1;
+
+blocked:
+    if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+    if (errno == EINTR) return send_response(c);
+    return -1;
+}
+
+static int arm_connection(Connection *c, uint32_t events) {
+    struct epoll_event ev = { .events = events | EPOLLONESHOT | EPOLLRDHUP, .data.ptr = c };
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void close_connection(Connection *c) {
+    pthread_mutex_lock(&connections_lock);
+    connections[c->fd] = NULL;
+    close(c->fd);  /* Also removes it from the epoll set */
+    pthread_mutex_unlock(&connections_lock);
+
+    reset_response(c);
+    free(c);
+}
+
+/*
+ * Wait for the next event on a connection
+ * Once it is re-armed another worker may own (and free) the connection,
+ * so this must be the last use of c.
+ */
+static int wait_connection(Connection *c, uint32_t events) {
+    __atomic_store_n(&c->last_active, time(NULL), __ATOMIC_RELAXED);
+    return arm_connection(c, events);
+}
+
+/* Drive a connection until it would block: 0 keeps it open, -1 closes it */
+static int process_connection(Connection *c) {
+    for (;;) {
+        if (c->head_len) {
+            int r = send_response(c);
+            if (r < 0) return -1;
+            if (r == 0) return wait_connection(c, EPOLLOUT);
+            reset_response(c);
+            if (!c->keep_alive) return -1;
+        }
+
+        /* Serve pipelined requests that are already buffered */
+        size_t len = request_length(c);
+        if (len) {
+            handle_request(c, len);
+            memmove(c->in, c->in + len, c->in_len - len);
+            c->in_len -= len;
+            continue;
+        }
+
+        if (c->in_len == sizeof(c->in)) {
+            c->keep_alive = 0;
+            set_error_response(c, 400, 0);
+            continue;
+        }
+
+        ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+        if (n > 0) {
+            c->in_len += n;
+        } else if (n == 0) {
+            return -1;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return wait_connection(c, EPOLLIN);
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+/* Accept every pending connection, then re-arm the listener */
+static void accept_connections(void) {
+    for (;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept4");
+            break;
+        }
+
+        Connection *c = fd < connections_max ? calloc(1, sizeof(Connection)) : NULL;
+        if (!c) {
+            close(fd);
+            continue;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        c->fd = fd;
+        c->file_fd = -1;
+        c->last_active = time(NULL);
+
+        pthread_mutex_lock(&connections_lock);
+        connections[fd] = c;
+        pthread_mutex_unlock(&connections_lock);
+
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT | EPOLLRDHUP, .data.ptr = c };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close_connection(c);
+        }
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = NULL };
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, listen_fd, &ev);
+}
+
+/* Worker thread: take one ready descriptor at a time from the shared epoll set */
+static void *worker_main(void *arg) {
+    (void)arg;  /* Unused */
+    struct epoll_event ev;
+
+    for (;;) {
+        int n = epoll_wait(epoll_fd, &ev, 1, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            exit(1);
+        }
+        if (n == 0) continue;
+
+        if (!ev.data.ptr) {
+            accept_connections();
+            continue;
+        }
+
+        Connection *c = ev.data.ptr;
+        __atomic_store_n(&c->last_active, time(NULL), __ATOMIC_RELAXED);
+        if ((ev.events & EPOLLERR) || process_connection(c) < 0) {
+            close_connection(c);
+        }
+    }
+
+    return NULL;
+}
+
+/* Shut down connections that have been idle too long; their workers then close them */
+static void reap_idle_connections(void) {
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&connections_lock);
+    for (int fd = 0; fd < connections_max; fd++) {
+        Connection *c = connections[fd];
+        if (c && now - __atomic_load_n(&c->last_active, __ATOMIC_RELAXED) > config.keepalive_timeout) {
+            shutdown(fd, SHUT_RDWR);
+        }
+    }
+    pthread_mutex_unlock(&connections_lock);
+}
+
+static int open_listener(const char *addr, const char *port) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE };
+    struct addrinfo *res;
+    int err = getaddrinfo(addr, port, &hints, &res);
+    if (err) {
+        fprintf(stderr, "gmi2html-server: %s: %s\n", addr ? addr : "*", gai_strerror(err));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) continue;
+
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd < 0) {
+        perror("gmi2html-server: bind");
+    }
+    return fd;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+        "Usage: gmi2html-server [options]\n"
+        "  -r DIR    document root (default: current directory)\n"
+        "  -b ADDR   address to listen on (default: all)\n"
+        "  -p PORT   port to listen on (default: " DEFAULT_PORT ")\n"
+        "  -t N      worker threads (default: number of CPUs)\n"
+        "  -s FILE   custom CSS stylesheet (as Gmi2HtmlStylesheet)\n"
+        "  -H FILE   custom <head> content (as Gmi2HtmlHead)\n"
+        "  -m        minify the HTML and stylesheet (as Gmi2HtmlMinify)\n"
+        "  -k SECS   keep-alive idle timeout (default: %d)\n",
+        DEFAULT_KEEPALIVE_TIMEOUT);
+}
+
+int main(int argc, char **argv) {
+    const char *root = ".";
+    const char *addr = NULL;
+    const char *port = DEFAULT_PORT;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    config.keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT;
+
+    while ((opt = getopt(argc, argv, "r:b:p:t:s:H:k:mh")) != -1) {
+        switch (opt) {
+            case 'r': root = optarg; break;
+            case 'b': addr = optarg; break;
+            case 'p': port = optarg; break;
+            case 't': threads = atol(optarg); break;
+            case 'k': config.keepalive_timeout = atoi(optarg); break;
+            case 'm': config.minify = 1; break;
+
+            /* Like the module, an unreadable file falls back to the default */
+            case 's':
+                config.stylesheet = read_file(optarg, NULL);
+                if (!config.stylesheet) {
+                    fprintf(stderr, "gmi2html-server: cannot read stylesheet %s, using built-in\n", optarg);
+                }
+                break;
+            case 'H':
+                config.custom_head = read_file(optarg, NULL);
+                if (!config.custom_head) {
+                    fprintf(stderr, "gmi2html-server: cannot read head content %s, skipping\n", optarg);
+                }
+                break;
+
+            default:
+                usage();
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+
+    if (threads < 1 || config.keepalive_timeout < 1) {
+        usage();
+        return 2;
+    }
+
+    if (config.minify) {
+        const char *css = config.stylesheet ? config.stylesheet : gemini_builtin_stylesheet();
+        char *minified = gemini_minify_css(css, strlen(css));
+        if (minified) {
+            free(config.stylesheet);
+            config.stylesheet = minified;
+        } else {
+            config.minify = 0;
+        }
+    }
+    
+    if (!realpath(root, config.root)) {
+        perror(root);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    struct rlimit rl;
+    connections_max = CONNECTIONS_MAX;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)connections_max) {
+        connections_max = (int)rl.rlim_cur;
+    }
+    connections = calloc(connections_max, sizeof(Connection *));
+
+    listen_fd = open_listener(addr, port);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (!connections || listen_fd < 0 || epoll_fd < 0) {
+        return 1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = NULL };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+    for (long i = 0; i < threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker_main, NULL) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+        pthread_detach(thread);
+    }
+
+    fprintf(stderr, "gmi2html-server: serving %s on port %s with %ld threads\n",
+            config.root, port, threads);
+
+    for (;;) {
+        sleep(1);
+        reap_idle_connections();
+    }
+}
@@ -0,0 +1,124 @@
+/*
+ * gmi2html_style - Per-process cache of minified stylesheets
+ */
+
+#include "gmi2html_style.h"
+#include "gemini_parser.h"
+#include "apr_strings.h"
+#include "apr_file_io.h"
+#include "apr_hash.h"
+#include "apr_thread_mutex.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* A minified custom stylesheet in the per-process cache (malloc'd) */
+typedef struct {
+    char *css;
+    apr_time_t mtime;
+    apr_off_t size;
+} style_entry;
+
+/* Minified built-in stylesheet, made once in child_init */
+static char *builtin_minified;
+
+/* Per-process cache: stylesheet path -> style_entry */
+static apr_hash_t *style_cache;
+static apr_thread_mutex_t *style_lock;
+
+/* Set up the per-process stylesheet cache */
+apr_status_t gmi2html_style_child_init(apr_pool_t *p) {
+    const char *builtin = gemini_builtin_stylesheet();
+    builtin_minified = gemini_minify_css(builtin, strlen(builtin));
+
+    apr_status_t status = apr_thread_mutex_create(&style_lock, APR_THREAD_MUTEX_DEFAULT, p);
+    if (status != APR_SUCCESS) {
+        style_lock = NULL;
+        return status;
+    }
+    style_cache = apr_hash_make(p);
+    return APR_SUCCESS;
+}
+
+/* Minified built-in stylesheet */
+static const char *builtin_style(apr_pool_t *p) {
+    if (builtin_minified) {
+        return builtin_minified;
+    }
+
+    const char *builtin = gemini_builtin_stylesheet();
+    char *css = gemini_minify_css(builtin, strlen(builtin));
+    const char *result = css ? apr_pstrdup(p, css) : builtin;
+    free(css);
+    return result;
+}
+
+/* Read and minify a stylesheet (malloc'd, NULL if it cannot be read) */
+static char *minify_file(const char *path, apr_off_t size, apr_pool_t *p) {
+    apr_file_t *file;
+    apr_size_t bytes_read;
+    char *css = NULL;
+
+    if (apr_file_open(&file, path, APR_READ, APR_OS_DEFAULT, p) != APR_SUCCESS) {
+        return NULL;
+    }
+
+    char *content = apr_palloc(p, size + 1);
+    if (apr_file_read_full(file, content, size, &bytes_read) == APR_SUCCESS &&
+        bytes_read == (apr_size_t)size) {
+        css = gemini_minify_css(content, size);
+    }
+
+    apr_file_close(file);
+    return css;
+}
+
+/* Get a minified stylesheet */
+const char *gmi2html_style_minified(apr_pool_t *p, const char *path, const apr_finfo_t *finfo) {
+    if (!path) {
+        return builtin_style(p);
+    }
+
+    if (style_lock) {
+        const char *css = NULL;
+
+        apr_thread_mutex_lock(style_lock);
+        style_entry *entry = apr_hash_get(style_cache, path, APR_HASH_KEY_STRING);
+        if (entry && entry->mtime == finfo->mtime && entry->size == finfo->size) {
+            css = apr_pstrdup(p, entry->css);
+        }
+        apr_thread_mutex_unlock(style_lock);
+
+        if (css) {
+            return css;
+        }
+    }
+
+    char *css = minify_file(path, finfo->size, p);
+    if (!css) {
+        return builtin_style(p);
+    }
+    const char *result = apr_pstrdup(p, css);
+
+    style_entry *entry = style_lock ? malloc(sizeof(style_entry)) : NULL;
+    if (!entry) {
+        free(css);
+        return result;
+    }
+    entry->css = css;
+    entry->mtime = finfo->mtime;
+    entry->size = finfo->size;
+
+    apr_thread_mutex_lock(style_lock);
+    style_entry *old = apr_hash_get(style_cache, path, APR_HASH_KEY_STRING);
+    if (old) {
+        /* The hash keeps the key of the first insert, which is never freed */
+        apr_hash_set(style_cache, path, APR_HASH_KEY_STRING, entry);
+        free(old->css);
+        free(old);
+    } else {
+        apr_hash_set(style_cache, strdup(path), APR_HASH_KEY_STRING, entry);
+    }
+    apr_thread_mutex_unlock(style_lock);
+
+    return result;
+}
@@ -0,0 +1,32 @@
+#ifndef GMI2HTML_STYLE_H
+#define GMI2HTML_STYLE_H
+
+#include "apr_pools.h"
+#include "apr_file_info.h"
+
+/**
+ * Minified stylesheets for Gmi2HtmlMinify
+ *
+ * The built-in stylesheet is minified once per process. Custom
+ * stylesheets are minified on first use and kept per process until the
+ * file's size or mtime changes.
+ */
+
+/**
+ * Set up the per-process stylesheet cache (call from child_init)
+ * Without it, custom stylesheets are minified on every request.
+ * @param p: Child process pool
+ * @return: APR_SUCCESS or the mutex creation status
+ */
+apr_status_t gmi2html_style_child_init(apr_pool_t *p);
+
+/**
+ * Get a minified stylesheet
+ * @param p: Pool for the result
+ * @param path: Custom stylesheet, or NULL for the built-in one
+ * @param finfo: Size and mtime of path (ignored when path is NULL)
+ * @return: Minified CSS (in p); the built-in stylesheet if path cannot be read
+ */
+const char *gmi2html_style_minified(apr_pool_t *p, const char *path, const apr_finfo_t *finfo);
+
+#endif
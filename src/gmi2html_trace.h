@@ -0,0 +1,43 @@
+#ifndef GMI2HTML_TRACE_H
+#define GMI2HTML_TRACE_H
+
+/**
+ * Static tracepoints (USDT) for the gmi2html provider
+ *
+ * When built with GMI2HTML_USDT defined (make USDT=1), each probe is a
+ * <sys/sdt.h> site: a single nop plus an ELF note that bpftrace and perf
+ * use to attach at runtime. Otherwise the macros compile to nothing.
+ * Probe arguments must be values the code already has at hand, so an
+ * unattached probe costs no extra work.
+ *
+ * Probes (arguments in order):
+ *   request_start  (filename)
+ *   request_end    (filename, http status)
+ *   file_read      (filename, bytes)
+ *   asset_load     (path, bytes)           stylesheet and head files
+ *   cache_hit      (filename, cache key)
+ *   cache_stale    (filename, cache key)   previous version sent during a render
+ *   parse_start    (input bytes)
+ *   parse_end      (line count)
+ *   render_start   (line count)           two-stage API only
+ *   render_end     (output bytes)
+ *
+ * The single-pass converter fires parse_start when it begins and
+ * parse_end and render_end when the page is complete.
+ */
+
+#ifdef GMI2HTML_USDT
+
+#include <sys/sdt.h>
+
+#define GMI2HTML_TRACE1(name, a)        DTRACE_PROBE1(gmi2html, name, a)
+#define GMI2HTML_TRACE2(name, a, b)     DTRACE_PROBE2(gmi2html, name, a, b)
+
+#else
+
+#define GMI2HTML_TRACE1(name, a)        do { } while (0)
+#define GMI2HTML_TRACE2(name, a, b)     do { } while (0)
+
+#endif
+
+#endif
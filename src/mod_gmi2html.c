@@ -7,16 +7,30 @@
 
 #include "httpd.h"
 #include "http_config.h"
+#include "http_core.h"
 #include "http_protocol.h"
 #include "http_request.h"
+#include "http_log.h"
 #include "ap_config.h"
 #include "apr_strings.h"
 #include "apr_file_io.h"
 #include "apr_fnmatch.h"
+#include "apr_buckets.h"
 #include <string.h>
 #include <sys/stat.h>
 
 #include "gemini_parser.h"
+#include "gmi2html_background.h"
+#include "gmi2html_blocks.h"
+#include "gmi2html_cache.h"
+#include "gmi2html_feed.h"
+#include "gmi2html_flight.h"
+#include "gmi2html_include.h"
+#include "gmi2html_index.h"
+#include "gmi2html_prerender.h"
+#include "gmi2html_query.h"
+#include "gmi2html_style.h"
+#include "gmi2html_trace.h"
 
 /* Forward declarations */
 module AP_MODULE_DECLARE_DATA gmi2html_module;
@@ -27,14 +41,52 @@ typedef struct {
     const char *gemini_type;
     const char *stylesheet_path;  /* Path to custom stylesheet file */
     const char *head_file_path;    /* Path to custom head content file */
+    int includes;                  /* Expand "%include" lines (on/off/unset) */
+    int indexes;                   /* List directories without index.gmi (on/off/unset) */
+    int feeds;                     /* Serve atom.xml beside index.gmi (on/off/unset) */
+    const char *search_index_path; /* Index file for the gmi2html-search handler */
+    int minify;                    /* Compact HTML and CSS output (on/off/unset) */
+    int prerender;                 /* Linked documents to render ahead (count/unset) */
+    int prefetch;                  /* Prefetch hints for those documents (on/off/unset) */
 } gmi2html_config;
 
+/* Value of an on/off setting that was not configured in a scope */
+#define GMI2HTML_UNSET -1
+
+/* Most linked documents Gmi2HtmlPrerender may render after a page */
+#define MAX_PRERENDER 16
+
+/* Per-server configuration */
+typedef struct {
+    const char *cache_root;           /* On-disk render cache directory */
+    apr_off_t cache_max_size;         /* Eviction threshold in bytes */
+    apr_interval_time_t cache_clean_interval;  /* Time between housekeeping runs */
+    apr_time_t cache_last_clean;      /* Last housekeeping run (parent process) */
+    apr_off_t max_source_size;        /* Largest source converted to HTML */
+    apr_off_t large_source_size;      /* Sources from this size up are large */
+    int max_large_renders;            /* Concurrent large conversions per process */
+    apr_off_t block_cache_size;       /* Rendered block cache per process (main server) */
+} gmi2html_server_config;
+
+#define DEFAULT_CACHE_MAX_SIZE (100 * 1024 * 1024)
+#define DEFAULT_CACHE_CLEAN_INTERVAL 60
+#define DEFAULT_LARGE_SOURCE_SIZE (1024 * 1024)
+
+/* Seconds a client is asked to wait when large conversions are at their limit */
+#define LARGE_RENDER_RETRY_AFTER "5"
+
 /* Get module configuration */
 static gmi2html_config *get_config(request_rec *r) {
     return (gmi2html_config *)ap_get_module_config(r->per_dir_config, 
                                                     &gmi2html_module);
 }
 
+/* Get per-server configuration */
+static gmi2html_server_config *get_server_config(server_rec *s) {
+    return (gmi2html_server_config *)ap_get_module_config(s->module_config,
+                                                           &gmi2html_module);
+}
+
 /* Create per-directory configuration */
 static void *create_dir_config(apr_pool_t *p, char *dir) {
     (void)dir;  /* Unused */
@@ -43,6 +95,13 @@ static void *create_dir_config(apr_pool_t *p, char *dir) {
     cfg->gemini_type = "text/gemini";
     cfg->stylesheet_path = NULL;  /* No custom stylesheet by default */
     cfg->head_file_path = NULL;    /* No custom head content by default */
+    cfg->includes = GMI2HTML_UNSET;  /* Include lines are plain text by default */
+    cfg->indexes = GMI2HTML_UNSET;   /* Directories are left to mod_autoindex by default */
+    cfg->feeds = GMI2HTML_UNSET;     /* No generated feeds by default */
+    cfg->search_index_path = NULL;   /* No search by default */
+    cfg->minify = GMI2HTML_UNSET;    /* Readable output by default */
+    cfg->prerender = GMI2HTML_UNSET; /* No speculative rendering by default */
+    cfg->prefetch = GMI2HTML_UNSET;  /* No prefetch hints by default */
     return cfg;
 }
 
@@ -56,10 +115,55 @@ static void *merge_dir_config(apr_pool_t *p, void *base_conf, void *new_conf) {
     merged->gemini_type = new->gemini_type ? new->gemini_type : base->gemini_type;
     merged->stylesheet_path = new->stylesheet_path ? new->stylesheet_path : base->stylesheet_path;
     merged->head_file_path = new->head_file_path ? new->head_file_path : base->head_file_path;
+    merged->includes = new->includes != GMI2HTML_UNSET ? new->includes : base->includes;
+    merged->indexes = new->indexes != GMI2HTML_UNSET ? new->indexes : base->indexes;
+    merged->feeds = new->feeds != GMI2HTML_UNSET ? new->feeds : base->feeds;
+    merged->search_index_path = new->search_index_path ?
+        new->search_index_path : base->search_index_path;
+    merged->minify = new->minify != GMI2HTML_UNSET ? new->minify : base->minify;
+    merged->prerender = new->prerender != GMI2HTML_UNSET ? new->prerender : base->prerender;
+    merged->prefetch = new->prefetch != GMI2HTML_UNSET ? new->prefetch : base->prefetch;
     
     return merged;
 }
 
+/* Create per-server configuration */
+static void *create_server_config(apr_pool_t *p, server_rec *s) {
+    (void)s;  /* Unused */
+    gmi2html_server_config *scfg = apr_pcalloc(p, sizeof(gmi2html_server_config));
+    scfg->cache_root = NULL;  /* Render cache disabled by default */
+    scfg->cache_max_size = -1;
+    scfg->cache_clean_interval = -1;
+    scfg->max_source_size = -1;    /* No size limit by default */
+    scfg->large_source_size = -1;
+    scfg->max_large_renders = -1;  /* No concurrency limit by default */
+    scfg->block_cache_size = -1;   /* Pages are rendered whole by default */
+    return scfg;
+}
+
+/* Merge per-server configuration (virtual host over main server) */
+static void *merge_server_config(apr_pool_t *p, void *base_conf, void *new_conf) {
+    gmi2html_server_config *base = (gmi2html_server_config *)base_conf;
+    gmi2html_server_config *new = (gmi2html_server_config *)new_conf;
+    gmi2html_server_config *merged = apr_pcalloc(p, sizeof(gmi2html_server_config));
+
+    merged->cache_root = new->cache_root ? new->cache_root : base->cache_root;
+    merged->cache_max_size = new->cache_max_size >= 0 ?
+        new->cache_max_size : base->cache_max_size;
+    merged->cache_clean_interval = new->cache_clean_interval >= 0 ?
+        new->cache_clean_interval : base->cache_clean_interval;
+    merged->max_source_size = new->max_source_size >= 0 ?
+        new->max_source_size : base->max_source_size;
+    merged->large_source_size = new->large_source_size >= 0 ?
+        new->large_source_size : base->large_source_size;
+    merged->max_large_renders = new->max_large_renders >= 0 ?
+        new->max_large_renders : base->max_large_renders;
+    merged->block_cache_size = new->block_cache_size >= 0 ?
+        new->block_cache_size : base->block_cache_size;
+
+    return merged;
+}
+
 /* Configuration directive: Gmi2HtmlEnabled on|off */
 static const char *set_gmi2html_enabled(cmd_parms *cmd, void *config, 
                                         const char *arg) {
@@ -95,6 +199,173 @@ static const char *set_gmi2html_head(cmd_parms *cmd, void *config,
     return NULL;
 }
 
+/* Configuration directive: Gmi2HtmlIncludes on|off */
+static const char *set_gmi2html_includes(cmd_parms *cmd, void *config, int flag) {
+    (void)cmd;  /* Unused */
+    gmi2html_config *cfg = (gmi2html_config *)config;
+    cfg->includes = flag;
+    return NULL;
+}
+
+/* Configuration directive: Gmi2HtmlIndexes on|off */
+static const char *set_gmi2html_indexes(cmd_parms *cmd, void *config, int flag) {
+    (void)cmd;  /* Unused */
+    gmi2html_config *cfg = (gmi2html_config *)config;
+    cfg->indexes = flag;
+    return NULL;
+}
+
+/* Configuration directive: Gmi2HtmlFeeds on|off */
+static const char *set_gmi2html_feeds(cmd_parms *cmd, void *config, int flag) {
+    (void)cmd;  /* Unused */
+    gmi2html_config *cfg = (gmi2html_config *)config;
+    cfg->feeds = flag;
+    return NULL;
+}
+
+/* Configuration directive: Gmi2HtmlMinify on|off */
+static const char *set_gmi2html_minify(cmd_parms *cmd, void *config, int flag) {
+    (void)cmd;  /* Unused */
+    gmi2html_config *cfg = (gmi2html_config *)config;
+    cfg->minify = flag;
+    return NULL;
+}
+
+/* Configuration directive: Gmi2HtmlPrerender <count> */
+static const char *set_gmi2html_prerender(cmd_parms *cmd, void *config, const char *arg) {
+    (void)cmd;  /* Unused */
+    gmi2html_config *cfg = (gmi2html_config *)config;
+    char *end;
+    apr_int64_t count = apr_strtoi64(arg, &end, 10);
+
+    if (*end || count < 0 || count > MAX_PRERENDER) {
+        return "Gmi2HtmlPrerender must be a number of links from 0 to 16";
+    }
+    cfg->prerender = (int)count;
+    return NULL;
+}
+
+/* Configuration directive: Gmi2HtmlPrefetchHints on|off */
+static const char *set_gmi2html_prefetch(cmd_parms *cmd, void *config, int flag) {
+    (void)cmd;  /* Unused */
+    gmi2html_config *cfg = (gmi2html_config *)config;
+    cfg->prefetch = flag;
+    return NULL;
+}
+
+/* Configuration directive: Gmi2HtmlSearchIndex <file> */
+static const char *set_gmi2html_search_index(cmd_parms *cmd, void *config,
+                                             const char *arg) {
+    gmi2html_config *cfg = (gmi2html_config *)config;
+    cfg->search_index_path = ap_server_root_relative(cmd->pool, arg);
+    if (!cfg->search_index_path) {
+        return apr_pstrcat(cmd->pool, "Invalid Gmi2HtmlSearchIndex path ", arg, NULL);
+    }
+    return NULL;
+}
+
+/* Configuration directive: Gmi2HtmlCacheRoot <directory> */
+static const char *set_gmi2html_cache_root(cmd_parms *cmd, void *config,
+                                           const char *arg) {
+    (void)config;  /* Unused */
+    gmi2html_server_config *scfg = get_server_config(cmd->server);
+    scfg->cache_root = ap_server_root_relative(cmd->pool, arg);
+    if (!scfg->cache_root) {
+        return apr_pstrcat(cmd->pool, "Invalid Gmi2HtmlCacheRoot path ", arg, NULL);
+    }
+    return NULL;
+}
+
+/* Configuration directive: Gmi2HtmlCacheMaxSize <bytes> */
+static const char *set_gmi2html_cache_max_size(cmd_parms *cmd, void *config,
+                                               const char *arg) {
+    (void)config;  /* Unused */
+    gmi2html_server_config *scfg = get_server_config(cmd->server);
+    char *end;
+
+    if (apr_strtoff(&scfg->cache_max_size, arg, &end, 10) != APR_SUCCESS ||
+        *end || scfg->cache_max_size < 0) {
+        return "Gmi2HtmlCacheMaxSize must be a size in bytes";
+    }
+    return NULL;
+}
+
+/* Configuration directive: Gmi2HtmlCacheCleanInterval <seconds> */
+static const char *set_gmi2html_cache_clean_interval(cmd_parms *cmd, void *config,
+                                                     const char *arg) {
+    (void)config;  /* Unused */
+    gmi2html_server_config *scfg = get_server_config(cmd->server);
+    char *end;
+    apr_int64_t seconds = apr_strtoi64(arg, &end, 10);
+
+    if (*end || seconds <= 0) {
+        return "Gmi2HtmlCacheCleanInterval must be a positive number of seconds";
+    }
+    scfg->cache_clean_interval = apr_time_from_sec(seconds);
+    return NULL;
+}
+
+/* Configuration directive: Gmi2HtmlMaxSourceSize <bytes> */
+static const char *set_gmi2html_max_source_size(cmd_parms *cmd, void *config,
+                                                const char *arg) {
+    (void)config;  /* Unused */
+    gmi2html_server_config *scfg = get_server_config(cmd->server);
+    char *end;
+
+    if (apr_strtoff(&scfg->max_source_size, arg, &end, 10) != APR_SUCCESS ||
+        *end || scfg->max_source_size < 0) {
+        return "Gmi2HtmlMaxSourceSize must be a size in bytes";
+    }
+    return NULL;
+}
+
+/* Configuration directive: Gmi2HtmlLargeSourceSize <bytes> */
+static const char *set_gmi2html_large_source_size(cmd_parms *cmd, void *config,
+                                                  const char *arg) {
+    (void)config;  /* Unused */
+    gmi2html_server_config *scfg = get_server_config(cmd->server);
+    char *end;
+
+    if (apr_strtoff(&scfg->large_source_size, arg, &end, 10) != APR_SUCCESS ||
+        *end || scfg->large_source_size < 0) {
+        return "Gmi2HtmlLargeSourceSize must be a size in bytes";
+    }
+    return NULL;
+}
+
+/* Configuration directive: Gmi2HtmlMaxLargeRenders <count> */
+static const char *set_gmi2html_max_large_renders(cmd_parms *cmd, void *config,
+                                                  const char *arg) {
+    (void)config;  /* Unused */
+    gmi2html_server_config *scfg = get_server_config(cmd->server);
+    char *end;
+    apr_int64_t count = apr_strtoi64(arg, &end, 10);
+
+    if (*end || count < 0 || count > 65535) {
+        return "Gmi2HtmlMaxLargeRenders must be a number of conversions (0 for no limit)";
+    }
+    scfg->max_large_renders = (int)count;
+    return NULL;
+}
+
+/* Configuration directive: Gmi2HtmlBlockCacheSize <bytes> */
+static const char *set_gmi2html_block_cache_size(cmd_parms *cmd, void *config,
+                                                 const char *arg) {
+    (void)config;  /* Unused */
+    gmi2html_server_config *scfg = get_server_config(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    char *end;
+
+    if (err) {
+        return err;
+    }
+    if (apr_strtoff(&scfg->block_cache_size, arg, &end, 10) != APR_SUCCESS ||
+        *end || scfg->block_cache_size < 0) {
+        return "Gmi2HtmlBlockCacheSize must be a size in bytes";
+    }
+    return NULL;
+}
+
 /* Configuration directives */
 static const command_rec gmi2html_directives[] = {
     AP_INIT_TAKE1("Gmi2HtmlEnabled", 
@@ -112,69 +383,468 @@ static const command_rec gmi2html_directives[] = {
                   NULL,
                   OR_OPTIONS,
                   "Path to custom <head> content file with meta tags, icons, etc. (optional)"),
+    AP_INIT_FLAG("Gmi2HtmlIncludes",
+                 set_gmi2html_includes,
+                 NULL,
+                 OR_OPTIONS,
+                 "Expand '%include <path>' lines with the rendered file (on|off)"),
+    AP_INIT_FLAG("Gmi2HtmlIndexes",
+                 set_gmi2html_indexes,
+                 NULL,
+                 OR_OPTIONS,
+                 "List directories without an index.gmi as gemtext (on|off)"),
+    AP_INIT_FLAG("Gmi2HtmlFeeds",
+                 set_gmi2html_feeds,
+                 NULL,
+                 OR_OPTIONS,
+                 "Serve an Atom feed of the dated links in index.gmi as " GMI2HTML_FEED_NAME " (on|off)"),
+    AP_INIT_FLAG("Gmi2HtmlMinify",
+                 set_gmi2html_minify,
+                 NULL,
+                 OR_OPTIONS,
+                 "Leave out whitespace between tags and minify the stylesheet (on|off)"),
+    AP_INIT_TAKE1("Gmi2HtmlPrerender",
+                  set_gmi2html_prerender,
+                  NULL,
+                  OR_OPTIONS,
+                  "Render this many linked local .gmi documents into the render cache after a page"),
+    AP_INIT_FLAG("Gmi2HtmlPrefetchHints",
+                 set_gmi2html_prefetch,
+                 NULL,
+                 OR_OPTIONS,
+                 "Add <link rel=\"prefetch\"> for the documents Gmi2HtmlPrerender selects (on|off)"),
+    AP_INIT_TAKE1("Gmi2HtmlSearchIndex",
+                  set_gmi2html_search_index,
+                  NULL,
+                  OR_OPTIONS,
+                  "Index file built by gmi2html-index, for the gmi2html-search handler"),
+    AP_INIT_TAKE1("Gmi2HtmlCacheRoot",
+                  set_gmi2html_cache_root,
+                  NULL,
+                  RSRC_CONF,
+                  "Directory for the persistent render cache (optional)"),
+    AP_INIT_TAKE1("Gmi2HtmlCacheMaxSize",
+                  set_gmi2html_cache_max_size,
+                  NULL,
+                  RSRC_CONF,
+                  "Maximum size of the render cache in bytes"),
+    AP_INIT_TAKE1("Gmi2HtmlCacheCleanInterval",
+                  set_gmi2html_cache_clean_interval,
+                  NULL,
+                  RSRC_CONF,
+                  "Seconds between render cache eviction runs"),
+    AP_INIT_TAKE1("Gmi2HtmlMaxSourceSize",
+                  set_gmi2html_max_source_size,
+                  NULL,
+                  RSRC_CONF,
+                  "Largest .gmi file in bytes that is converted to HTML"),
+    AP_INIT_TAKE1("Gmi2HtmlLargeSourceSize",
+                  set_gmi2html_large_source_size,
+                  NULL,
+                  RSRC_CONF,
+                  "Size in bytes from which a conversion counts as large"),
+    AP_INIT_TAKE1("Gmi2HtmlMaxLargeRenders",
+                  set_gmi2html_max_large_renders,
+                  NULL,
+                  RSRC_CONF,
+                  "Maximum concurrent large conversions per process (0 for no limit)"),
+    AP_INIT_TAKE1("Gmi2HtmlBlockCacheSize",
+                  set_gmi2html_block_cache_size,
+                  NULL,
+                  RSRC_CONF,
+                  "Bytes of rendered blocks each process keeps for re-rendering changed pages"),
     { NULL }
 };
 
-/* Handler for .gmi files */
-static int gmi2html_handler(request_rec *r) {
-    gmi2html_config *cfg = get_config(r);
+/* Stat an optional asset file; returns 1 if it is a readable regular file */
+static int stat_asset(apr_finfo_t *finfo, const char *path, apr_pool_t *p) {
+    return path &&
+           apr_stat(finfo, path, APR_FINFO_SIZE | APR_FINFO_MTIME, p) == APR_SUCCESS &&
+           finfo->filetype == APR_REG;
+}
+
+/* Read a whole file of known size into a NUL-terminated pool buffer */
+static char *read_file(const char *path, apr_off_t size, apr_pool_t *p) {
+    apr_file_t *file;
     
-    /* Only handle if enabled */
-    if (!cfg->enabled) {
-        return DECLINED;
+    if (apr_file_open(&file, path, APR_READ, APR_OS_DEFAULT, p) != APR_SUCCESS) {
+        return NULL;
     }
     
-    /* Only handle .gmi files */
-    if (strcmp(r->handler, "gmi2html") != 0 && 
-        apr_fnmatch("*.gmi", r->filename, 0) != APR_SUCCESS) {
-        return DECLINED;
+    char *content = apr_palloc(p, size + 1);
+    apr_size_t bytes_read;
+    
+    if (!content ||
+        apr_file_read_full(file, content, size, &bytes_read) != APR_SUCCESS ||
+        bytes_read != (apr_size_t)size) {
+        content = NULL;
+    } else {
+        content[size] = '\0';
     }
     
-    /* Check if file exists and is readable */
-    apr_finfo_t finfo;
-    if (apr_stat(&finfo, r->filename, APR_FINFO_SIZE, r->pool) != APR_SUCCESS) {
-        return HTTP_NOT_FOUND;
+    apr_file_close(file);
+    return content;
+}
+
+/* Add an asset's identity (path, size and mtime) to a cache key */
+static void cache_key_add_asset(apr_md5_ctx_t *ctx, const char *path,
+                                const apr_finfo_t *finfo, int present) {
+    if (!present) {
+        gmi2html_cache_key_add(ctx, NULL, 0);
+        return;
     }
+    gmi2html_cache_key_add(ctx, path, strlen(path));
+    gmi2html_cache_key_add(ctx, &finfo->size, sizeof(finfo->size));
+    gmi2html_cache_key_add(ctx, &finfo->mtime, sizeof(finfo->mtime));
+}
+
+/* Send an open file through the output filters (sendfile when possible);
+ * with flush set, it reaches the client before the handler returns */
+static int send_file(request_rec *r, apr_file_t *fd, apr_off_t size,
+                     const char *content_type, int flush) {
+    r->content_type = content_type;
+    ap_set_content_length(r, size);
     
-    if (finfo.filetype != APR_REG) {
-        return HTTP_NOT_FOUND;
+    if (r->header_only) {
+        return OK;
     }
     
-    /* Read the file */
-    apr_file_t *file;
-    apr_status_t status = apr_file_open(&file, r->filename, APR_READ, 
-                                        APR_OS_DEFAULT, r->pool);
-    if (status != APR_SUCCESS) {
-        return HTTP_FORBIDDEN;
+    apr_bucket_brigade *bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    apr_brigade_insert_file(bb, fd, 0, size, r->pool);
+    if (flush) {
+        APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_flush_create(r->connection->bucket_alloc));
     }
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(r->connection->bucket_alloc));
     
-    /* Allocate buffer for file content */
-    char *content = apr_palloc(r->pool, finfo.size + 1);
-    if (!content) {
-        apr_file_close(file);
-        return HTTP_INTERNAL_SERVER_ERROR;
+    return ap_pass_brigade(r->output_filters, bb) == APR_SUCCESS ? OK : AP_FILTER_ERROR;
+}
+
+/* Quality value the Accept header gives a media type, using the most
+ * specific matching range: exact type, then subtype wildcard, then full wildcard */
+static double accept_quality(apr_pool_t *p, const char *accept, const char *type) {
+    const char *slash = strchr(type, '/');
+    size_t major_len = slash ? (size_t)(slash - type) : strlen(type);
+    double quality = 0.0;
+    int best = -1;  /* Specificity of the best match so far */
+    
+    while (*accept) {
+        char *range = ap_getword(p, &accept, ',');
+        char *params = strchr(range, ';');
+        double q = 1.0;
+        int specificity;
+        
+        if (params) {
+            *params++ = '\0';
+            char *qparam = strstr(params, "q=");
+            if (qparam) {
+                q = atof(qparam + 2);
+            }
+        }
+        
+        /* Trim surrounding whitespace from the media range */
+        while (apr_isspace(*range)) range++;
+        char *end = range + strlen(range);
+        while (end > range && apr_isspace(end[-1])) *--end = '\0';
+        
+        /* The major type is compared first, so a range shorter than it
+           is never read past its end */
+        if (!strcasecmp(range, type)) {
+            specificity = 2;
+        } else if (!strncasecmp(range, type, major_len) &&
+                   !strcmp(range + major_len, "/*")) {
+            specificity = 1;
+        } else if (!strcmp(range, "*/*")) {
+            specificity = 0;
+        } else {
+            continue;
+        }
+        
+        if (specificity > best) {
+            best = specificity;
+            quality = q;
+        }
     }
     
-    /* Read file content */
-    apr_size_t bytes_read;
-    status = apr_file_read_full(file, content, finfo.size, &bytes_read);
-    apr_file_close(file);
+    return quality;
+}
+
+/* Whether the client prefers the Gemini source over converted HTML */
+static int prefers_gemini(request_rec *r, const char *gemini_type) {
+    const char *accept = apr_table_get(r->headers_in, "Accept");
+    
+    /* Browsers rank text/html and wildcards at least as high, so only an
+       explicit higher preference for text/gemini skips the conversion */
+    return accept &&
+           accept_quality(r->pool, accept, gemini_type) >
+           accept_quality(r->pool, accept, "text/html");
+}
+
+/* Streaming conversion state for one response */
+typedef struct {
+    request_rec *r;
+    apr_size_t sent;
+} stream_ctx;
+
+/* GeminiWriteFn passing converter output to the client */
+static int write_to_client(void *data, const char *buf, size_t len) {
+    stream_ctx *stream = (stream_ctx *)data;
+    
+    if (ap_rwrite(buf, len, stream->r) < 0) {
+        return -1;
+    }
+    stream->sent += len;
+    return 0;
+}
+
+/* Load the custom stylesheet and head content found by stat_asset
+ * (a NULL stylesheet falls back to the default, NULL head content is skipped) */
+static void load_assets(apr_pool_t *p, gmi2html_config *cfg, GeminiRenderOptions *options,
+                        const apr_finfo_t *style_finfo, int have_stylesheet,
+                        const apr_finfo_t *head_finfo, int have_head) {
+    if (cfg->minify == 1) {
+        /* Minified once per stylesheet version, not per request */
+        options->minify = 1;
+        options->stylesheet = gmi2html_style_minified(p,
+                                                      have_stylesheet ? cfg->stylesheet_path : NULL,
+                                                      style_finfo);
+    } else if (have_stylesheet) {
+        options->stylesheet = read_file(cfg->stylesheet_path, style_finfo->size, p);
+        GMI2HTML_TRACE2(asset_load, cfg->stylesheet_path, style_finfo->size);
+    }
+    if (have_head) {
+        options->custom_head = read_file(cfg->head_file_path, head_finfo->size, p);
+        GMI2HTML_TRACE2(asset_load, cfg->head_file_path, head_finfo->size);
+    }
+}
+
+/* Convert Gemini source and stream the HTML to the client as it is produced */
+static int stream_page(request_rec *r, const char *content, apr_size_t size,
+                       const char *title, const GeminiRenderOptions *options) {
+    stream_ctx stream = { r, 0 };
     
-    if (status != APR_SUCCESS || bytes_read != (apr_size_t)finfo.size) {
+    if (gemini_stream_html(content, size, title, options,
+                           write_to_client, &stream) != 0 && !stream.sent) {
         return HTTP_INTERNAL_SERVER_ERROR;
     }
+    return OK;
+}
+
+/* One conversion of a page for the render cache. Nothing in a job refers to
+ * the request except the include context, so a job without includes can be
+ * copied and run on the background thread. */
+typedef struct {
+    apr_pool_t *pool;
+    server_rec *server;            /* For logging */
+    const char *filename;          /* Source, as known to the render registry */
+    gmi2html_config *cfg;
+    const char *cache_root;        /* NULL if the render cache is off */
+    const char *content;
+    apr_size_t size;
+    const char *title;
+    const char *cache_key;
+    gmi2html_include_ctx *include_ctx;
+    apr_finfo_t style_finfo;
+    apr_finfo_t head_finfo;
+    int have_stylesheet;
+    int have_head;
+    apr_array_header_t *links;     /* Documents to pre-render (NULL if off) */
+    const char *prefetch;          /* Prefetch hints for the head (NULL if none) */
+    int large;                     /* Counted by gmi2html_flight_admit */
+} render_job;
+
+/* Whether converting a source of this size counts as a large conversion */
+static int is_large_source(gmi2html_server_config *scfg, apr_size_t size) {
+    apr_off_t large_size = scfg->large_source_size >= 0 ?
+        scfg->large_source_size : DEFAULT_LARGE_SOURCE_SIZE;
+    return (apr_off_t)size >= large_size;
+}
+
+/* <link rel="prefetch"> elements for the documents a page links to */
+static const char *prefetch_hints(apr_pool_t *p, const apr_array_header_t *links, int minify) {
+    apr_array_header_t *hints = apr_array_make(p, links->nelts, sizeof(const char *));
     
-    content[finfo.size] = '\0';
+    for (int i = 0; i < links->nelts; i++) {
+        APR_ARRAY_PUSH(hints, const char *) =
+            apr_pstrcat(p, minify ? "" : "  ", "<link rel=\"prefetch\" href=\"",
+                        ap_escape_html(p, APR_ARRAY_IDX(links, i, const char *)), "\">", NULL);
+    }
+    return apr_array_pstrcat(p, hints, minify ? 0 : '\n');
+}
+
+/* Stat the assets, pick the links and compute the render cache key of a job
+ * whose source, configuration and include context are set */
+static void prepare_render_job(render_job *job) {
+    gmi2html_config *cfg = job->cfg;
+    apr_pool_t *p = job->pool;
     
-    /* Parse Gemini document */
-    GeminiDocument *doc = gemini_parse(content, finfo.size);
-    if (!doc) {
-        return HTTP_INTERNAL_SERVER_ERROR;
+    /* Check custom stylesheet and head content (read only on a cache miss) */
+    job->have_stylesheet = stat_asset(&job->style_finfo, cfg->stylesheet_path, p);
+    job->have_head = stat_asset(&job->head_finfo, cfg->head_file_path, p);
+    
+    /* The links a reader is most likely to follow next */
+    if (cfg->prerender > 0) {
+        job->links = gmi2html_prerender_links(p, job->content, job->size, cfg->prerender);
+        if (cfg->prefetch == 1 && job->links->nelts) {
+            job->prefetch = prefetch_hints(p, job->links, cfg->minify == 1);
+        }
     }
     
+    if (job->cache_root) {
+        apr_md5_ctx_t ctx;
+        
+        gmi2html_cache_key_begin(&ctx);
+        gmi2html_cache_key_add(&ctx, job->content, job->size);
+        gmi2html_cache_key_add(&ctx, job->title, strlen(job->title));
+        cache_key_add_asset(&ctx, cfg->stylesheet_path, &job->style_finfo, job->have_stylesheet);
+        cache_key_add_asset(&ctx, cfg->head_file_path, &job->head_finfo, job->have_head);
+        gmi2html_cache_key_add(&ctx, cfg->minify == 1 ? "minify" : NULL, cfg->minify == 1 ? 6 : 0);
+        gmi2html_cache_key_add(&ctx, job->prefetch, job->prefetch ? strlen(job->prefetch) : 0);
+        gmi2html_cache_key_add(&ctx, job->include_ctx ? "includes" : NULL, job->include_ctx ? 8 : 0);
+        if (job->include_ctx) {
+            gmi2html_include_key_add(job->include_ctx, &ctx, job->content, job->size);
+        }
+        job->cache_key = gmi2html_cache_key_end(&ctx, p);
+    }
+}
+
+/* Set up the conversion of a page, with its render cache key if the cache is on */
+static render_job *make_render_job(request_rec *r, gmi2html_config *cfg, const char *content,
+                                   apr_size_t size, const char *title, int includes) {
+    render_job *job = apr_pcalloc(r->pool, sizeof(render_job));
+    
+    job->pool = r->pool;
+    job->server = r->server;
+    job->filename = r->filename;
+    job->cfg = cfg;
+    job->cache_root = get_server_config(r->server)->cache_root;
+    job->content = content;
+    job->size = size;
+    job->title = title;
+    
+    /* Included fragments are resolved relative to this page */
+    if (includes) {
+        job->include_ctx = gmi2html_include_ctx_make(r, cfg->minify == 1);
+    }
+    
+    prepare_render_job(job);
+    return job;
+}
+
+/* Copy of a directory configuration in another pool */
+static gmi2html_config *copy_config(apr_pool_t *p, const gmi2html_config *cfg) {
+    gmi2html_config *copy = apr_pmemdup(p, cfg, sizeof(gmi2html_config));
+    
+    copy->gemini_type = apr_pstrdup(p, cfg->gemini_type);
+    copy->stylesheet_path = apr_pstrdup(p, cfg->stylesheet_path);
+    copy->head_file_path = apr_pstrdup(p, cfg->head_file_path);
+    copy->search_index_path = apr_pstrdup(p, cfg->search_index_path);
+    return copy;
+}
+
+/* Copy of a job without includes in a pool of its own, for the background
+ * thread (NULL if the pool cannot be created) */
+static render_job *detach_render_job(const render_job *job) {
+    apr_pool_t *p;
+    
+    if (apr_pool_create(&p, NULL) != APR_SUCCESS) {
+        return NULL;
+    }
+    
+    render_job *copy = apr_pmemdup(p, job, sizeof(render_job));
+    copy->pool = p;
+    copy->filename = apr_pstrdup(p, job->filename);
+    copy->cfg = copy_config(p, job->cfg);
+    copy->cache_root = apr_pstrdup(p, job->cache_root);
+    copy->content = apr_pstrmemdup(p, job->content, job->size);
+    copy->title = apr_pstrdup(p, job->title);
+    copy->cache_key = apr_pstrdup(p, job->cache_key);
+    copy->links = NULL;
+    copy->prefetch = apr_pstrdup(p, job->prefetch);
+    return copy;
+}
+
+/* Fill in the render options of a job: assets, block cache, includes and prefetch hints */
+static void render_options(render_job *job, GeminiRenderOptions *options) {
+    load_assets(job->pool, job->cfg, options, &job->style_finfo, job->have_stylesheet,
+                &job->head_finfo, job->have_head);
+    gmi2html_blocks_attach(options);
+    if (job->include_ctx) {
+        options->include_resolver = gmi2html_include_resolve;
+        options->include_ctx = job->include_ctx;
+    }
+    if (job->prefetch) {
+        options->custom_head = options->custom_head ?
+            apr_pstrcat(job->pool, options->custom_head, job->cfg->minify == 1 ? "" : "\n",
+                        job->prefetch, NULL) :
+            job->prefetch;
+    }
+}
+
+/* Convert a page and store it in the render cache
+ * (returns the gemini_html_free'd HTML, or NULL if conversion failed) */
+static char *render_to_cache(render_job *job, int *stored) {
+    GeminiRenderOptions options = {0};
+    
+    *stored = 0;
+    render_options(job, &options);
+    
+    char *html = gemini_convert_to_html(job->content, job->size, job->title, &options);
+    if (!html) {
+        return NULL;
+    }
+    
+    /* Store for later requests; a failed write only costs a re-render */
+    apr_status_t status = gmi2html_cache_store(job->cache_root, job->cache_key,
+                                               html, strlen(html), job->pool);
+    if (status != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, status, job->server,
+                     "gmi2html: could not write render cache entry in %s",
+                     job->cache_root);
+    } else {
+        *stored = 1;
+    }
+    return html;
+}
+
+/* Background task rendering a page whose previous version was sent, so the
+ * new one is in the cache for later requests (job from detach_render_job) */
+static void refresh_page(void *data) {
+    render_job *job = (render_job *)data;
+    int stored;
+    
+    gemini_html_free(render_to_cache(job, &stored));
+    gmi2html_flight_release(job->filename, job->cache_key, stored);
+    if (job->large) {
+        gmi2html_flight_leave();
+    }
+    apr_pool_destroy(job->pool);
+}
+
+/* Queue the render of a claimed page for the background thread; returns 0
+ * if it could not be queued (the caller still holds the claim) */
+static int queue_refresh(const render_job *job) {
+    render_job *copy = detach_render_job(job);
+    
+    if (!copy) {
+        return 0;
+    }
+    if (!gmi2html_background_queue(refresh_page, copy)) {
+        apr_pool_destroy(copy->pool);
+        return 0;
+    }
+    return 1;
+}
+
+/* Whether a request maps to a Gemini file for this module */
+static int is_gemini_file(request_rec *r) {
+    return (r->handler && !strcmp(r->handler, "gmi2html")) ||
+           apr_fnmatch("*.gmi", r->filename, 0) == APR_SUCCESS;
+}
+
+/* Title of a page without a # heading */
+static const char *page_title(apr_pool_t *p, const char *filename) {
     /* Extract title from filename */
-    const char *filename = apr_pstrdup(r->pool, r->filename);
-    char *title = apr_pstrdup(r->pool, filename);
+    char *title = apr_pstrdup(p, filename);
     
     /* Get basename */
     char *slash = strrchr(title, '/');
@@ -188,97 +858,603 @@ static int gmi2html_handler(request_rec *r) {
         *dot = '\0';
     }
     
-    /* Load custom stylesheet if configured */
-    char *custom_stylesheet = NULL;
-    if (cfg->stylesheet_path) {
-        apr_file_t *style_file;
-        apr_finfo_t style_finfo;
+    return title;
+}
+
+/* A linked document to render on the background thread (in a pool of its own) */
+typedef struct {
+    apr_pool_t *pool;
+    server_rec *server;
+    gmi2html_config *cfg;          /* Copy of the document's configuration */
+    const char *filename;
+    apr_finfo_t finfo;             /* Size and mtime when it was looked up */
+} prerender_task;
+
+/* Render a linked document into the render cache, as a request for it would */
+static int prerender_file(prerender_task *task) {
+    gmi2html_server_config *scfg = get_server_config(task->server);
+    char *content = read_file(task->filename, task->finfo.size, task->pool);
+    
+    if (!content) {
+        return 0;
+    }
+    
+    render_job *job = apr_pcalloc(task->pool, sizeof(render_job));
+    job->pool = task->pool;
+    job->server = task->server;
+    job->filename = task->filename;
+    job->cfg = task->cfg;
+    job->cache_root = scfg->cache_root;
+    job->content = content;
+    job->size = task->finfo.size;
+    job->title = page_title(task->pool, task->filename);
+    prepare_render_job(job);
+    
+    apr_file_t *cached;
+    apr_off_t cached_size;
+    const char *stale_key;
+    int stored = 0;
+    
+    if (gmi2html_cache_open(&cached, &cached_size, job->cache_root,
+                            job->cache_key, job->pool) == APR_SUCCESS) {
+        apr_file_close(cached);
+        return 1;
+    }
+    if (!gmi2html_flight_claim(job->pool, job->filename, job->cache_key, &stale_key)) {
+        return 0;
+    }
+    
+    /* Speculative work gives way when the large conversion slots are in use */
+    job->large = is_large_source(scfg, job->size);
+    if (job->large && !gmi2html_flight_admit(scfg->max_large_renders)) {
+        gmi2html_flight_release(job->filename, job->cache_key, 0);
+        return 0;
+    }
+    
+    gemini_html_free(render_to_cache(job, &stored));
+    gmi2html_flight_release(job->filename, job->cache_key, stored);
+    if (job->large) {
+        gmi2html_flight_leave();
+    }
+    return stored;
+}
+
+/* Background task pre-rendering a linked document */
+static void prerender_in_background(void *data) {
+    prerender_task *task = (prerender_task *)data;
+    
+    gmi2html_prerender_done(task->filename, &task->finfo, prerender_file(task));
+    apr_pool_destroy(task->pool);
+}
+
+/* Queue a linked document for pre-rendering, if a request for it would
+ * get a page this module renders */
+static void prerender_link(request_rec *r, const char *url) {
+    /* The lookup applies the document's own configuration and access rules */
+    request_rec *rr = ap_sub_req_lookup_uri(url, r, NULL);
+    gmi2html_config *cfg = get_config(rr);
+    gmi2html_server_config *scfg = get_server_config(rr->server);
+    apr_pool_t *p;
+    
+    /* Includes are resolved as subrequests, so only a request can render them */
+    if (rr->status != HTTP_OK || rr->finfo.filetype != APR_REG ||
+        !cfg->enabled || !is_gemini_file(rr) || !scfg->cache_root || cfg->includes == 1 ||
+        (scfg->max_source_size >= 0 && rr->finfo.size > scfg->max_source_size) ||
+        !gmi2html_prerender_due(rr->filename, &rr->finfo)) {
+        ap_destroy_sub_req(rr);
+        return;
+    }
+    
+    if (apr_pool_create(&p, NULL) == APR_SUCCESS) {
+        prerender_task *task = apr_pcalloc(p, sizeof(prerender_task));
+        task->pool = p;
+        task->server = rr->server;
+        task->cfg = copy_config(p, cfg);
+        task->filename = apr_pstrdup(p, rr->filename);
+        task->finfo = rr->finfo;
         
-        /* Check if stylesheet file exists and is readable */
-        if (apr_stat(&style_finfo, cfg->stylesheet_path, APR_FINFO_SIZE, r->pool) == APR_SUCCESS &&
-            style_finfo.filetype == APR_REG) {
-            
-            /* Try to open and read the stylesheet */
-            if (apr_file_open(&style_file, cfg->stylesheet_path, APR_READ, 
-                            APR_OS_DEFAULT, r->pool) == APR_SUCCESS) {
-                
-                custom_stylesheet = apr_palloc(r->pool, style_finfo.size + 1);
-                apr_size_t style_bytes_read;
-                
-                if (custom_stylesheet &&
-                    apr_file_read_full(style_file, custom_stylesheet, style_finfo.size, 
-                                     &style_bytes_read) == APR_SUCCESS &&
-                    style_bytes_read == (apr_size_t)style_finfo.size) {
-                    custom_stylesheet[style_finfo.size] = '\0';
-                } else {
-                    custom_stylesheet = NULL;  /* Failed to read, use default */
-                }
-                
-                apr_file_close(style_file);
-            }
+        if (gmi2html_background_queue(prerender_in_background, task)) {
+            ap_destroy_sub_req(rr);
+            return;
         }
+        apr_pool_destroy(p);
     }
     
-    /* Load custom head content if configured */
-    char *custom_head = NULL;
-    if (cfg->head_file_path) {
-        apr_file_t *head_file;
-        apr_finfo_t head_finfo;
+    /* Not queued: due again the next time a page links to it */
+    gmi2html_prerender_done(rr->filename, &rr->finfo, 0);
+    ap_destroy_sub_req(rr);
+}
+
+/* Whether linked documents are looked up once the page is sent */
+static int prerender_follows(const render_job *job) {
+    return job->links && job->links->nelts && job->cache_root;
+}
+
+/* Send a page, from the render cache when possible */
+static int send_page(request_rec *r, render_job *job) {
+    gmi2html_server_config *scfg = get_server_config(r->server);
+    
+    /* The link lookups after the page must not hold it back */
+    int flush = prerender_follows(job);
+    
+    /* Large sources are rendered in the background when an older version
+       can be sent meanwhile, and only so many at once; pages with includes
+       need the request to render, so they never are */
+    int large = is_large_source(scfg, job->size);
+    int deferrable = large && !job->include_ctx;
+    int claimed = 0;
+    
+    /* Serve from the render cache if this exact output was rendered before */
+    if (job->cache_key) {
+        apr_file_t *cached;
+        apr_off_t cached_size;
+        
+        if (gmi2html_cache_open(&cached, &cached_size, scfg->cache_root,
+                                job->cache_key, r->pool) == APR_SUCCESS) {
+            GMI2HTML_TRACE2(cache_hit, r->filename, job->cache_key);
+            gmi2html_flight_seen(r->filename, job->cache_key);
+            return send_file(r, cached, cached_size, "text/html; charset=utf-8", flush);
+        }
+        
+        /* Only one thread renders a given output; the others get the
+           previous version of the page, or wait for the new one */
+        const char *stale_key;
+        claimed = gmi2html_flight_claim(r->pool, r->filename, job->cache_key, &stale_key);
         
-        /* Check if head file exists and is readable */
-        if (apr_stat(&head_finfo, cfg->head_file_path, APR_FINFO_SIZE, r->pool) == APR_SUCCESS &&
-            head_finfo.filetype == APR_REG) {
-            
-            /* Try to open and read the head file */
-            if (apr_file_open(&head_file, cfg->head_file_path, APR_READ, 
-                            APR_OS_DEFAULT, r->pool) == APR_SUCCESS) {
-                
-                custom_head = apr_palloc(r->pool, head_finfo.size + 1);
-                apr_size_t head_bytes_read;
-                
-                if (custom_head &&
-                    apr_file_read_full(head_file, custom_head, head_finfo.size, 
-                                     &head_bytes_read) == APR_SUCCESS &&
-                    head_bytes_read == (apr_size_t)head_finfo.size) {
-                    custom_head[head_finfo.size] = '\0';
+        /* The previous version is sent only while the new one is rendered
+           elsewhere or, for a large source, in the background */
+        if (!stale_key || (claimed && !deferrable) ||
+            gmi2html_cache_open(&cached, &cached_size, scfg->cache_root,
+                                stale_key, r->pool) != APR_SUCCESS) {
+            stale_key = NULL;
+        }
+        
+        if (!claimed && !stale_key) {
+            gmi2html_flight_wait(r->filename, job->cache_key);
+            if (gmi2html_cache_open(&cached, &cached_size, scfg->cache_root,
+                                    job->cache_key, r->pool) == APR_SUCCESS) {
+                GMI2HTML_TRACE2(cache_hit, r->filename, job->cache_key);
+                return send_file(r, cached, cached_size, "text/html; charset=utf-8", flush);
+            }
+            /* The other render failed or is slow: convert here as well */
+        } else if (stale_key) {
+            if (claimed) {
+                if (!gmi2html_flight_admit(scfg->max_large_renders)) {
+                    /* Left for a later request when a conversion slot is free */
+                    gmi2html_flight_release(r->filename, job->cache_key, 0);
                 } else {
-                    custom_head = NULL;  /* Failed to read, skip custom head */
+                    job->large = 1;
+                    if (!queue_refresh(job)) {
+                        /* No room on the background thread: render here instead */
+                        apr_file_close(cached);
+                        stale_key = NULL;
+                    }
                 }
-                
-                apr_file_close(head_file);
             }
+            if (stale_key) {
+                GMI2HTML_TRACE2(cache_stale, r->filename, stale_key);
+                return send_file(r, cached, cached_size, "text/html; charset=utf-8", flush);
+            }
+        }
+    }
+    
+    /* Refuse a large conversion while the process has enough of them */
+    if (large && !job->large) {
+        if (!gmi2html_flight_admit(scfg->max_large_renders)) {
+            if (claimed) {
+                gmi2html_flight_release(r->filename, job->cache_key, 0);
+            }
+            ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r,
+                          "gmi2html: %d large conversions in progress, "
+                          "not converting %s", scfg->max_large_renders, r->filename);
+            apr_table_setn(r->err_headers_out, "Retry-After", LARGE_RENDER_RETRY_AFTER);
+            return HTTP_SERVICE_UNAVAILABLE;
+        }
+        job->large = 1;
+    }
+    
+    r->content_type = "text/html; charset=utf-8";
+    
+    /* Without a cache there is nothing to keep, so stream the page out */
+    if (!job->cache_key) {
+        GeminiRenderOptions options = {0};
+        render_options(job, &options);
+        int status = stream_page(r, job->content, job->size, job->title, &options);
+        if (job->large) {
+            gmi2html_flight_leave();
         }
+        return status;
     }
     
-    /* Convert to HTML with optional custom stylesheet and custom head content */
-    char *html = gemini_to_html_with_stylesheet_and_head(doc, title, custom_stylesheet, custom_head);
+    int stored;
+    char *html = render_to_cache(job, &stored);
+    if (claimed) {
+        gmi2html_flight_release(r->filename, job->cache_key, stored);
+    }
+    if (job->large) {
+        gmi2html_flight_leave();
+    }
     if (!html) {
-        gemini_document_free(doc);
         return HTTP_INTERNAL_SERVER_ERROR;
     }
     
+    size_t html_len = strlen(html);
+    
     /* Set response headers */
-    r->content_type = "text/html; charset=utf-8";
-    ap_set_content_length(r, strlen(html));
+    ap_set_content_length(r, html_len);
     
     /* Send the HTML response */
     /* Note: ap_send_http_header is deprecated in Apache 2.4+
        Headers are sent automatically, just write the body */
     if (!r->header_only) {
-        ap_rputs(html, r);
+        ap_rwrite(html, html_len, r);
+        if (flush) {
+            ap_rflush(r);
+        }
     }
     
     /* Cleanup */
     gemini_html_free(html);
-    gemini_document_free(doc);
     
     return OK;
 }
 
+/* Send Gemini source as an HTML page, then queue the documents it links to
+ * (the page is flushed first, so the client does not wait for the lookups) */
+static int render_page(request_rec *r, gmi2html_config *cfg, const char *content,
+                       apr_size_t size, const char *title, int includes) {
+    render_job *job = make_render_job(r, cfg, content, size, title, includes);
+    int status = send_page(r, job);
+    
+    if (status == OK && prerender_follows(job)) {
+        for (int i = 0; i < job->links->nelts; i++) {
+            prerender_link(r, APR_ARRAY_IDX(job->links, i, const char *));
+        }
+    }
+    return status;
+}
+
+/* Convert (or pass through) the requested .gmi file */
+static int serve_gemini_file(request_rec *r, gmi2html_config *cfg) {
+    /* Check if file exists and is readable */
+    apr_finfo_t finfo;
+    if (apr_stat(&finfo, r->filename, APR_FINFO_SIZE, r->pool) != APR_SUCCESS) {
+        return HTTP_NOT_FOUND;
+    }
+    
+    if (finfo.filetype != APR_REG) {
+        return HTTP_NOT_FOUND;
+    }
+    
+    /* The response depends on Accept, so shared caches must key on it */
+    apr_table_mergen(r->headers_out, "Vary", "Accept");
+    
+    /* Gemini-aware clients get the source file as-is, without conversion */
+    if (prefers_gemini(r, cfg->gemini_type)) {
+        apr_file_t *source;
+        if (apr_file_open(&source, r->filename, APR_READ | APR_BINARY | APR_SENDFILE_ENABLED,
+                          APR_OS_DEFAULT, r->pool) != APR_SUCCESS) {
+            return HTTP_FORBIDDEN;
+        }
+        return send_file(r, source, finfo.size, cfg->gemini_type, 0);
+    }
+    
+    /* Sources over the limit are never read, let alone converted; the limit is
+       the server's, not the client's fault, and lasts until it is raised */
+    gmi2html_server_config *scfg = get_server_config(r->server);
+    if (scfg->max_source_size >= 0 && finfo.size > scfg->max_source_size) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                      "gmi2html: %s (%" APR_OFF_T_FMT " bytes) is larger than "
+                      "Gmi2HtmlMaxSourceSize (%" APR_OFF_T_FMT " bytes), not converting",
+                      r->filename, finfo.size, scfg->max_source_size);
+        ap_custom_response(r, HTTP_INTERNAL_SERVER_ERROR,
+                           "This page is too large to be shown as HTML.\n");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    
+    /* Read the file */
+    char *content = read_file(r->filename, finfo.size, r->pool);
+    if (!content) {
+        return HTTP_FORBIDDEN;
+    }
+    GMI2HTML_TRACE2(file_read, r->filename, finfo.size);
+    
+    return render_page(r, cfg, content, finfo.size, page_title(r->pool, r->filename),
+                       cfg->includes == 1);
+}
+
+/* List a directory that has no index.gmi */
+static int serve_directory_index(request_rec *r, gmi2html_config *cfg) {
+    apr_finfo_t finfo;
+    apr_size_t len;
+    
+    /* mod_dir redirects to the trailing slash and serves index.gmi when it
+       is a DirectoryIndex; neither is ours to do */
+    if (r->uri[0] == '\0' || r->uri[strlen(r->uri) - 1] != '/' ||
+        apr_stat(&finfo, apr_pstrcat(r->pool, r->filename, "index.gmi", NULL),
+                 APR_FINFO_TYPE, r->pool) == APR_SUCCESS) {
+        return DECLINED;
+    }
+    
+    const char *listing = gmi2html_index_listing(r, &len);
+    if (!listing) {
+        return HTTP_FORBIDDEN;
+    }
+    
+    apr_table_mergen(r->headers_out, "Vary", "Accept");
+    
+    if (prefers_gemini(r, cfg->gemini_type)) {
+        r->content_type = cfg->gemini_type;
+        ap_set_content_length(r, len);
+        if (!r->header_only) {
+            ap_rwrite(listing, len, r);
+        }
+        return OK;
+    }
+    
+    return render_page(r, cfg, listing, len, r->uri, 0);
+}
+
+/* Whether the request is for the generated feed of a gemlog directory */
+static int is_feed_request(request_rec *r) {
+    const char *slash = strrchr(r->filename, '/');
+    
+    /* A real file of that name is served as it is */
+    return r->finfo.filetype == APR_NOFILE && slash &&
+           !strcmp(slash + 1, GMI2HTML_FEED_NAME);
+}
+
+/* Send the Atom feed built from the directory's index.gmi */
+static int serve_feed(request_rec *r) {
+    const char *index_path = apr_pstrcat(r->pool, ap_make_dirstr_parent(r->pool, r->filename),
+                                         "index.gmi", NULL);
+    const char *origin = ap_construct_url(r->pool, "", r);
+    
+    const gmi2html_feed *feed = gmi2html_feed_get(r, index_path, ap_document_root(r),
+                                                  origin, ap_make_dirstr_parent(r->pool, r->uri));
+    if (!feed) {
+        return HTTP_NOT_FOUND;
+    }
+    
+    /* Validators let polling feed readers get a 304 */
+    r->content_type = "application/atom+xml";
+    apr_table_setn(r->headers_out, "ETag", feed->etag);
+    ap_update_mtime(r, feed->mtime);
+    ap_set_last_modified(r);
+    
+    int status = ap_meets_conditions(r);
+    if (status != OK) {
+        return status;
+    }
+    
+    ap_set_content_length(r, feed->len);
+    if (!r->header_only) {
+        ap_rwrite(feed->xml, feed->len, r);
+    }
+    return OK;
+}
+
+/* Include resolver for results pages; ctx is the search form's HTML */
+static const char *resolve_search_form(void *ctx, const char *path) {
+    return strcmp(path, GMI2HTML_QUERY_FORM) ? NULL : (const char *)ctx;
+}
+
+/* The q parameter of the query string, decoded ("" if absent) */
+static const char *search_words(request_rec *r) {
+    const char *args = r->args;
+    
+    while (args && *args) {
+        char *pair = ap_getword(r->pool, &args, '&');
+        char *value = strchr(pair, '=');
+        
+        if (value && value - pair == 1 && pair[0] == 'q') {
+            value++;
+            return ap_unescape_urlencoded(value) == OK ? value : "";
+        }
+    }
+    return "";
+}
+
+/* Search the configured index and send the results page */
+static int serve_search(request_rec *r, gmi2html_config *cfg) {
+    apr_size_t len;
+    
+    if (!cfg->search_index_path) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                      "gmi2html: gmi2html-search handler without Gmi2HtmlSearchIndex");
+        return HTTP_NOT_FOUND;
+    }
+    
+    apr_table_mergen(r->headers_out, "Vary", "Accept");
+    int gemini = prefers_gemini(r, cfg->gemini_type);
+    
+    const char *query = search_words(r);
+    const char *page = gmi2html_query_page(r, cfg->search_index_path, query,
+                                           !gemini, &len);
+    if (!page) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                      "gmi2html: cannot open search index %s", cfg->search_index_path);
+        return HTTP_SERVICE_UNAVAILABLE;
+    }
+    
+    if (gemini) {
+        r->content_type = cfg->gemini_type;
+        ap_set_content_length(r, len);
+        if (!r->header_only) {
+            ap_rwrite(page, len, r);
+        }
+        return OK;
+    }
+    
+    /* Every query is different, so results bypass the render cache */
+    apr_finfo_t style_finfo, head_finfo;
+    int have_stylesheet = stat_asset(&style_finfo, cfg->stylesheet_path, r->pool);
+    int have_head = stat_asset(&head_finfo, cfg->head_file_path, r->pool);
+    
+    GeminiRenderOptions options = {0};
+    load_assets(r->pool, cfg, &options, &style_finfo, have_stylesheet, &head_finfo, have_head);
+    options.include_resolver = resolve_search_form;
+    options.include_ctx = apr_pstrcat(r->pool,
+        "<form class=\"gemini-search\" action=\"\" method=\"get\" role=\"search\">"
+        "<input type=\"search\" name=\"q\" value=\"", ap_escape_html(r->pool, query),
+        "\" aria-label=\"Search\"> <button type=\"submit\">Search</button></form>\n", NULL);
+    r->content_type = "text/html; charset=utf-8";
+    
+    return stream_page(r, page, len, "Search", &options);
+}
+
+/* Handler for .gmi files, search pages and, with Gmi2HtmlIndexes, directories */
+static int gmi2html_handler(request_rec *r) {
+    gmi2html_config *cfg = get_config(r);
+    
+    /* Only handle if enabled */
+    if (!cfg->enabled) {
+        return DECLINED;
+    }
+    
+    /* Search pages are set up with SetHandler, whatever the URL maps to */
+    if (!strcmp(r->handler, "gmi2html-search")) {
+        GMI2HTML_TRACE1(request_start, r->uri);
+        int status = serve_search(r, cfg);
+        GMI2HTML_TRACE2(request_end, r->uri, status);
+        return status;
+    }
+    
+    if (r->finfo.filetype == APR_DIR) {
+        if (cfg->indexes != 1 || strcmp(r->handler, DIR_MAGIC_TYPE) != 0) {
+            return DECLINED;
+        }
+        GMI2HTML_TRACE1(request_start, r->filename);
+        int status = serve_directory_index(r, cfg);
+        GMI2HTML_TRACE2(request_end, r->filename, status);
+        return status;
+    }
+    
+    if (cfg->feeds == 1 && is_feed_request(r)) {
+        GMI2HTML_TRACE1(request_start, r->filename);
+        int status = serve_feed(r);
+        GMI2HTML_TRACE2(request_end, r->filename, status);
+        return status;
+    }
+    
+    /* Only handle .gmi files */
+    if (!is_gemini_file(r)) {
+        return DECLINED;
+    }
+    
+    GMI2HTML_TRACE1(request_start, r->filename);
+    int status = serve_gemini_file(r, cfg);
+    GMI2HTML_TRACE2(request_end, r->filename, status);
+    
+    return status;
+}
+
+/* Periodic render cache eviction, run by the parent process */
+static int gmi2html_monitor(apr_pool_t *p, server_rec *s) {
+    apr_time_t now = apr_time_now();
+    
+    for (; s; s = s->next) {
+        gmi2html_server_config *scfg = get_server_config(s);
+        
+        if (!scfg->cache_root) {
+            continue;
+        }
+        
+        apr_interval_time_t interval = scfg->cache_clean_interval >= 0 ?
+            scfg->cache_clean_interval : apr_time_from_sec(DEFAULT_CACHE_CLEAN_INTERVAL);
+        if (now - scfg->cache_last_clean < interval) {
+            continue;
+        }
+        scfg->cache_last_clean = now;
+        
+        apr_pool_t *scratch;
+        if (apr_pool_create(&scratch, p) != APR_SUCCESS) {
+            continue;
+        }
+        
+        apr_off_t max_size = scfg->cache_max_size >= 0 ?
+            scfg->cache_max_size : DEFAULT_CACHE_MAX_SIZE;
+        apr_status_t status = gmi2html_cache_clean(scfg->cache_root, max_size, scratch);
+        if (status != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, status, s,
+                         "gmi2html: render cache cleanup of %s failed",
+                         scfg->cache_root);
+        }
+        
+        apr_pool_destroy(scratch);
+    }
+    
+    return DECLINED;
+}
+
+/* Per-process setup of in-memory caches */
+static void gmi2html_child_init(apr_pool_t *p, server_rec *s) {
+    apr_status_t status = gmi2html_include_child_init(p);
+    if (status != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, status, s,
+                     "gmi2html: include fragment cache disabled");
+    }
+    
+    status = gmi2html_index_child_init(p);
+    if (status != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, status, s,
+                     "gmi2html: directory listing cache disabled");
+    }
+    
+    status = gmi2html_feed_child_init(p);
+    if (status != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, status, s,
+                     "gmi2html: feed cache disabled");
+    }
+    
+    status = gmi2html_query_child_init(p);
+    if (status != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, status, s,
+                     "gmi2html: search indexes will be mapped per request");
+    }
+    
+    status = gmi2html_style_child_init(p);
+    if (status != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, status, s,
+                     "gmi2html: minified stylesheet cache disabled");
+    }
+    
+    gmi2html_server_config *scfg = get_server_config(s);
+    status = gmi2html_blocks_child_init(p, scfg->block_cache_size > 0 ?
+                                           (apr_size_t)scfg->block_cache_size : 0);
+    if (status != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, status, s,
+                     "gmi2html: rendered block cache disabled");
+    }
+    
+    status = gmi2html_prerender_child_init(p);
+    if (status != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, status, s,
+                     "gmi2html: linked documents will be checked after every page");
+    }
+    
+    status = gmi2html_flight_child_init(p);
+    if (status != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, status, s,
+                     "gmi2html: single-flight rendering and large conversion limits disabled");
+    }
+    
+    status = gmi2html_background_child_init(p);
+    if (status != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, status, s,
+                     "gmi2html: no background thread, linked documents will not be pre-rendered");
+    }
+}
+
 /* Register hooks */
 static void gmi2html_register_hooks(apr_pool_t *p) {
+    /* Directory listings must be offered before mod_autoindex's */
+    static const char *const handler_succ[] = { "mod_autoindex.c", NULL };
+    
     (void)p;  /* Unused */
-    ap_hook_handler(gmi2html_handler, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(gmi2html_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_handler(gmi2html_handler, NULL, handler_succ, APR_HOOK_MIDDLE);
+    ap_hook_monitor(gmi2html_monitor, NULL, NULL, APR_HOOK_MIDDLE);
 }
 
 /* Module definition */
@@ -286,8 +1462,8 @@ module AP_MODULE_DECLARE_DATA gmi2html_module = {
     STANDARD20_MODULE_STUFF,
     create_dir_config,    /* Per-directory config creator */
     merge_dir_config,     /* Per-directory config merger */
-    NULL,                 /* Per-server config creator */
-    NULL,                 /* Per-server config merger */
+    create_server_config, /* Per-server config creator */
+    merge_server_config,  /* Per-server config merger */
     gmi2html_directives,  /* Command table */
     gmi2html_register_hooks, /* Register hooks */
     0                     /* flags */